@@ -0,0 +1,65 @@
+/**
+ * Object allocation benchmark: VM heap vs global operator new, on
+ * several threads.
+ *
+ *   make bench && ./bin/alloc-bench
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/vm/ChrisVM.h"
+
+/**
+ * Objects allocated per thread.
+ */
+#define OBJECTS 1000000
+
+/**
+ * Runs the function on the threads and reports ns per object.
+ */
+template <typename Fn>
+void bench(const std::string& name, size_t threadsCount, Fn fn) {
+    std::vector<std::thread> threads;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < threadsCount; i++) {
+        threads.emplace_back(fn);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << name << " (" << threadsCount << " threads): "
+        << elapsed.count() * 1e9 / OBJECTS << " ns/object\n";
+}
+
+int main(int argc, char const *argv[]) {
+    for (size_t threadsCount : {1, 4}) {
+        // Allocate, then release all objects (as at VM teardown).
+        bench("heap", threadsCount, []() {
+            Heap heap;
+            HeapScope heapScope(&heap);
+            for (size_t i = 0; i < OBJECTS; i++) {
+                allocObject<FunctionObject>(nullptr);
+            }
+        });
+
+        bench("operator new", threadsCount, []() {
+            std::vector<FunctionObject*> objects;
+            objects.reserve(OBJECTS);
+            for (size_t i = 0; i < OBJECTS; i++) {
+                objects.push_back(new FunctionObject(nullptr));
+            }
+            for (auto object : objects) {
+                delete object;
+            }
+        });
+    }
+
+    return 0;
+}
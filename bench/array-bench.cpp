@@ -0,0 +1,84 @@
+/**
+ * Array benchmark: bulk opcodes vs per-element bytecode vs native C++.
+ *
+ *   make bench && ./bin/array-bench
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../src/vm/ChrisVM.h"
+
+/**
+ * Number of array elements.
+ */
+#define ELEMENTS 1000000
+
+/**
+ * Runs the function `repeat` times and reports ns per element.
+ */
+template <typename Fn>
+void bench(const std::string& name, size_t repeat, Fn fn) {
+    std::string result;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeat; i++) {
+        result = fn();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << name << " = " << result << ": "
+        << elapsed.count() * 1e9 / (repeat * ELEMENTS) << " ns/element\n";
+}
+
+int main(int argc, char const *argv[]) {
+    ChrisVM vm;
+
+    vm.run(vm.compile("(var a (make-array 1000000 3))"));
+    vm.run(vm.compile("(var b (make-array 1000000 2))"));
+
+    // Per-element loop over the array in bytecode.
+    vm.run(vm.compile(R"(
+        (def sum-loop (i n acc)
+            (if (== i n)
+                acc
+                (sum-loop (+ i 1) n (+ acc (array-get a i)))))
+    )"));
+
+    auto sum = vm.compile("(array-sum a)");
+    auto sumLoop = vm.compile("(sum-loop 0 (array-length a) 0)");
+    auto dot = vm.compile("(array-dot a b)");
+    auto add = vm.compile("(array-length (array-add a 1))");
+
+    bench("array-sum", 100, [&]() {
+        return chrisValueToConstantString(vm.run(sum));
+    });
+
+    bench("sum-loop (bytecode)", 3, [&]() {
+        return chrisValueToConstantString(vm.run(sumLoop));
+    });
+
+    bench("array-dot", 100, [&]() {
+        return chrisValueToConstantString(vm.run(dot));
+    });
+
+    // Allocates a new array per run (not collected).
+    bench("array-add", 10, [&]() {
+        return chrisValueToConstantString(vm.run(add));
+    });
+
+    // Native baseline.
+    std::vector<double> numbers(ELEMENTS, 3);
+
+    bench("native sum", 100, [&]() {
+        double result = 0;
+        for (auto number : numbers) {
+            result += number;
+        }
+        return std::to_string(result);
+    });
+
+    return 0;
+}
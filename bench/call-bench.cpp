@@ -0,0 +1,153 @@
+/**
+ * Function call benchmark (recursive fib and ackermann, tail-recursive loop,
+ * integer arithmetic, closures, natives).
+ *
+ *   make bench && ./bin/call-bench
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../src/vm/ChrisVM.h"
+
+/**
+ * Number of calls made by fib(n) and ack(m, n) (computed natively).
+ */
+size_t fibCalls(int n) {
+    return n < 2 ? 1 : 1 + fibCalls(n - 1) + fibCalls(n - 2);
+}
+
+size_t ackCalls(int m, int n, int& result) {
+    if (m == 0) {
+        result = n + 1;
+        return 1;
+    }
+    if (n == 0) {
+        return 1 + ackCalls(m - 1, 1, result);
+    }
+    int inner;
+    auto calls = 1 + ackCalls(m, n - 1, inner);
+    return calls + ackCalls(m - 1, inner, result);
+}
+
+/**
+ * Native function for the native call overhead.
+ */
+ChrisValue nativeInc(const ChrisValue* args, size_t argsCount) {
+    return INT(AS_INT(args[0]) + 1);
+}
+
+/**
+ * Runs the program and reports calls per second, returns ns per call.
+ */
+double bench(ChrisVM& vm, const std::string& name, const std::string& program,
+             size_t calls, size_t repeat = 1) {
+    auto code = vm.compile(program);
+    ChrisValue result;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeat; i++) {
+        result = vm.run(code);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    calls *= repeat;
+
+    std::cout << name << " = " << chrisValueToConstantString(result) << ": "
+        << calls << " calls in " << elapsed.count() * 1000 << " ms, "
+        << calls / elapsed.count() / 1e6 << " M calls/s\n";
+
+    return elapsed.count() * 1e9 / calls;
+}
+
+int main(int argc, char const *argv[]) {
+    ChrisVM vm;
+
+    vm.run(vm.compile(R"(
+        (def fib (n)
+            (if (< n 2)
+                n
+                (+ (fib (- n 1)) (fib (- n 2)))))
+    )"));
+
+    vm.run(vm.compile(R"(
+        (def ack (m n)
+            (if (== m 0)
+                (+ n 1)
+                (if (== n 0)
+                    (ack (- m 1) 1)
+                    (ack (- m 1) (ack m (- n 1))))))
+    )"));
+
+    vm.run(vm.compile(R"(
+        (def loop (n acc)
+            (if (== n 0)
+                acc
+                (loop (- n 1) (+ acc 1))))
+    )"));
+
+    // Integer-heavy loop body.
+    vm.run(vm.compile(R"(
+        (def arith (n acc)
+            (if (== n 0)
+                acc
+                (arith (- n 1) (+ acc (- (/ (* n 6) 3) n)))))
+    )"));
+
+    // Upvalue access: `step` reads `n` and updates `acc` of `sum-to`.
+    vm.run(vm.compile(R"(
+        (def sum-to (n)
+            (begin
+                (var acc 0)
+                (def step (i)
+                    (if (> i n)
+                        acc
+                        (begin
+                            (set acc (+ acc i))
+                            (step (+ i 1)))))
+                (step 1)))
+    )"));
+
+    // Closure creation: a closure per iteration, called once.
+    vm.run(vm.compile(R"(
+        (def make (n) (lambda () n))
+    )"));
+
+    vm.run(vm.compile(R"(
+        (def make-loop (n acc)
+            (if (== n 0)
+                acc
+                (make-loop (- n 1) (+ acc ((make n))))))
+    )"));
+
+    // Same loop with a native increment.
+    vm.defineNative("inc", nativeInc, 1);
+
+    vm.run(vm.compile(R"(
+        (def native-loop (n acc)
+            (if (== n 0)
+                acc
+                (native-loop (- n 1) (inc acc))))
+    )"));
+
+    int ackResult;
+    auto ackCount = ackCalls(2, 30, ackResult);
+
+    bench(vm, "fib(27)", "(fib 27)", fibCalls(27));
+    bench(vm, "ack(2, 30) x 300", "(ack 2 30)", ackCount, 300);
+
+    // Tail calls run in constant stack at any depth.
+    auto loopNs = bench(vm, "loop(5000000)", "(loop 5000000 0)", 5000001);
+    bench(vm, "arith(5000000)", "(arith 5000000 0)", 5000001);
+
+    bench(vm, "sum-to(5000000)", "(sum-to 5000000)", 5000001);
+    bench(vm, "make-loop(1000000)", "(make-loop 1000000 0)", 3000001);
+
+    // Native call overhead: the native loop makes one native call per
+    // iteration instead of an OP_ADD.
+    auto nativeLoopNs = bench(vm, "native-loop(5000000)", "(native-loop 5000000 0)", 5000001);
+    std::cout << "native call overhead: " << nativeLoopNs - loopNs << " ns/call\n";
+
+    return 0;
+}
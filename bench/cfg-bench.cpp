@@ -0,0 +1,111 @@
+/**
+ * Control-flow graph passes: code size and run time of branchy functions
+ * linearized as emitted, and with the jump threading, exit duplication
+ * and hot/cold layout.
+ *
+ *   make bench && ./bin/cfg-bench
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../src/vm/ChrisVM.h"
+
+/**
+ * Scoring rule: nested branches in operand position, and a nested `if`
+ * as a test.
+ */
+static const char* SCORE = R"(
+    (def score (x)
+        (+ (if (== x 0)
+               100
+               (if (< x 50) (* x 2) (- x 50)))
+           (if (if (> x 90) (< x 95) false)
+               (if (> x 93) 3 2)
+               1)))
+)";
+
+/**
+ * Tail-recursive driver over the rule.
+ */
+static const char* LOOP = R"(
+    (def loop (i acc)
+        (if (<= i 0)
+            acc
+            (loop (- i 1) (+ acc (score (- i (* (/ i 100) 100)))))))
+)";
+
+/**
+ * Recursion with a base case.
+ */
+static const char* FIB = R"(
+    (def fib (n)
+        (if (< n 2)
+            n
+            (+ (fib (- n 1)) (fib (- n 2)))))
+)";
+
+/**
+ * Compiles the functions, returns their code size.
+ */
+size_t define(ChrisVM& vm, bool optimize) {
+    vm.compiler->setCfgOptimizations(optimize);
+
+    size_t codeSize = 0;
+    for (auto source : {SCORE, LOOP, FIB}) {
+        vm.run(vm.compile(source));
+        for (auto code : vm.compiler->getCodeObjects()) {
+            if (code->name != "main") {
+                codeSize += code->code.size();
+            }
+        }
+    }
+    return codeSize;
+}
+
+/**
+ * Runs the program once, returns seconds.
+ */
+double bench(ChrisVM& vm, CodeObject* code) {
+    auto start = std::chrono::steady_clock::now();
+    vm.run(code);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+int main(int argc, char const *argv[]) {
+    ChrisVM plainVm;
+    ChrisVM cfgVm;
+
+    auto plainSize = define(plainVm, false);
+    auto cfgSize = define(cfgVm, true);
+
+    std::cout << "bytecode: " << plainSize << " -> " << cfgSize << " bytes\n";
+
+    for (auto program : {"(loop 1000000 0)", "(fib 25)"}) {
+        auto plainCode = plainVm.compile(program);
+        auto cfgCode = cfgVm.compile(program);
+
+        auto expected = chrisValueToConstantString(plainVm.run(plainCode));
+        auto result = chrisValueToConstantString(cfgVm.run(cfgCode));
+        if (result != expected) {
+            std::cout << "results differ: " << result << " vs " << expected << "\n";
+            return 1;
+        }
+
+        // Alternating runs (best of each), so machine noise hits both.
+        double plain = 1e9;
+        double optimized = 1e9;
+
+        for (size_t i = 0; i < 7; i++) {
+            plain = std::min(plain, bench(plainVm, plainCode));
+            optimized = std::min(optimized, bench(cfgVm, cfgCode));
+        }
+
+        std::cout << program << ": as emitted " << plain * 1000 << " ms, optimized "
+            << optimized * 1000 << " ms (" << (optimized / plain - 1) * 100 << "%)\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,98 @@
+/**
+ * Compiler throughput benchmark: 100k generated rule forms.
+ *
+ *   make bench && ./bin/compile-bench
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../src/vm/ChrisVM.h"
+
+/**
+ * Total rule forms.
+ */
+#define FORMS_COUNT 100000
+
+/**
+ * Forms per program (the main code is limited to 64 KiB).
+ */
+#define FORMS_PER_PROGRAM 1000
+
+/**
+ * Generates a program of rule forms, mixing the special forms.
+ */
+std::string generateProgram(size_t first, size_t count) {
+    std::string source = "(begin\n";
+    for (auto i = first; i < first + count; i++) {
+        auto n = std::to_string(i % 100);
+        source += "  (if (>= (+ x " + n + ") (* y 3))\n"
+            "      (set y (- y " + n + "))\n"
+            "      (begin (var t (array-get a 0)) (map-set m \"k\" (/ t " + n + "))))\n";
+    }
+    source += ")";
+    return source;
+}
+
+/**
+ * Best of the repeats, in seconds.
+ */
+template <typename Fn>
+double bench(Fn fn, size_t repeat = 5) {
+    double best = 1e9;
+    for (size_t i = 0; i < repeat; i++) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+int main(int argc, char const *argv[]) {
+    ChrisVM vm;
+
+    vm.run(vm.compile("(var x 1)"));
+    vm.run(vm.compile("(var y 2)"));
+    vm.run(vm.compile("(var a (array 1 2 3))"));
+    vm.run(vm.compile("(var m (hash-map \"k\" 1))"));
+
+    std::vector<std::string> sources;
+    size_t bytes = 0;
+    for (size_t i = 0; i < FORMS_COUNT; i += FORMS_PER_PROGRAM) {
+        sources.push_back(generateProgram(i, FORMS_PER_PROGRAM));
+        bytes += sources.back().size();
+    }
+
+    std::vector<Exp> asts;
+
+    // The (regex) tokenizer dominates parsing: parsed once.
+    auto parse = bench([&]() {
+        asts.clear();
+        for (const auto& source : sources) {
+            asts.push_back(vm.parser->parse(source));
+        }
+    }, 1);
+
+    size_t codeSize = 0;
+
+    auto compile = bench([&]() {
+        HeapScope heapScope(vm.heap.get());
+        codeSize = 0;
+        for (const auto& ast : asts) {
+            codeSize += vm.compiler->compile(ast)->code.size();
+        }
+    });
+
+    std::cout << FORMS_COUNT << " forms, " << bytes / 1024 << " KiB source, "
+        << codeSize / 1024 << " KiB bytecode\n";
+    std::cout << "parse: " << parse * 1000 << " ms, "
+        << parse * 1e9 / FORMS_COUNT << " ns/form\n";
+    std::cout << "compile: " << compile * 1000 << " ms, "
+        << compile * 1e9 / FORMS_COUNT << " ns/form, "
+        << FORMS_COUNT / compile / 1e6 << " M forms/s\n";
+
+    return 0;
+}
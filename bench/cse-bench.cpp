@@ -0,0 +1,107 @@
+/**
+ * Common subexpression elimination: code size and run time of rule
+ * functions with repeated pure subexpressions, compiled with and without
+ * the elimination.
+ *
+ *   make bench && ./bin/cse-bench
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../src/vm/ChrisVM.h"
+
+/**
+ * Pricing rule: the line total is used by every branch.
+ */
+static const char* RULE = R"(
+    (def rule (price qty discount)
+        (begin
+            (var base (if (> (* price qty) 1000)
+                          (- (* price qty) (/ (* (* price qty) discount) 100))
+                          (* price qty)))
+            (if (>= (- (* price qty) base) (/ (* price qty) 10))
+                (+ base (/ (- (* price qty) base) 2))
+                base)))
+)";
+
+/**
+ * Tail-recursive driver over the rule.
+ */
+static const char* LOOP = R"(
+    (def loop (i acc)
+        (if (<= i 0)
+            acc
+            (loop (- i 1) (+ acc (rule (+ 10 (/ i 100)) (- 120 (/ i 1000)) 15)))))
+)";
+
+/**
+ * Compiles the functions, returns their code size.
+ */
+size_t define(ChrisVM& vm, bool cse, CseStats& stats) {
+    vm.compiler->setCse(cse);
+
+    size_t codeSize = 0;
+    for (auto source : {RULE, LOOP}) {
+        vm.run(vm.compile(source));
+        stats.eliminated += vm.compiler->getCseStats().eliminated;
+        stats.bytesSaved += vm.compiler->getCseStats().bytesSaved;
+        stats.instructionsSaved += vm.compiler->getCseStats().instructionsSaved;
+        for (auto code : vm.compiler->getCodeObjects()) {
+            if (code->name != "main") {
+                codeSize += code->code.size();
+            }
+        }
+    }
+    return codeSize;
+}
+
+/**
+ * Runs the program once, returns seconds.
+ */
+double bench(ChrisVM& vm, CodeObject* code) {
+    auto start = std::chrono::steady_clock::now();
+    vm.run(code);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+int main(int argc, char const *argv[]) {
+    ChrisVM plainVm;
+    ChrisVM cseVm;
+
+    CseStats plainStats;
+    CseStats stats;
+    auto plainSize = define(plainVm, false, plainStats);
+    auto cseSize = define(cseVm, true, stats);
+
+    std::cout << "bytecode: " << plainSize << " -> " << cseSize << " bytes ("
+        << stats.eliminated << " subexpressions eliminated, " << stats.bytesSaved
+        << " bytes and " << stats.instructionsSaved << " instructions saved)\n";
+
+    auto program = "(loop 1000000 0)";
+    auto plainCode = plainVm.compile(program);
+    auto cseCode = cseVm.compile(program);
+
+    auto expected = chrisValueToConstantString(plainVm.run(plainCode));
+    auto result = chrisValueToConstantString(cseVm.run(cseCode));
+    if (result != expected) {
+        std::cout << "results differ: " << result << " vs " << expected << "\n";
+        return 1;
+    }
+
+    // Alternating runs (best of each), so machine noise hits both.
+    double plain = 1e9;
+    double eliminated = 1e9;
+
+    for (size_t i = 0; i < 7; i++) {
+        plain = std::min(plain, bench(plainVm, plainCode));
+        eliminated = std::min(eliminated, bench(cseVm, cseCode));
+    }
+
+    std::cout << "loop(1000000): plain " << plain * 1000 << " ms, cse "
+        << eliminated * 1000 << " ms (" << (eliminated / plain - 1) * 100 << "%)\n";
+
+    return 0;
+}
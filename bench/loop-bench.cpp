@@ -0,0 +1,162 @@
+/**
+ * Loops: a while loop against tail recursion, and on-stack replacement
+ * of a hot loop by a faster tier (the code compiled with the optimizing
+ * passes), taking over in the middle of the call.
+ *
+ *   make bench && ./bin/loop-bench
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../src/vm/ChrisVM.h"
+
+/**
+ * Sum with a loop, and with tail recursion.
+ */
+static const char* SUM = R"(
+    (def sum (n)
+        (begin
+            (var i 0)
+            (var s 0)
+            (while (< i n)
+                (begin
+                    (set s (+ s i))
+                    (set i (+ i 1))))
+            s))
+)";
+
+static const char* RSUM = R"(
+    (def rsum (i s)
+        (if (<= i 0)
+            s
+            (rsum (- i 1) (+ s i))))
+)";
+
+/**
+ * Loop with repeated subexpressions (the optimized tier computes them
+ * once per iteration).
+ */
+static const char* WORK = R"(
+    (def work (n)
+        (begin
+            (var i 0)
+            (var s 0)
+            (while (< i n)
+                (begin
+                    (set s (+ s (- (* (* i 3) (* i 3)) (* (* i 3) 2))))
+                    (set i (+ i 1))))
+            s))
+)";
+
+/**
+ * Runs the program once, returns seconds.
+ */
+double bench(ChrisVM& vm, CodeObject* code) {
+    auto start = std::chrono::steady_clock::now();
+    vm.run(code);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+/**
+ * Code object of the function from the last compilation.
+ */
+CodeObject* function(ChrisVM& vm, const std::string& name) {
+    for (auto code : vm.compiler->getCodeObjects()) {
+        if (code->name == name) {
+            return code;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Offset after the header of the loop in the code.
+ */
+size_t loopEntry(CodeObject* code, size_t loop) {
+    for (size_t offset = 0; offset < code->code.size();
+         offset += opcodeTable[code->code[offset]].length) {
+        if (code->code[offset] == OP_LOOP && code->code[offset + 1] == loop) {
+            return offset + opcodeTable[OP_LOOP].length;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char const *argv[]) {
+    ChrisVM vm;
+    vm.run(vm.compile(SUM));
+    vm.run(vm.compile(RSUM));
+
+    auto loop = vm.compile("(sum 1000000)");
+    auto recursion = vm.compile("(rsum 1000000 0)");
+
+    double loopTime = 1e9;
+    double recursionTime = 1e9;
+
+    for (size_t i = 0; i < 7; i++) {
+        loopTime = std::min(loopTime, bench(vm, loop));
+        recursionTime = std::min(recursionTime, bench(vm, recursion));
+    }
+
+    std::cout << "sum(1000000): while " << loopTime * 1000 << " ms, tail recursion "
+        << recursionTime * 1000 << " ms\n";
+
+    // Baseline tier (defines the function), and the optimized tier.
+    vm.compiler->setCse(false);
+    vm.compiler->setCfgOptimizations(false);
+    vm.run(vm.compile(WORK));
+    auto baseline = function(vm, "work");
+
+    vm.compiler->setCse(true);
+    vm.compiler->setCfgOptimizations(true);
+    vm.compile(WORK);
+    auto optimized = function(vm, "work");
+
+    // Both tiers keep the function locals in the same slots.
+    auto replace = [&](CodeObject* code, size_t loop, size_t offset) -> OsrEntry {
+        if (code != baseline) {
+            return {nullptr, 0};
+        }
+        return {optimized, loopEntry(optimized, loop)};
+    };
+
+    auto work = vm.compile("(work 1000000)");
+
+    vm.setOsrHook(nullptr);
+    auto expected = chrisValueToConstantString(vm.run(work));
+    baseline->loops[0].iterations = 0;
+    vm.setOsrHook(replace);
+    auto result = chrisValueToConstantString(vm.run(work));
+
+    if (result != expected) {
+        std::cout << "results differ: " << result << " vs " << expected << "\n";
+        return 1;
+    }
+
+    // Each run starts in the baseline tier (the loop gets hot again).
+    double baselineTime = 1e9;
+    double osrTime = 1e9;
+
+    for (size_t i = 0; i < 7; i++) {
+        vm.setOsrHook(nullptr);
+        baselineTime = std::min(baselineTime, bench(vm, work));
+
+        baseline->loops[0].iterations = 0;
+        vm.setOsrHook(replace);
+        osrTime = std::min(osrTime, bench(vm, work));
+    }
+
+    std::cout << "work(1000000): baseline " << baselineTime * 1000 << " ms, on-stack replaced "
+        << osrTime * 1000 << " ms (" << (osrTime / baselineTime - 1) * 100 << "%)\n";
+
+    for (const auto& stats : vm.getLoopStats()) {
+        std::cout << "  " << stats.function << " " << stats.location.line << ":"
+            << stats.location.column << " " << stats.iterations << " iterations"
+            << (stats.hot ? ", hot" : "") << ", " << stats.replacements << " replacements\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,148 @@
+/**
+ * Hash map benchmark: MapObject vs std::unordered_map on insert/lookup,
+ * and insert/lookup-heavy scripts.
+ *
+ *   make bench && ./bin/map-bench
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../src/vm/ChrisVM.h"
+
+/**
+ * Number of keys.
+ */
+#define KEYS 1000000
+
+/**
+ * Scrambled integer keys (sequential keys favour identity hashing).
+ */
+int64_t intKey(int64_t i) {
+    return (i * 0x9E3779B97F4A7C15ll) >> 16;
+}
+
+/**
+ * Runs the function and reports ns per operation.
+ */
+template <typename Fn>
+void bench(const std::string& name, size_t ops, Fn fn) {
+    auto start = std::chrono::steady_clock::now();
+    auto result = fn();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << name << " = " << result << ": "
+        << elapsed.count() * 1e9 / ops << " ns/op\n";
+}
+
+int main(int argc, char const *argv[]) {
+    // Integer keys.
+    auto intMap = AS_MAP(ALLOC_MAP());
+    std::unordered_map<int64_t, ChrisValue> intStdMap;
+
+    bench("MapObject int insert", KEYS, [&]() {
+        for (int64_t i = 0; i < KEYS; i++) {
+            auto key = INT(intKey(i));
+            intMap->set(key, MapObject::hashKey(key), INT(i));
+        }
+        return intMap->count;
+    });
+
+    bench("unordered_map int insert", KEYS, [&]() {
+        for (int64_t i = 0; i < KEYS; i++) {
+            intStdMap[intKey(i)] = INT(i);
+        }
+        return intStdMap.size();
+    });
+
+    bench("MapObject int lookup", KEYS, [&]() {
+        int64_t sum = 0;
+        for (int64_t i = 0; i < KEYS; i++) {
+            auto key = INT(intKey(i));
+            sum += AS_INT(intMap->find(key, MapObject::hashKey(key))->value);
+        }
+        return sum;
+    });
+
+    bench("unordered_map int lookup", KEYS, [&]() {
+        int64_t sum = 0;
+        for (int64_t i = 0; i < KEYS; i++) {
+            sum += AS_INT(intStdMap.find(intKey(i))->second);
+        }
+        return sum;
+    });
+
+    // String keys (the key objects are reused, as constants are).
+    std::vector<ChrisValue> stringKeys;
+    for (int64_t i = 0; i < KEYS; i++) {
+        stringKeys.push_back(ALLOC_STRING("rate-" + std::to_string(i)));
+    }
+
+    auto stringMap = AS_MAP(ALLOC_MAP());
+    std::unordered_map<std::string, ChrisValue> stringStdMap;
+
+    bench("MapObject string insert", KEYS, [&]() {
+        for (int64_t i = 0; i < KEYS; i++) {
+            stringMap->set(stringKeys[i], MapObject::hashKey(stringKeys[i]), INT(i));
+        }
+        return stringMap->count;
+    });
+
+    bench("unordered_map string insert", KEYS, [&]() {
+        for (int64_t i = 0; i < KEYS; i++) {
+            stringStdMap[AS_CPPSTRING(stringKeys[i])] = INT(i);
+        }
+        return stringStdMap.size();
+    });
+
+    bench("MapObject string lookup", KEYS, [&]() {
+        int64_t sum = 0;
+        for (int64_t i = 0; i < KEYS; i++) {
+            auto& key = stringKeys[i];
+            sum += AS_INT(stringMap->find(key, MapObject::hashKey(key))->value);
+        }
+        return sum;
+    });
+
+    bench("unordered_map string lookup", KEYS, [&]() {
+        int64_t sum = 0;
+        for (int64_t i = 0; i < KEYS; i++) {
+            sum += AS_INT(stringStdMap.find(AS_CPPSTRING(stringKeys[i]))->second);
+        }
+        return sum;
+    });
+
+    // Scripts.
+    ChrisVM vm;
+
+    vm.run(vm.compile("(var m (hash-map))"));
+
+    vm.run(vm.compile(R"(
+        (def fill (i n)
+            (if (== i n)
+                (map-size m)
+                (begin
+                    (map-set m (* i 7) i)
+                    (fill (+ i 1) n))))
+    )"));
+
+    vm.run(vm.compile(R"(
+        (def lookup (i n acc)
+            (if (== i n)
+                acc
+                (lookup (+ i 1) n (+ acc (map-get m (* i 7))))))
+    )"));
+
+    bench("script insert", KEYS, [&]() {
+        return chrisValueToConstantString(vm.run(vm.compile("(fill 0 1000000)")));
+    });
+
+    bench("script lookup", KEYS, [&]() {
+        return chrisValueToConstantString(vm.run(vm.compile("(lookup 0 1000000 0)")));
+    });
+
+    return 0;
+}
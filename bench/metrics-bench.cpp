@@ -0,0 +1,84 @@
+/**
+ * Metrics overhead and aggregation: VMs on several threads run the same
+ * programs with a shared metrics registry.
+ *
+ *   make bench && ./bin/metrics-bench
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/vm/ChrisVM.h"
+
+#define THREADS 4
+
+#define RUNS 200
+
+/**
+ * Runs fib(20) and a small allocating program RUNS times on a new VM,
+ * returns seconds.
+ */
+double runPrograms(ChrisMetrics* metrics) {
+    ChrisVM vm;
+    vm.setMetrics(metrics);
+
+    vm.run(vm.compile(R"(
+        (def fib (n)
+            (if (< n 2)
+                n
+                (+ (fib (- n 1)) (fib (- n 2)))))
+    )", "setup"));
+
+    auto fib = vm.compile("(fib 20)", "fib");
+    auto alloc = vm.compile("(map-size (hash-map 1 (array 1 2) 2 (make-array 100 0)))",
+                            "alloc");
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < RUNS; i++) {
+        vm.run(fib);
+        vm.run(alloc);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    return elapsed.count();
+}
+
+int main(int argc, char const *argv[]) {
+    ChrisMetrics metrics;
+
+    // Overhead on a single thread (alternating, best of each).
+    double plain = 1e9;
+    double measured = 1e9;
+    for (size_t i = 0; i < 5; i++) {
+        plain = std::min(plain, runPrograms(nullptr));
+        measured = std::min(measured, runPrograms(&metrics));
+    }
+
+    std::cout << "plain: " << plain * 1000 << " ms, with metrics: " << measured * 1000
+        << " ms, overhead " << (measured / plain - 1) * 100 << "%\n";
+
+    // Aggregation across threads.
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < THREADS; i++) {
+        threads.emplace_back([&]() { runPrograms(&metrics); });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (auto name : {"fib", "alloc"}) {
+        auto stats = metrics.stats(name);
+        std::cout << name << ": " << stats.executions << " executions, "
+            << stats.instructions / stats.executions << " instructions/exec, "
+            << stats.allocations / stats.executions << " allocations/exec, p50 "
+            << stats.latencyP50 / 1000.0 << " us, p99 " << stats.latencyP99 / 1000.0
+            << " us\n";
+    }
+
+    std::cout << "\n" << metrics.toPrometheus();
+
+    return 0;
+}
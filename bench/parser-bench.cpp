@@ -0,0 +1,53 @@
+/**
+ * Parser throughput benchmark.
+ *
+ *   make bench && ./bin/parser-bench
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../src/parser/ChrisParser.h"
+
+using syntax::ChrisParser;
+
+/**
+ * Generates a list expression of about `size` bytes.
+ */
+std::string generateSource(size_t size) {
+    std::string source = "(begin\n";
+    for (int i = 0; source.size() < size; i++) {
+        source += "  (if (> x " + std::to_string(i) + ") (+ (* 2 y) " +
+            std::to_string(i % 97) + ") \"label\") // rule\n";
+    }
+    source += ")";
+    return source;
+}
+
+int main(int argc, char const *argv[]) {
+    ChrisParser parser;
+
+    for (size_t size : {1024, 4 * 1024, 16 * 1024}) {
+        auto source = generateSource(size);
+
+        // Parse repeatedly for at least a second.
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed{0};
+        size_t iterations = 0;
+        size_t entries = 0;
+
+        while (elapsed.count() < 1.0) {
+            entries += parser.parse(source).list.size();
+            iterations++;
+            elapsed = std::chrono::steady_clock::now() - start;
+        }
+
+        auto mb = (double)(source.size() * iterations) / (1024 * 1024);
+
+        std::cout << "expression " << source.size() / 1024 << " KiB: "
+            << mb / elapsed.count() << " MB/s (" << entries << " entries)\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+/**
+ * Sampling profiler overhead: fib(30) with and without the profiler.
+ *
+ *   make bench && ./bin/profiler-bench
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../src/vm/ChrisVM.h"
+
+/**
+ * Runs the program (best of the repeats), returns seconds.
+ */
+double bench(ChrisVM& vm, CodeObject* code, size_t repeat = 5) {
+    double best = 0;
+    for (size_t i = 0; i < repeat; i++) {
+        auto start = std::chrono::steady_clock::now();
+        vm.run(code);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (i == 0 || elapsed.count() < best) {
+            best = elapsed.count();
+        }
+    }
+    return best;
+}
+
+int main(int argc, char const *argv[]) {
+    ChrisVM vm;
+
+    vm.run(vm.compile(R"(
+        (def fib (n)
+            (if (< n 2)
+                n
+                (+ (fib (- n 1)) (fib (- n 2)))))
+    )"));
+
+    auto code = vm.compile("(fib 30)");
+
+    auto plain = bench(vm, code);
+    std::cout << "fib(30): " << plain * 1000 << " ms\n";
+
+    ChrisProfiler profiler;
+
+    for (int hz : {100, 1000}) {
+        vm.startProfiler(profiler, hz);
+        auto profiled = bench(vm, code);
+        vm.stopProfiler();
+
+        std::cout << "fib(30) profiled at " << hz << " Hz: " << profiled * 1000
+            << " ms, overhead " << (profiled / plain - 1) * 100 << "%\n";
+    }
+
+    std::cout << profiler.samplesCount() << " samples, "
+        << profiler.droppedCount() << " dropped\n";
+
+    return 0;
+}
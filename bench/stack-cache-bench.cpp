@@ -0,0 +1,86 @@
+/**
+ * Top-of-stack caching: the eval loop with and without the cached top
+ * (A/B in the same binary), on calls and on arithmetic chains.
+ *
+ *   make bench && ./bin/stack-cache-bench
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../src/vm/ChrisVM.h"
+
+/**
+ * Runs the program once, returns seconds.
+ */
+double bench(ChrisVM& vm, CodeObject* code) {
+    auto start = std::chrono::steady_clock::now();
+    vm.run(code);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+/**
+ * Alternating runs (best of each), so machine noise hits both.
+ */
+void compare(ChrisVM& vm, const std::string& name, const std::string& program) {
+    auto code = vm.compile(program);
+
+    vm.setStackCaching(false);
+    auto expected = vm.run(code);
+    vm.setStackCaching(true);
+    auto result = vm.run(code);
+
+    if (chrisValueToConstantString(result) != chrisValueToConstantString(expected)) {
+        std::cout << name << ": results differ: " << chrisValueToConstantString(result)
+            << " vs " << chrisValueToConstantString(expected) << "\n";
+        return;
+    }
+
+    double plain = 1e9;
+    double cached = 1e9;
+
+    for (size_t i = 0; i < 7; i++) {
+        vm.setStackCaching(false);
+        plain = std::min(plain, bench(vm, code));
+
+        vm.setStackCaching(true);
+        cached = std::min(cached, bench(vm, code));
+    }
+
+    std::cout << name << ": push/pop " << plain * 1000 << " ms, cached top "
+        << cached * 1000 << " ms (" << (cached / plain - 1) * 100 << "%)\n";
+}
+
+int main(int argc, char const *argv[]) {
+    ChrisVM vm;
+
+    vm.run(vm.compile(R"(
+        (def fib (n)
+            (if (< n 2)
+                n
+                (+ (fib (- n 1)) (fib (- n 2)))))
+    )"));
+
+    vm.run(vm.compile(R"(
+        (def poly (x)
+            (- (+ (* (* x x) 3) (* x 7)) (/ (* x 4) 2)))
+    )"));
+
+    // Arithmetic and comparison chains in a tail-recursive loop:
+    vm.run(vm.compile(R"(
+        (def loop (i acc)
+            (if (<= i 0)
+                acc
+                (loop (- i 1)
+                      (if (> (poly i) (* i 5))
+                          (+ acc 1)
+                          (- acc 1)))))
+    )"));
+
+    compare(vm, "fib(30)", "(fib 30)");
+    compare(vm, "loop(1000000)", "(loop 1000000 0)");
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+/**
+ * Execution trace overhead: fib(30) with and without the tracer.
+ *
+ *   make bench && ./bin/trace-bench
+ */
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../src/vm/ChrisVM.h"
+
+/**
+ * Runs the program once, returns seconds.
+ */
+double bench(ChrisVM& vm, CodeObject* code) {
+    auto start = std::chrono::steady_clock::now();
+    vm.run(code);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+int main(int argc, char const *argv[]) {
+    ChrisVM vm;
+
+    vm.run(vm.compile(R"(
+        (def fib (n)
+            (if (< n 2)
+                n
+                (+ (fib (- n 1)) (fib (- n 2)))))
+    )"));
+
+    auto code = vm.compile("(fib 30)");
+
+    ChrisTracer tracer;
+
+    // Alternating runs (best of each), so machine noise hits both.
+    double plain = 1e9;
+    double traced = 1e9;
+    size_t instructions = 0;
+
+    for (size_t i = 0; i < 7; i++) {
+        plain = std::min(plain, bench(vm, code));
+
+        tracer.clear();
+        vm.setTracer(&tracer);
+        traced = std::min(traced, bench(vm, code));
+        vm.setTracer(nullptr);
+        instructions = tracer.recordedCount();
+    }
+
+    std::cout << "fib(30): " << plain * 1000 << " ms (" << instructions / 1e6
+        << " M instructions)\n";
+    std::cout << "fib(30) traced: " << traced * 1000 << " ms, overhead "
+        << (traced / plain - 1) * 100 << "%, "
+        << (traced - plain) * 1e9 / instructions << " ns/instruction\n";
+
+    return 0;
+}
@@ -1,23 +1,204 @@
+#include <cstdlib>
+#include <fcntl.h>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <unistd.h>
 
 #include "src/Logger.h"
+#include "src/parser/ChrisSourceReader.h"
 #include "src/vm/ChrisVM.h"
+
+/**
+ * Instructions dumped after an error (--trace).
+ */
+static size_t traceDumpCount = 0;
+
+/**
+ * Prints the last error (and the last traced instructions).
+ */
+void reportError(ChrisVM& vm) {
+    std::cerr << vm.error << "\n";
+    if (traceDumpCount > 0 && vm.error.type == ErrorType::RUNTIME) {
+        std::cerr << "Last executed instructions:\n";
+        vm.dumpTrace(std::cerr, traceDumpCount);
+    }
+}
+
+/**
+ * Reads top-level expressions from the stream one at a time and executes
+ * each as a continuation of the same program.
+ */
+int run(ChrisVM& vm, int fd) {
+    auto interactive = isatty(fd);
+    auto status = EXIT_SUCCESS;
+
+    ChrisSourceReader reader(fd);
+    std::string source;
+
+    ChrisValue result;
+
+    for (;;) {
+        if (interactive) {
+            std::cout << "> " << std::flush;
+        }
+
+        if (!reader.next(source)) {
+            break;
+        }
+
+        if (vm.tryExecIncremental(source, result, reader.line)) {
+            std::cout << chrisValueToConstantString(result) << "\n";
+        } else {
+            // Syntax errors are reported relative to the expression.
+            if (vm.error.type == ErrorType::SYNTAX && vm.error.line > 0) {
+                vm.error.line += reader.line - 1;
+            }
+            reportError(vm);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    return status;
+}
+
+/**
+ * Writes the iteration counts of the loops, the most iterated first:
+ * <function> <line>:<column> <iterations> [hot]
+ */
+bool writeLoopStats(ChrisVM& vm, const std::string& path) {
+    std::ofstream out(path);
+    for (const auto& loop : vm.getLoopStats()) {
+        out << loop.function << " " << loop.location.line << ":" << loop.location.column
+            << " " << loop.iterations << (loop.hot ? " hot" : "") << "\n";
+    }
+    return (bool)out;
+}
+
+/**
+ * Runs the command line program, returns the exit status.
+ */
+int runMain(ChrisVM& vm, int argc, char const *argv[]) {
+    if (argc == 3 && std::string(argv[1]) == "-e") {
+        ChrisValue result;
+
+        if (!vm.tryExec(argv[2], result)) {
+            reportError(vm);
+            return EXIT_FAILURE;
+        }
+
+        log(result);
+
+        std::cout << "All done!\n";
+
+        return 0;
+    }
+
+    if (argc == 2 && argv[1][0] != '-') {
+        auto fd = open(argv[1], O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Cannot open " << argv[1] << "\n";
+            return EXIT_FAILURE;
+        }
+        auto status = run(vm, fd);
+        close(fd);
+        return status;
+    }
+
+    if (argc != 1) {
+        std::cerr << "Usage: chris-vm [--profile <out>] [--trace <count>] [--metrics <out>] "
+            "[--loops <out>] [-e <expression> | <file>]\n";
+        return EXIT_FAILURE;
+    }
+
+    return run(vm, STDIN_FILENO);
+}
+
 /**
  * Chris VM main executable.
+ *
+ *   chris-vm -e '(+ 1 2)'   evaluates the expression
+ *   chris-vm <file>         executes expressions from the file
+ *   chris-vm                reads expressions from stdin
+ *
+ *   --profile <out>         writes sampled folded stacks to the file
+ *                           (e.g. for flamegraph.pl)
+ *   --trace <count>         prints the last executed instructions on
+ *                           runtime errors
+ *   --metrics <out>         writes the metrics in the Prometheus text
+ *                           format to the file
+ *   --loops <out>           writes the iteration counts of the loops
+ *                           to the file
  */
 int main(int argc, char const *argv[]) {
 
     ChrisVM vm;
 
-    auto result = vm.exec(R"(
+    std::ofstream profileOut;
+    std::unique_ptr<ChrisProfiler> profiler;
+    std::unique_ptr<ChrisTracer> tracer;
+    std::string metricsPath;
+    std::unique_ptr<ChrisMetrics> metrics;
+    std::string loopsPath;
+
+    while (argc >= 3 && std::string(argv[1]).rfind("--", 0) == 0) {
+        std::string option = argv[1];
+
+        if (option == "--profile") {
+            profileOut.open(argv[2]);
+            if (!profileOut) {
+                std::cerr << "Cannot open " << argv[2] << "\n";
+                return EXIT_FAILURE;
+            }
+            profiler = std::make_unique<ChrisProfiler>();
+        } else if (option == "--trace") {
+            traceDumpCount = std::strtoul(argv[2], nullptr, 10);
+            tracer = std::make_unique<ChrisTracer>(
+                std::max(traceDumpCount, (size_t)TRACE_DEFAULT_SIZE));
+            vm.setTracer(tracer.get());
+        } else if (option == "--metrics") {
+            metricsPath = argv[2];
+            metrics = std::make_unique<ChrisMetrics>();
+            vm.setMetrics(metrics.get());
+        } else if (option == "--loops") {
+            loopsPath = argv[2];
+        } else {
+            break;
+        }
+
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (profiler) {
+        try {
+            vm.startProfiler(*profiler);
+        } catch (ChrisError& e) {
+            std::cerr << e << "\n";
+            return EXIT_FAILURE;
+        }
+    }
 
-        (if (> 5 10) 1 2)
+    auto status = runMain(vm, argc, argv);
 
-    )");
+    if (profiler) {
+        vm.stopProfiler();
+        profiler->writeFolded(profileOut);
+        if (profiler->droppedCount() > 0) {
+            std::cerr << "Profiler: " << profiler->droppedCount()
+                << " samples dropped (ring full)\n";
+        }
+    }
 
-    log(result);
+    if (metrics && !metrics->writePrometheusFile(metricsPath)) {
+        std::cerr << "Cannot write " << metricsPath << "\n";
+        return EXIT_FAILURE;
+    }
 
-    std::cout << "All done!\n";
+    if (!loopsPath.empty() && !writeLoopStats(vm, loopsPath)) {
+        std::cerr << "Cannot write " << loopsPath << "\n";
+        return EXIT_FAILURE;
+    }
 
-    return 0;
-}
\ No newline at end of file
+    return status;
+}
@@ -5,18 +5,121 @@
 #ifndef Logger_h
 #define Logger_h
 
+#include <cstring>
+#include <exception>
 #include <sstream>
+#include <string>
 
-class ErrorLogMessage : public std::basic_ostringstream<char> {
+/**
+ * Error category (which stage of the pipeline failed).
+ */
+enum class ErrorType {
+    NONE,
+    SYNTAX,
+    COMPILE,
+    RUNTIME,
+};
+
+/**
+ * Max length of the error message (longer messages are truncated).
+ */
+#define ERROR_MESSAGE_SIZE 256
+
+/**
+ * Recoverable error.
+ *
+ * The message is stored inline, so copying the error into a
+ * preallocated slot (e.g. ChrisVM::error) does not allocate.
+ */
+class ChrisError : public std::exception {
+    public:
+    ChrisError() { message[0] = '\0'; }
+
+    ChrisError(ErrorType type, const std::string& msg, int line = 0, int column = 0)
+        : type(type), line(line), column(column) {
+        strncpy(message, msg.c_str(), ERROR_MESSAGE_SIZE - 1);
+        message[ERROR_MESSAGE_SIZE - 1] = '\0';
+    }
+
+    const char* what() const noexcept override { return message; }
+
+    /**
+     * Error category.
+     */
+    ErrorType type = ErrorType::NONE;
+
+    /**
+     * Source location (0 if unknown).
+     */
+    int line = 0;
+    int column = 0;
+
+    /**
+     * Bytecode offset for runtime errors (-1 if unknown).
+     */
+    int offset = -1;
+
+    /**
+     * Error message.
+     */
+    char message[ERROR_MESSAGE_SIZE];
+};
+
+/**
+ * Error message builder, throws ChrisError once the message is complete.
+ */
+class ErrorLogMessage {
     public:
-    ~ErrorLogMessage() {
-        fprintf(stderr, "Fatal error: %s\n", str().c_str());
-        exit(EXIT_FAILURE);
+    ErrorLogMessage(ErrorType type, int line = 0, int column = 0)
+        : type(type), line(line), column(column) {}
+
+    ~ErrorLogMessage() noexcept(false) {
+        // Don't throw while already unwinding from another error.
+        if (std::uncaught_exceptions() == 0) {
+            throw ChrisError(type, stream.str(), line, column);
+        }
+    }
+
+    template <typename T>
+    ErrorLogMessage& operator<<(const T& value) {
+        stream << value;
+        return *this;
+    }
+
+    // Stream manipulators (std::hex, etc).
+    ErrorLogMessage& operator<<(std::ios_base& (*manip)(std::ios_base&)) {
+        stream << manip;
+        return *this;
     }
+
+    private:
+    std::ostringstream stream;
+    ErrorType type;
+    int line;
+    int column;
 };
 
-#define DIE ErrorLogMessage()
+#define DIE ErrorLogMessage(ErrorType::RUNTIME)
+
+#define COMPILE_ERROR ErrorLogMessage(ErrorType::COMPILE)
+
+#define SYNTAX_ERROR(line, column) ErrorLogMessage(ErrorType::SYNTAX, line, column)
 
 #define log(value) std::cout << #value << " = " << (value) << "\n";
 
-#endif
\ No newline at end of file
+/**
+ * Output stream.
+ */
+inline std::ostream &operator<<(std::ostream &os, const ChrisError &error) {
+    static const char* types[] = {"", "Syntax error", "Compile error", "Runtime error"};
+    os << types[(int)error.type];
+    if (error.line > 0) {
+        os << " at " << error.line << ":" << error.column;
+    }
+    if (error.offset >= 0) {
+        os << " at offset " << error.offset;
+    }
+    return os << ": " << error.message;
+}
+
+#endif
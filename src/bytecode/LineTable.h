@@ -0,0 +1,242 @@
+/**
+ * Line table: maps bytecode offsets to source locations.
+ */
+
+#ifndef LineTable_h
+#define LineTable_h
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Source location (line is 1-based, column is 0-based; line 0 is unknown).
+ */
+struct SourceLocation {
+    int line;
+    int column;
+};
+
+/**
+ * Line table of a code object.
+ *
+ * An entry is recorded only where the location changes, and is encoded
+ * as varints: the offset delta, the zigzag line delta and the column.
+ * Most entries take 3 bytes. The table is kept apart from the bytecode
+ * and is only decoded on errors, disassembly and profiling.
+ */
+class LineTable {
+    public:
+    /**
+     * Position in the table: the entries so far, and the last one.
+     */
+    struct Mark {
+        size_t index;
+        size_t offset;
+        int line;
+        int column;
+    };
+
+    /**
+     * Records the location of the code starting at the offset (offsets
+     * are added in increasing order).
+     */
+    void add(size_t offset, int line, int column) {
+        if (line == lastLine && column == lastColumn) {
+            return;
+        }
+        write(offset, line, column);
+    }
+
+    /**
+     * Location of the instruction at the offset ({0, 0} if unknown).
+     *
+     * Doesn't allocate, so it's safe to call from a signal handler.
+     */
+    SourceLocation find(size_t offset) const {
+        SourceLocation location{0, 0};
+        size_t entryOffset = 0;
+        int line = 0;
+        size_t i = 0;
+
+        while (i < data.size()) {
+            entryOffset += readVarint(i);
+            line += unzigzag(readVarint(i));
+            auto column = (int)readVarint(i);
+
+            if (entryOffset > offset) {
+                break;
+            }
+            location = {line, column};
+        }
+
+        return location;
+    }
+
+    /**
+     * Drops the entries of the code from the offset on (the code was
+     * truncated).
+     */
+    void truncate(size_t offset) {
+        size_t entryOffset = 0;
+        int line = 0;
+        int column = 0;
+        size_t i = 0;
+
+        while (i < data.size()) {
+            auto entryStart = i;
+            auto nextOffset = entryOffset + readVarint(i);
+            auto nextLine = line + unzigzag(readVarint(i));
+            auto nextColumn = (int)readVarint(i);
+
+            if (nextOffset >= offset) {
+                data.resize(entryStart);
+                break;
+            }
+            entryOffset = nextOffset;
+            line = nextLine;
+            column = nextColumn;
+        }
+
+        lastOffset = entryOffset;
+        lastLine = line;
+        lastColumn = column;
+    }
+
+    /**
+     * Current position (the entries of the code emitted next follow it).
+     */
+    Mark mark() const { return {data.size(), lastOffset, lastLine, lastColumn}; }
+
+    /**
+     * Drops the entries after the position.
+     */
+    void rewind(const Mark& mark) {
+        data.resize(mark.index);
+        lastOffset = mark.offset;
+        lastLine = mark.line;
+        lastColumn = mark.column;
+    }
+
+    /**
+     * Appends the locations of the code moved from offset `from` to `to`:
+     * the entries of the table between the marks, up to the offset
+     * `limit` (the code may be cut).
+     *
+     * Only the first entry is re-encoded (its deltas are relative to
+     * the code before), the others are copied as is.
+     */
+    void append(const LineTable& table, const Mark& begin, const Mark& end,
+                size_t from, size_t to, size_t limit) {
+        if (begin.index == end.index) {
+            add(to, begin.line, begin.column);
+            return;
+        }
+
+        auto i = begin.index;
+        auto offset = begin.offset + table.readVarint(i);
+        auto line = begin.line + unzigzag(table.readVarint(i));
+        auto column = (int)table.readVarint(i);
+
+        // The location in effect at the start of the code.
+        if (offset > from) {
+            add(to, begin.line, begin.column);
+        }
+        if (offset >= limit) {
+            return;
+        }
+        write(offset - from + to, line, column);
+
+        if (end.offset < limit) {
+            data.insert(data.end(), table.data.begin() + i, table.data.begin() + end.index);
+            lastOffset = end.offset - from + to;
+            lastLine = end.line;
+            lastColumn = end.column;
+            return;
+        }
+
+        while (i < end.index) {
+            offset += table.readVarint(i);
+            line += unzigzag(table.readVarint(i));
+            column = (int)table.readVarint(i);
+            if (offset >= limit) {
+                break;
+            }
+            add(offset - from + to, line, column);
+        }
+    }
+
+    /**
+     * Removes all entries.
+     */
+    void clear() {
+        data.clear();
+        lastOffset = 0;
+        lastLine = 0;
+        lastColumn = 0;
+    }
+
+    /**
+     * Encoded size in bytes.
+     */
+    size_t size() const { return data.size(); }
+
+    private:
+    /**
+     * Writes an entry (even if the location doesn't change).
+     */
+    void write(size_t offset, int line, int column) {
+        writeVarint(offset - lastOffset);
+        writeVarint(zigzag(line - lastLine));
+        writeVarint(column);
+
+        lastOffset = offset;
+        lastLine = line;
+        lastColumn = column;
+    }
+
+    static uint32_t zigzag(int32_t value) {
+        return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+    }
+
+    static int32_t unzigzag(uint32_t value) {
+        return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+    }
+
+    /**
+     * LEB128: 7 bits per byte, the high bit marks continuation.
+     */
+    void writeVarint(uint32_t value) {
+        while (value >= 0x80) {
+            data.push_back((uint8_t)(value | 0x80));
+            value >>= 7;
+        }
+        data.push_back((uint8_t)value);
+    }
+
+    uint32_t readVarint(size_t& i) const {
+        uint32_t value = 0;
+        int shift = 0;
+        uint8_t byte;
+        do {
+            byte = data[i++];
+            value |= (uint32_t)(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        return value;
+    }
+
+    /**
+     * Encoded entries.
+     */
+    std::vector<uint8_t> data;
+
+    /**
+     * Last entry (the base of the next delta).
+     */
+    size_t lastOffset = 0;
+    int lastLine = 0;
+    int lastColumn = 0;
+};
+
+#endif
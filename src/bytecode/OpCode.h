@@ -5,60 +5,260 @@
 #ifndef OpCode_h
 #define OpCode_h
 
+#include <array>
+#include <cstdint>
+#include <string>
+
+#include "../Logger.h"
+
 /**
- * Stops the program.
+ * Instruction flags.
  */
-#define OP_HALT 0x00
 
 /**
- * Pushes a const onto the stack.
+ * May jump to the address operand.
  */
+#define OPF_BRANCH 0x01
 
-#define OP_CONST 0x01
+/**
+ * Never continues to the next instruction.
+ */
+#define OPF_NO_FALLTHROUGH 0x02
 
 /**
- * Math instruction.
+ * May allocate heap objects.
  */
-#define OP_ADD 0x02
-#define OP_SUB 0x03
-#define OP_MUL 0x04
-#define OP_DIV 0x05
+#define OPF_ALLOCATES 0x04
 
 /**
- * Comparison.
+ * Additionally pops the number of values given by the operand.
  */
-#define OP_COMPARE 0x06
+#define OPF_POPS_OPERAND 0x08
 
 /**
- * Control flow: jump if the value on the stack is false.
+ * Instruction set: X(name, code, operand, pops, pushes, flags).
+ *
+ * This is the single source of truth for opcodes: the opcode constants,
+ * the metadata table (names, lengths, stack effects), the disassembler
+ * and the verifier are all derived from it.
  */
-#define OP_JMP_IF_FALSE 0x07
+#define OPCODE_LIST(X)                                                    \
+    /* Stops the program. */                                              \
+    X(HALT,         0x00, NONE,    1, 0, OPF_NO_FALLTHROUGH)              \
+                                                                          \
+    /* Pushes a const onto the stack. */                                  \
+    X(CONST,        0x01, CONST,   0, 1, 0)                               \
+                                                                          \
+    /* Math instruction. */                                               \
+    X(ADD,          0x02, NONE,    2, 1, OPF_ALLOCATES)                   \
+    X(SUB,          0x03, NONE,    2, 1, 0)                               \
+    X(MUL,          0x04, NONE,    2, 1, 0)                               \
+    X(DIV,          0x05, NONE,    2, 1, 0)                               \
+                                                                          \
+    /* Comparison. */                                                     \
+    X(COMPARE,      0x06, COMPARE, 2, 1, 0)                               \
+                                                                          \
+    /* Control flow: jump if the value on the stack is false. */          \
+    X(JMP_IF_FALSE, 0x07, ADDRESS, 1, 0, OPF_BRANCH)                      \
+                                                                          \
+    /* Unconditional jump. */                                             \
+    X(JMP,          0x08, ADDRESS, 0, 0, OPF_BRANCH | OPF_NO_FALLTHROUGH)  \
+                                                                          \
+    /* Global variables (by slot). */                                     \
+    X(GET_GLOBAL,   0x09, GLOBAL,  0, 1, 0)                               \
+    X(SET_GLOBAL,   0x0A, GLOBAL,  1, 1, 0)                               \
+                                                                          \
+    /* Pops a value from the stack. */                                    \
+    X(POP,          0x0B, NONE,    1, 0, 0)                               \
+                                                                          \
+    /* Local variables (by frame-relative stack slot). */                 \
+    X(GET_LOCAL,    0x0C, LOCAL,   0, 1, 0)                               \
+    X(SET_LOCAL,    0x0D, LOCAL,   1, 1, 0)                               \
+                                                                          \
+    /* Exits a block: pops the block locals, keeps the result on top. */  \
+    X(SCOPE_EXIT,   0x0E, COUNT,   1, 1, OPF_POPS_OPERAND)                \
+                                                                          \
+    /* Function call: callee and arguments are on the stack. */           \
+    X(CALL,         0x0F, COUNT,   1, 1, OPF_POPS_OPERAND)                \
+                                                                          \
+    /* Return from a function (the result is on top). */                  \
+    X(RETURN,       0x10, NONE,    1, 0, OPF_NO_FALLTHROUGH)              \
+                                                                          \
+    /* Call in tail position: replaces the current frame. */              \
+    X(TAIL_CALL,    0x11, COUNT,   1, 0, OPF_POPS_OPERAND | OPF_NO_FALLTHROUGH) \
+                                                                          \
+    /* Captured variables of the running closure. */                      \
+    X(GET_UPVALUE,  0x12, UPVALUE, 0, 1, 0)                               \
+    X(SET_UPVALUE,  0x13, UPVALUE, 1, 1, 0)                               \
+                                                                          \
+    /* Creates a closure of a function constant (captures upvalues). */   \
+    X(CLOSURE,      0x14, CLOSURE, 0, 1, OPF_ALLOCATES)                   \
+                                                                          \
+    /* Call of a native function (falls back to OP_CALL otherwise). */    \
+    X(NATIVE_CALL,  0x15, COUNT,   1, 1, OPF_POPS_OPERAND)                \
+                                                                          \
+    /* Arrays: (array <elements>), (make-array <size> <value>). */        \
+    X(ARRAY,        0x16, COUNT,   0, 1, OPF_POPS_OPERAND | OPF_ALLOCATES) \
+    X(MAKE_ARRAY,   0x17, NONE,    2, 1, OPF_ALLOCATES)                   \
+                                                                          \
+    /* Array element access, length and append. */                        \
+    X(ARRAY_GET,    0x18, NONE,    2, 1, 0)                               \
+    X(ARRAY_SET,    0x19, NONE,    3, 1, 0)                               \
+    X(ARRAY_LENGTH, 0x1A, NONE,    1, 1, 0)                               \
+    X(ARRAY_PUSH,   0x1B, NONE,    2, 1, OPF_ALLOCATES)                   \
+                                                                          \
+    /* Bulk numeric array operations (native loops). */                   \
+    X(ARRAY_SUM,    0x1C, NONE,    1, 1, 0)                               \
+    X(ARRAY_ADD,    0x1D, NONE,    2, 1, OPF_ALLOCATES)                   \
+    X(ARRAY_DOT,    0x1E, NONE,    2, 1, 0)                               \
+                                                                          \
+    /* Hash maps: (hash-map <key> <value> ...). */                        \
+    X(MAP,          0x1F, COUNT,   0, 1, OPF_POPS_OPERAND | OPF_ALLOCATES) \
+    X(MAP_GET,      0x20, NONE,    2, 1, 0)                               \
+    X(MAP_SET,      0x21, NONE,    3, 1, OPF_ALLOCATES)                   \
+    X(MAP_HAS,      0x22, NONE,    2, 1, 0)                               \
+    X(MAP_SIZE,     0x23, NONE,    1, 1, 0)                               \
+                                                                          \
+    /* Control flow: jump if the value on the stack is true. */           \
+    X(JMP_IF_TRUE,  0x24, ADDRESS, 1, 0, OPF_BRANCH)                      \
+                                                                          \
+    /* Loop header: counts the iterations of the loop. */                 \
+    X(LOOP,         0x25, LOOP,    0, 0, 0)                               \
+                                                                          \
+    /* Pushes a const past the first 256 of the pool. */                  \
+    X(CONST_WIDE,   0x26, CONST_WIDE, 0, 1, 0)
 
 /**
- * Unconditional jump.
+ * Opcodes.
  */
-#define OP_JMP 0x08
+#define OPCODE_ENUM(name, code, operand, pops, pushes, flags) OP_##name = code,
+
+enum OpCode : uint8_t {
+    OPCODE_LIST(OPCODE_ENUM)
+};
+
+#undef OPCODE_ENUM
+
+/**
+ * Operand type (the operand follows the opcode byte).
+ */
+enum class OperandType : uint8_t {
+    NONE,     // no operand
+    CONST,    // 1-byte constant pool index
+    COMPARE,  // 1-byte compare op
+    ADDRESS,  // 2-byte absolute bytecode address
+    GLOBAL,   // 1-byte global slot
+    LOCAL,    // 1-byte frame-relative stack slot
+    COUNT,    // 1-byte count
+    UPVALUE,  // 1-byte upvalue index of the running closure
+    CLOSURE,  // 1-byte constant pool index of a function
+    LOOP,     // 1-byte loop index of the code object
+    CONST_WIDE,  // 2-byte constant pool index
+};
+
+/**
+ * Operand size in bytes.
+ */
+constexpr uint8_t operandSize(OperandType operand) {
+    switch (operand) {
+        case OperandType::NONE:
+            return 0;
+        case OperandType::CONST:
+        case OperandType::COMPARE:
+        case OperandType::GLOBAL:
+        case OperandType::LOCAL:
+        case OperandType::COUNT:
+        case OperandType::UPVALUE:
+        case OperandType::CLOSURE:
+        case OperandType::LOOP:
+            return 1;
+        case OperandType::ADDRESS:
+        case OperandType::CONST_WIDE:
+            return 2;
+    }
+    return 0;
+}
+
+/**
+ * Opcode metadata.
+ */
+struct OpCodeInfo {
+    /**
+     * Opcode name (nullptr for unused opcodes).
+     */
+    const char* name;
+
+    /**
+     * Operand type.
+     */
+    OperandType operand;
+
+    /**
+     * Instruction length in bytes (opcode + operand).
+     */
+    uint8_t length;
+
+    /**
+     * Number of values popped and pushed.
+     */
+    uint8_t pops;
+    uint8_t pushes;
+
+    /**
+     * Net stack effect (pushes - pops).
+     */
+    int8_t stackEffect;
+
+    /**
+     * OPF_* flags.
+     */
+    uint8_t flags;
+};
+
+/**
+ * Builds the metadata table indexed by opcode.
+ */
+constexpr std::array<OpCodeInfo, 256> makeOpCodeTable() {
+    std::array<OpCodeInfo, 256> table{};
+
+#define OPCODE_INFO(name, code, operand, pops, pushes, flags)          \
+    table[code] = {#name, OperandType::operand,                        \
+                   (uint8_t)(1 + operandSize(OperandType::operand)),   \
+                   pops, pushes, (int8_t)(pushes - pops), flags};
+
+    OPCODE_LIST(OPCODE_INFO)
+
+#undef OPCODE_INFO
+
+    return table;
+}
+
+/**
+ * Opcode metadata table (O(1) lookups for length, stack effect, etc).
+ */
+constexpr std::array<OpCodeInfo, 256> opcodeTable = makeOpCodeTable();
+
+/**
+ * Whether the opcode is defined.
+ */
+constexpr bool isValidOpcode(uint8_t opcode) {
+    return opcodeTable[opcode].name != nullptr;
+}
+
+/**
+ * Whether the opcode has the flag.
+ */
+constexpr bool opcodeHasFlag(uint8_t opcode, uint8_t flag) {
+    return (opcodeTable[opcode].flags & flag) != 0;
+}
 
 // ------------------------------------------------------------------
-#define OP_STR(op)  \
-    case OP_##op:   \
-        return #op
 
 std::string opcodeToString(uint8_t opcode) {
-    switch (opcode) {
-        OP_STR(HALT);
-        OP_STR(CONST);
-        OP_STR(ADD);
-        OP_STR(SUB);
-        OP_STR(MUL);
-        OP_STR(DIV);
-        OP_STR(COMPARE);
-        OP_STR(JMP_IF_FALSE);
-        OP_STR(JMP);
-        default:
-            DIE << "opcodeToString: unknown opcode: " << (int)opcode;
+    if (!isValidOpcode(opcode)) {
+        DIE << "opcodeToString: unknown opcode: " << (int)opcode;
     }
-    return "Unknown"; // Unreachable
+    return opcodeTable[opcode].name;
 }
 
-#endif
\ No newline at end of file
+#endif
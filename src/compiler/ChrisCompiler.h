@@ -5,17 +5,52 @@
 #ifndef ChrisCompiler_h
 #define ChrisCompiler_h
 
-#include <map>
 #include <string>
+#include <unordered_map>
 
 #include "../parser/ChrisParser.h"
 #include "../disassembler/ChrisDisassembler.h"
 #include "../vm/ChrisValue.h"
+#include "../vm/Global.h"
+#include "CommonSubexpressions.h"
+#include "ControlFlowGraph.h"
+
+/**
+ * Max constants per code object (OP_CONST_WIDE has a 2-byte index).
+ */
+#define CONSTANTS_LIMIT 0x10000
+
+/**
+ * Constants reachable by the 1-byte index of OP_CONST and OP_CLOSURE.
+ */
+#define SHORT_CONSTANTS_LIMIT 256
+
+/**
+ * Max loops per code object (OP_LOOP has a 1-byte index).
+ */
+#define LOOPS_LIMIT 256
+
+/**
+ * Incremental mode: once the main code grows past this size, the
+ * already executed top-level code is dropped before appending more.
+ */
+#define INCREMENTAL_CODE_REWIND 0x8000
+
+/**
+ * Incremental mode: the loops of the dropped code are dropped with it,
+ * also once there are this many.
+ */
+#define INCREMENTAL_LOOPS_REWIND (LOOPS_LIMIT / 2)
+
+/**
+ * Name of the common subexpression temps (not a valid variable name).
+ */
+#define CSE_TEMP_NAME "(cse)"
 
 // Allocates new constant in the pool.
 #define ALLOC_CONST(tester, converter, allocator, value)    \
     do {                                                    \
-        for (auto i = 0; i < co->constants.size(); i++) {   \
+        for (size_t i = 0; i < co->constants.size(); i++) { \
             if (!tester(co->constants[i])) {                \
                 continue;                                   \
             }                                               \
@@ -23,15 +58,29 @@
                 return i;                                   \
             }                                               \
         }                                                   \
+        if (co->constants.size() == CONSTANTS_LIMIT) {      \
+            COMPILE_ERROR << "Too many constants.";         \
+        }                                                   \
         co->constants.push_back(allocator(value));          \
     } while(false)
 
 // Generic binary operator: (+ 1 2) OP_CONST, OP_CONST, OP_ADD
-#define GEN_BINARY_OP(op) \
-    do {                  \
-        gen(exp.list[1]); \
-        gen(exp.list[2]); \
-        emit(op);         \
+#define GEN_BINARY_OP(op)      \
+    do {                       \
+        checkArity(exp, 2, 2); \
+        gen(exp.list[1]);      \
+        gen(exp.list[2]);      \
+        emit(op);              \
+    } while (false)
+
+// Fixed arity operation: (array-get a 0) ..., OP_ARRAY_GET
+#define GEN_OP(op, count)                         \
+    do {                                          \
+        checkArity(exp, count, count);            \
+        for (size_t i = 1; i <= count; i++) {     \
+            gen(exp.list[i]);                     \
+        }                                         \
+        emit(op);                                 \
     } while (false)
 
 /**
@@ -39,36 +88,176 @@
  */
 class ChrisCompiler {
 public:
-        ChrisCompiler() : disassembler(std::make_unique<ChrisDisassembler>()) {}
+        ChrisCompiler(std::shared_ptr<Global> global)
+            : global(global),
+              disassembler(std::make_unique<ChrisDisassembler>(global)) {}
 
     /**
      * Main compile API.
      */
     CodeObject* compile(const Exp& exp) {
         // Allocate new code object:
-        co = AS_CODE(ALLOC_CODE("main"));
+        co = AS_CODE(ALLOC_CODE("main", 0));
+        stackDepth = 0;
+
+        codeObjects_.clear();
+        codeObjects_.push_back(co);
+        functions_ = {co};
+        location_ = {0, 0};
+        resetCse();
+
+        cfg_ = &cfgAt(0);
+        cfg_->begin(co, 0);
+
+        auto globalsCount = global->globals.size();
 
         // Generate recursively from top-level:
-        gen(exp);
+        try {
+            gen(exp);
 
-        // Explicit VM-stop marker.
-        emit(OP_HALT);
+            // Explicit VM-stop marker.
+            emit(OP_HALT);
+            cfg_->finish(cfgOptimizations_);
+        } catch (ChrisError& e) {
+            addLocation(e);
+
+            // Globals of the failed program don't exist.
+            global->truncate(globalsCount);
+            throw;
+        }
 
         return co;
     }
 
+    /**
+     * Incremental compile API (REPL, streaming).
+     *
+     * Appends code for the expression to the long-lived "main" code object,
+     * reusing its constant pool, and returns the entry offset of the
+     * appended code. Nothing is reallocated between expressions.
+     *
+     * The ints and strings of the pool are interned, so a stream of
+     * expressions only adds the constants it hasn't seen (the pool is
+     * never rewound with the code: traces keep decoding the old code).
+     *
+     * `firstLine` is the line of the expression in the whole input, so
+     * the line table of the program stays absolute.
+     */
+    size_t compileIncremental(const Exp& exp, int firstLine = 1) {
+        if (program == nullptr) {
+            program = AS_CODE(ALLOC_CODE("main", 0));
+        }
+
+        co = program;
+
+        codeObjects_.clear();
+        codeObjects_.push_back(co);
+        functions_ = {co};
+        location_ = {0, 0};
+        lineBase_ = firstLine - 1;
+        resetCse();
+
+        // Top-level code is never re-entered, so it is safe to drop it
+        // (the capacity is kept) to stay within the 2-byte address space.
+        if (getOffset() > INCREMENTAL_CODE_REWIND ||
+            co->loops.size() > INCREMENTAL_LOOPS_REWIND) {
+            co->code.clear();
+            co->lines.clear();
+            droppedLoops_.insert(droppedLoops_.end(), co->loops.begin(), co->loops.end());
+            co->loops.clear();
+            rewinds_++;
+        }
+
+        auto entry = getOffset();
+        auto loopsCount = co->loops.size();
+        auto constantsCount = co->constants.size();
+        auto globalsCount = global->globals.size();
+        stackDepth = 0;
+
+        cfg_ = &cfgAt(0);
+        cfg_->begin(co, entry);
+
+        try {
+            gen(exp);
+            emit(OP_HALT);
+            cfg_->finish(cfgOptimizations_);
+        } catch (ChrisError& e) {
+            addLocation(e);
+
+            // Drop partially emitted code and scopes, keep the program
+            // consistent.
+            co = program;
+            functions_ = {co};
+            co->code.resize(entry);
+            co->lines.truncate(entry);
+            co->loops.resize(loopsCount);
+            truncateProgramConstants(constantsCount);
+            global->truncate(globalsCount);
+            lineBase_ = 0;
+            co->scopeLevel = 0;
+            co->locals.clear();
+            throw;
+        }
+
+        lineBase_ = 0;
+
+        return entry;
+    }
+
+    /**
+     * Long-lived program of the incremental mode.
+     */
+    CodeObject* getProgram() { return program; }
+
+    /**
+     * Loops of the main code dropped by the incremental rewinds, with
+     * their statistics (the caller takes them over and clears it).
+     */
+    std::vector<LoopInfo>& getDroppedLoops() { return droppedLoops_; }
+
+    /**
+     * Number of times the incremental mode dropped the executed main code.
+     */
+    size_t getRewinds() { return rewinds_; }
+
+    /**
+     * Enables common subexpression elimination (on by default).
+     */
+    void setCse(bool enabled) { cseEnabled_ = enabled; }
+
+    /**
+     * Savings of common subexpression elimination in the last compilation.
+     */
+    const CseStats& getCseStats() { return cseStats_; }
+
+    /**
+     * Enables the control-flow graph passes and the hot/cold block layout
+     * (on by default; otherwise the blocks are linearized as emitted).
+     */
+    void setCfgOptimizations(bool enabled) { cfgOptimizations_ = enabled; }
+
     /**
      * Main compile loop.
+     *
+     * `isTail` is set when the value of the expression is the return
+     * value of the enclosing function (calls there are tail calls).
      */
-    void gen(const Exp& exp) {
+    void gen(const Exp& exp, bool isTail = false) {
+        // Each expression leaves exactly one value on the stack.
+        auto depth = stackDepth;
+
+        // Code of the expression maps to its location (left as is on
+        // errors, to report the innermost expression).
+        auto prevLocation = location_;
+        setLocation(exp);
+
         switch (exp.type) {
             /**
              * -----------------------------------------------
              * Numbers.
              */
             case ExpType::NUMBER:
-                emit(OP_CONST);
-                emit(numericConstIdx(exp.number));
+                emitConst(intConstIdx(exp.number));
                 break;
 
             /**
@@ -76,8 +265,7 @@ public:
              * Strings.
              */
             case ExpType::STRING:
-                emit(OP_CONST);
-                emit(stringConstIdx(exp.string));
+                emitConst(stringConstIdx(exp.string));
                 break;
 
             /**
@@ -88,11 +276,35 @@ public:
                 /**
                  * Boolean.
                  */
-                if (exp.string == "true" || exp.string == "false") {
-                    emit(OP_CONST);
-                    emit(booleanConstIdx(exp.string == "true" ? true : false));
+                if (exp.symbol == SYM_TRUE || exp.symbol == SYM_FALSE) {
+                    emitConst(booleanConstIdx(exp.symbol == SYM_TRUE));
                 } else {
-                    // Variables: TODO
+                    // Variables:
+                    auto varName = exp.string;
+
+                    // 1. Local vars:
+                    auto localIndex = co->getLocalIndex(varName);
+                    if (localIndex != -1) {
+                        emit(OP_GET_LOCAL);
+                        emit(localIndex);
+                        break;
+                    }
+
+                    // 2. Captured vars of enclosing functions:
+                    auto upvalueIndex = resolveUpvalue(functions_.size() - 1, varName);
+                    if (upvalueIndex != -1) {
+                        emit(OP_GET_UPVALUE);
+                        emit(upvalueIndex);
+                        break;
+                    }
+
+                    // 3. Global vars:
+                    auto globalIndex = global->getGlobalIndex(varName);
+                    if (globalIndex == -1) {
+                        COMPILE_ERROR << "Reference error: " << varName;
+                    }
+                    emit(OP_GET_GLOBAL);
+                    emit(globalIndex);
                 }
                 break;
 
@@ -101,40 +313,59 @@ public:
              * Lists.
              */
             case ExpType::LIST:
-                auto tag = exp.list[0];
+                if (exp.list.empty()) {
+                    COMPILE_ERROR << "Unexpected empty list ()";
+                }
+
+                // Common subexpression computed into a temp:
+                if (genCseOccurrence(exp)) {
+                    break;
+                }
+
+                const auto& tag = exp.list[0];
 
                 /**
                  * -----------------------------------------------
-                 * Special cases.
+                 * Special forms (by the interned symbol ID, the other
+                 * symbols and non-symbols are calls).
                  */
-                if (tag.type == ExpType::SYMBOL) {
-                    auto op = tag.string;
-
+                switch (tag.symbol) {
                     // -----------------------------------------------
                     // Binary math operations:
-                    if (op == "+") {
+                    case SYM_ADD: {
                         GEN_BINARY_OP(OP_ADD);
+                        break;
                     }
 
-                    else if (op == "-") {
+                    case SYM_SUB: {
                         GEN_BINARY_OP(OP_SUB);
+                        break;
                     }
 
-                    else if (op == "*") {
+                    case SYM_MUL: {
                         GEN_BINARY_OP(OP_MUL);
+                        break;
                     }
 
-                    else if (op == "/") {
+                    case SYM_DIV: {
                         GEN_BINARY_OP(OP_DIV);
+                        break;
                     }
 
                     // -----------------------------------------------
                     // Compare operations: (> 5 10)
-                    else if (compareOps_.count(op) != 0) {
+                    case SYM_LT:
+                    case SYM_GT:
+                    case SYM_EQ:
+                    case SYM_GE:
+                    case SYM_LE:
+                    case SYM_NE: {
+                        checkArity(exp, 2, 2);
                         gen(exp.list[1]);
                         gen(exp.list[2]);
                         emit(OP_COMPARE);
-                        emit(compareOps_[op]);
+                        emit(tag.symbol - SYM_LT);
+                        break;
                     }
 
                     // -----------------------------------------------
@@ -142,63 +373,816 @@ public:
                     /**
                      * (if <test> <consequent> <alternate>)
                      */
-                    else if (op == "if") {
+                    case SYM_IF: {
+                        checkArity(exp, 2, 3);
+
                         // Emit <test>:
                         gen(exp.list[1]);
+                        stackDepth--;
 
-                        // Else branch. Init with 0 address, wil be patched.
-                        emit(OP_JMP_IF_FALSE);
-
-                        // NOTE: we use 2-byte addresses:
-                        emit(0);
-                        emit(0);
-                        
-                        auto elseJmpAddr = getOffset() - 2;
+                        // The branches and the join point are basic blocks
+                        // (the jumps are emitted by the linearizer).
+                        auto consequent = cfg_->newBlock();
+                        auto alternate = cfg_->newBlock();
+                        auto join = cfg_->newBlock();
+                        cfg_->branch(consequent, alternate, location_);
 
                         // Emit <consequent>
+                        auto consequentStart = cfg_->position();
+                        cfg_->start(consequent);
+                        gen(exp.list[2], isTail);
+                        cfg_->jump(join, location_);
+
+                        // Alternate starts with the stack of the test.
+                        stackDepth = depth;
+
+                        // Emit <alternate> if we have it.
+                        auto alternateStart = cfg_->position();
+                        cfg_->start(alternate);
+                        if (exp.list.size() == 4) {
+                            gen(exp.list[3], isTail);
+                        } else {
+                            // Keep the stack balanced: (if <test> <consequent>)
+                            // evaluates to false when the test fails.
+                            emitConst(booleanConstIdx(false));
+                        }
+                        cfg_->jump(join, location_);
+
+                        // The unlikely branch is laid out after the hot code.
+                        switch (unlikelyBranch(exp)) {
+                            case 2:
+                                cfg_->markCold(consequentStart, alternateStart);
+                                break;
+                            case 3:
+                                cfg_->markCold(alternateStart, cfg_->position());
+                                break;
+                        }
+
+                        cfg_->start(join);
+                        break;
+                    }
+
+                    // -----------------------------------------------
+                    // Loop:
+                    /**
+                     * (while <test> <body>)
+                     *
+                     * The header (OP_LOOP) counts the iterations, the body
+                     * jumps back to it. Evaluates to false.
+                     */
+                    case SYM_WHILE: {
+                        checkArity(exp, 2, 2);
+
+                        if (co->loops.size() == LOOPS_LIMIT) {
+                            COMPILE_ERROR << "Too many loops.";
+                        }
+                        co->loops.push_back({location_});
+
+                        auto header = cfg_->newBlock();
+                        auto body = cfg_->newBlock();
+                        auto exit = cfg_->newBlock();
+                        cfg_->jump(header, location_);
+
+                        // Emit <test>:
+                        cfg_->start(header);
+                        emit(OP_LOOP);
+                        emit(co->loops.size() - 1);
+                        gen(exp.list[1]);
+                        stackDepth--;
+                        cfg_->branch(body, exit, location_);
+
+                        // Emit <body>, its value is discarded:
+                        cfg_->start(body);
                         gen(exp.list[2]);
+                        emit(OP_POP);
+                        stackDepth--;
+                        cfg_->jump(header, location_);
 
-                        emit(OP_JMP);
+                        cfg_->start(exit);
+                        emitConst(booleanConstIdx(false));
+                        break;
+                    }
 
-                        // 2-byte address:
-                        emit(0);
-                        emit(0);
+                    // -----------------------------------------------
+                    // Variable declaration: (var x (+ y 10))
+                    case SYM_VAR: {
+                        checkArity(exp, 2, 2);
+                        auto varName = symbolName(exp.list[1]);
 
-                        auto endAddr = getOffset() - 2;
+                        // Local vars are declared only in blocks (genBlock).
+                        if (!isGlobalScope()) {
+                            COMPILE_ERROR << "(var " << varName
+                                << " ...) must be declared directly in a block.";
+                        }
 
-                        // Patch the else branch address.
-                        auto elseBranchAddr = getOffset();
-                        patchJumpAddress(elseJmpAddr, elseBranchAddr);
+                        // Initializer:
+                        gen(exp.list[2]);
 
-                        // Emit <alternate> if we have it.
-                        if (exp.list.size() == 4) {
-                            gen(exp.list[3]);
+                        // Global vars:
+                        auto globalIndex = global->define(varName);
+                        emit(OP_SET_GLOBAL);
+                        emit(globalIndex);
+                        break;
+                    }
+
+                    // -----------------------------------------------
+                    // Variable assignment: (set x (+ y 10))
+                    case SYM_SET: {
+                        checkArity(exp, 2, 2);
+                        auto varName = symbolName(exp.list[1]);
+
+                        // Value:
+                        gen(exp.list[2]);
+
+                        // 1. Local vars:
+                        auto localIndex = co->getLocalIndex(varName);
+                        if (localIndex != -1) {
+                            emit(OP_SET_LOCAL);
+                            emit(localIndex);
+                            break;
+                        }
+
+                        // 2. Captured vars of enclosing functions:
+                        auto upvalueIndex = resolveUpvalue(functions_.size() - 1, varName);
+                        if (upvalueIndex != -1) {
+                            emit(OP_SET_UPVALUE);
+                            emit(upvalueIndex);
+                            break;
+                        }
+
+                        // 3. Global vars:
+                        auto globalIndex = global->getGlobalIndex(varName);
+                        if (globalIndex == -1) {
+                            COMPILE_ERROR << "Reference error: " << varName;
                         }
 
-                        // Patch the end.
-                        auto endBranchAddr = getOffset();
-                        patchJumpAddress(endAddr, endBranchAddr);
+                        emit(OP_SET_GLOBAL);
+                        emit(globalIndex);
+                        break;
+                    }
+
+                    // -----------------------------------------------
+                    // Blocks: (begin <expressions>)
+                    case SYM_BEGIN: {
+                        checkArity(exp, 1, SIZE_MAX);
+                        genBlock(exp, isTail);
+                        break;
+                    }
+
+                    // -----------------------------------------------
+                    // Function declaration: (def <name> <params> <body>)
+                    case SYM_DEF: {
+                        checkArity(exp, 3, 3);
+                        auto fnName = symbolName(exp.list[1]);
+
+                        // Local functions are declared only in blocks (genBlock).
+                        if (!isGlobalScope()) {
+                            COMPILE_ERROR << "(def " << fnName
+                                << " ...) must be declared directly in a block.";
+                        }
+
+                        // Define first, so the function can refer to itself.
+                        auto globalIndex = global->define(fnName);
+
+                        genFunction(fnName, exp.list[2], exp.list[3]);
+
+                        emit(OP_SET_GLOBAL);
+                        emit(globalIndex);
+                        break;
+                    }
+
+                    // -----------------------------------------------
+                    // Arrays: (array 1 2 3), (make-array <size> <value>)
+                    case SYM_ARRAY: {
+                        checkArity(exp, 0, UINT8_MAX);
+                        for (size_t i = 1; i < exp.list.size(); i++) {
+                            gen(exp.list[i]);
+                        }
+                        emit(OP_ARRAY);
+                        emit(exp.list.size() - 1);
+                        break;
+                    }
+
+                    case SYM_MAKE_ARRAY: {
+                        GEN_OP(OP_MAKE_ARRAY, 2);
+                        break;
+                    }
+
+                    // (array-get <array> <index>)
+                    case SYM_ARRAY_GET: {
+                        GEN_OP(OP_ARRAY_GET, 2);
+                        break;
+                    }
+
+                    // (array-set <array> <index> <value>)
+                    case SYM_ARRAY_SET: {
+                        GEN_OP(OP_ARRAY_SET, 3);
+                        break;
+                    }
+
+                    case SYM_ARRAY_LENGTH: {
+                        GEN_OP(OP_ARRAY_LENGTH, 1);
+                        break;
+                    }
+
+                    // (array-push <array> <value>)
+                    case SYM_ARRAY_PUSH: {
+                        GEN_OP(OP_ARRAY_PUSH, 2);
+                        break;
+                    }
+
+                    // Bulk operations: (array-sum a), (array-add a 1),
+                    // (array-dot a b)
+                    case SYM_ARRAY_SUM: {
+                        GEN_OP(OP_ARRAY_SUM, 1);
+                        break;
+                    }
+
+                    case SYM_ARRAY_ADD: {
+                        GEN_OP(OP_ARRAY_ADD, 2);
+                        break;
+                    }
+
+                    case SYM_ARRAY_DOT: {
+                        GEN_OP(OP_ARRAY_DOT, 2);
+                        break;
+                    }
+
+                    // -----------------------------------------------
+                    // Hash maps: (hash-map "a" 1 "b" 2)
+                    case SYM_HASH_MAP: {
+                        checkArity(exp, 0, UINT8_MAX - 1);
+                        if (exp.list.size() % 2 == 0) {
+                            COMPILE_ERROR << "(hash-map ...): expected key-value pairs";
+                        }
+                        for (size_t i = 1; i < exp.list.size(); i++) {
+                            gen(exp.list[i]);
+                        }
+                        emit(OP_MAP);
+                        emit(exp.list.size() - 1);
+                        break;
                     }
+
+                    // (map-get <map> <key>)
+                    case SYM_MAP_GET: {
+                        GEN_OP(OP_MAP_GET, 2);
+                        break;
+                    }
+
+                    // (map-set <map> <key> <value>)
+                    case SYM_MAP_SET: {
+                        GEN_OP(OP_MAP_SET, 3);
+                        break;
+                    }
+
+                    // (map-has <map> <key>)
+                    case SYM_MAP_HAS: {
+                        GEN_OP(OP_MAP_HAS, 2);
+                        break;
+                    }
+
+                    case SYM_MAP_SIZE: {
+                        GEN_OP(OP_MAP_SIZE, 1);
+                        break;
+                    }
+
+                    // -----------------------------------------------
+                    // Anonymous function: (lambda <params> <body>)
+                    case SYM_LAMBDA: {
+                        checkArity(exp, 2, 2);
+                        genFunction("lambda", exp.list[1], exp.list[2]);
+                        break;
+                    }
+
+                    // -----------------------------------------------
+                    // Function calls: (square 2)
+                    default:
+                        genCall(exp, isTail);
+                        break;
                 }
+
+                genCseDefinition(exp);
                 break;
         }
+
+        stackDepth = depth + 1;
+        location_ = prevLocation;
     }
 
     /**
      * Disassemble all complication units.
      */
-    void disassemblyBytecode() { disassembler->disassemble(co); }
+    void disassemblyBytecode() {
+        for (auto& co_ : codeObjects_) {
+            disassembler->disassemble(co_);
+        }
+    }
+
+    /**
+     * Code objects (main and functions) produced by the last compilation.
+     */
+    const std::vector<CodeObject*>& getCodeObjects() { return codeObjects_; }
 private:
+    /**
+     * Global object.
+     */
+    std::shared_ptr<Global> global;
+
     /**
      * Disassembler.
      */
     std::unique_ptr<ChrisDisassembler> disassembler;
 
+    /**
+     * Verifies the number of operands of a form.
+     */
+    void checkArity(const Exp& exp, size_t min, size_t max) {
+        auto count = exp.list.size() - 1;
+        if (count < min || count > max) {
+            COMPILE_ERROR << "(" << exp.list[0].string << " ...): expected "
+                << min << (min == max ? "" : "-" + std::to_string(max))
+                << " operands, got " << count;
+        }
+    }
+
+    /**
+     * Compiles a block: (begin <expressions>)
+     *
+     * Block locals live directly on the operand stack: the initializer value
+     * stays in its stack slot, and OP_SCOPE_EXIT drops all block locals
+     * at the end, keeping the block result on top.
+     */
+    void genBlock(const Exp& block, bool isTail) {
+        scopeEnter();
+
+        auto blockLocation = location_;
+
+        // Temps live in the block scope (SCOPE_EXIT costs an instruction
+        // if the block has no locals).
+        auto hasLocals = std::any_of(block.list.begin() + 1, block.list.end(),
+                                     [&](const Exp& exp) { return isDeclaration(exp); });
+        auto temps = analyzeCse(block.list.data() + 1, block.list.size() - 1, !hasLocals);
+
+        for (size_t i = 1; i < block.list.size(); i++) {
+            const auto& exp = block.list[i];
+            bool isLast = i == block.list.size() - 1;
+
+            genCseTemps(temps, i - 1);
+
+            if (isDeclaration(exp)) {
+                setLocation(exp);
+
+                auto isFunction = exp.list[0].symbol == SYM_DEF;
+                checkArity(exp, isFunction ? 3 : 2, isFunction ? 3 : 2);
+                auto varName = symbolName(exp.list[1]);
+
+                // The initializer value becomes the local slot.
+                if (isFunction) {
+                    genFunction(varName, exp.list[2], exp.list[3]);
+                } else {
+                    gen(exp.list[2]);
+                }
+
+                auto slot = stackDepth - 1;
+                if (slot > UINT8_MAX) {
+                    COMPILE_ERROR << "Too many locals.";
+                }
+                co->addLocal(varName, slot);
+
+                // Declaration as the block result: push its value.
+                if (isLast) {
+                    emit(OP_GET_LOCAL);
+                    emit(slot);
+                    stackDepth++;
+                }
+
+                location_ = blockLocation;
+                continue;
+            }
+
+            // The block locals die with the frame, so the last expression
+            // of a block in tail position is in tail position too.
+            gen(exp, isTail && isLast);
+
+            // Intermediate results are discarded.
+            if (!isLast) {
+                emit(OP_POP);
+                stackDepth--;
+            }
+        }
+
+        scopeExit();
+    }
+
+    /**
+     * Whether the expression is a variable or function declaration.
+     */
+    bool isDeclaration(const Exp& exp) {
+        return exp.type == ExpType::LIST && !exp.list.empty() &&
+            exp.list[0].type == ExpType::SYMBOL &&
+            (exp.list[0].symbol == SYM_VAR || exp.list[0].symbol == SYM_DEF);
+    }
+
+    /**
+     * Compiles a function into its own code object, and pushes the
+     * function object (stored in the constant pool).
+     *
+     * Calling convention: the callee and the arguments stay in place on
+     * the caller's operand stack and become slots 0..arity of the callee
+     * frame. The function drops them on exit, leaving the result.
+     *
+     * Functions which capture variables of enclosing functions are
+     * wrapped into a closure at runtime (OP_CLOSURE), others are used
+     * directly from the constant pool.
+     */
+    void genFunction(const std::string& fnName, const Exp& params, const Exp& body) {
+        if (params.type != ExpType::LIST) {
+            COMPILE_ERROR << fnName << ": expected a parameter list.";
+        }
+
+        auto arity = params.list.size();
+
+        if (arity >= UINT8_MAX) {
+            COMPILE_ERROR << fnName << ": too many parameters.";
+        }
+
+        auto prevCo = co;
+        auto prevCfg = cfg_;
+        auto prevStackDepth = stackDepth;
+
+        co = AS_CODE(ALLOC_CODE(fnName, arity));
+        codeObjects_.push_back(co);
+        functions_.push_back(co);
+
+        cfg_ = &cfgAt(functions_.size() - 1);
+        cfg_->begin(co, 0);
+
+        // The function itself (for recursive calls) and the parameters:
+        co->scopeLevel = 1;
+        co->addLocal(fnName, 0);
+        for (size_t i = 0; i < arity; i++) {
+            co->addLocal(symbolName(params.list[i]), i + 1);
+        }
+        stackDepth = arity + 1;
+
+        // Temps of a block body live in the block.
+        auto isBlock = body.type == ExpType::LIST && !body.list.empty() &&
+            body.list[0].symbol == SYM_BEGIN;
+        auto temps = analyzeCse(&body, isBlock ? 0 : 1, false);
+        genCseTemps(temps, 0);
+
+        gen(body, true);
+
+        // Drop the callee, the arguments and the temps (all the slots below
+        // the result):
+        emit(OP_SCOPE_EXIT);
+        emit(stackDepth - 1);
+
+        emit(OP_RETURN);
+        cfg_->finish(cfgOptimizations_);
+
+        auto fn = ALLOC_FUNCTION(co);
+        auto isClosure = !co->upvalues.empty();
+
+        functions_.pop_back();
+        co = prevCo;
+        cfg_ = prevCfg;
+
+        auto index = addConst(fn);
+        if (!isClosure) {
+            emitConst(index);
+        } else if (index < SHORT_CONSTANTS_LIMIT) {
+            emit(OP_CLOSURE);
+            emit(index);
+        } else {
+            COMPILE_ERROR << "Too many constants for a closure.";
+        }
+        stackDepth = prevStackDepth + 1;
+    }
+
+    /**
+     * Resolves a variable of enclosing functions captured by the function
+     * at the level (index in `functions_`), returns the upvalue index,
+     * -1 if not found.
+     *
+     * Captures are flat: a variable of an outer function is captured by
+     * every function in between, so a closure only reads its own upvalues.
+     */
+    int resolveUpvalue(size_t level, const std::string& name) {
+        // Main code has no enclosing function.
+        if (level == 0) {
+            return -1;
+        }
+
+        auto fn = functions_[level];
+
+        auto index = fn->getUpvalueIndex(name);
+        if (index != -1) {
+            return index;
+        }
+
+        auto localIndex = functions_[level - 1]->getLocalIndex(name);
+        if (localIndex != -1) {
+            return addUpvalue(fn, name, true, localIndex);
+        }
+
+        auto upvalueIndex = resolveUpvalue(level - 1, name);
+        if (upvalueIndex != -1) {
+            return addUpvalue(fn, name, false, upvalueIndex);
+        }
+
+        return -1;
+    }
+
+    /**
+     * Adds a captured variable to the function.
+     */
+    int addUpvalue(CodeObject* fn, const std::string& name, bool isLocal, size_t index) {
+        if (fn->upvalues.size() == UINT8_MAX + 1) {
+            COMPILE_ERROR << fn->name << ": too many captured variables.";
+        }
+        fn->upvalues.push_back({name, isLocal, index});
+        return fn->upvalues.size() - 1;
+    }
+
+    /**
+     * Compiles a function call: (<callee> <arguments>)
+     *
+     * Calls in tail position reuse the frame of the caller (OP_TAIL_CALL),
+     * so tail-recursive loops run in constant stack. Calls of globals
+     * bound to natives at compile time use OP_NATIVE_CALL (natives have
+     * no frame, so there is nothing to reuse).
+     */
+    void genCall(const Exp& exp, bool isTail) {
+        auto argsCount = exp.list.size() - 1;
+
+        if (argsCount >= UINT8_MAX) {
+            COMPILE_ERROR << "Too many arguments.";
+        }
+
+        // The callee and the arguments form the frame of the callee.
+        for (const auto& arg : exp.list) {
+            gen(arg);
+        }
+
+        if (isNativeGlobal(exp.list[0])) {
+            emit(OP_NATIVE_CALL);
+        } else {
+            emit(isTail ? OP_TAIL_CALL : OP_CALL);
+        }
+        emit(argsCount);
+    }
+
+    /**
+     * Whether the callee is a global currently bound to a native.
+     */
+    bool isNativeGlobal(const Exp& callee) {
+        if (callee.type != ExpType::SYMBOL || co->getLocalIndex(callee.string) != -1 ||
+            resolveUpvalue(functions_.size() - 1, callee.string) != -1) {
+            return false;
+        }
+        auto globalIndex = global->getGlobalIndex(callee.string);
+        return globalIndex != -1 && IS_NATIVE(global->get(globalIndex).value);
+    }
+
+    /**
+     * Index of the statically unlikely branch of an `if` (in the list),
+     * 0 if unknown.
+     *
+     * Equality rarely holds, and a constant or a variable next to a
+     * computation is usually the base case of a recursion.
+     */
+    size_t unlikelyBranch(const Exp& exp) {
+        const auto& test = exp.list[1];
+        if (test.type == ExpType::LIST && !test.list.empty()) {
+            if (test.list[0].symbol == SYM_EQ) {
+                return 2;
+            }
+            if (test.list[0].symbol == SYM_NE) {
+                return 3;
+            }
+        }
+
+        if (exp.list.size() < 4) {
+            return 0;
+        }
+
+        auto isLeaf = [](const Exp& branch) { return branch.type != ExpType::LIST; };
+        if (isLeaf(exp.list[2]) && !isLeaf(exp.list[3])) {
+            return 2;
+        }
+        if (isLeaf(exp.list[3]) && !isLeaf(exp.list[2])) {
+            return 3;
+        }
+        return 0;
+    }
+
+    /**
+     * Control-flow graph of the function at the level (reused between
+     * compilations).
+     */
+    ControlFlowGraph& cfgAt(size_t level) {
+        while (cfgs_.size() <= level) {
+            cfgs_.push_back(std::make_unique<ControlFlowGraph>());
+        }
+        return *cfgs_[level];
+    }
+
+    /**
+     * Finds the common subexpressions of a region (block statements,
+     * function body), returns the range of its temps.
+     */
+    std::pair<size_t, size_t> analyzeCse(const Exp* statements, size_t count,
+                                         bool needsScopeExit) {
+        auto first = cseTemps_.size();
+        if (cseEnabled_ && count > 0) {
+            cseAnalysis_.analyze(statements, count, needsScopeExit, cseTemps_,
+                                 cseOccurrences_, cseStats_);
+        }
+        return {first, cseTemps_.size()};
+    }
+
+    /**
+     * Pushes the temps of the region statement as hidden locals: the
+     * hoisted values, and placeholders assigned by the definitions.
+     */
+    void genCseTemps(std::pair<size_t, size_t>& temps, size_t statement) {
+        for (; temps.first < temps.second; temps.first++) {
+            auto& temp = cseTemps_[temps.first];
+            if (temp.statement != statement) {
+                break;
+            }
+
+            if (temp.hoisted) {
+                gen(*temp.exp);
+            } else {
+                emitConst(booleanConstIdx(false));
+                stackDepth++;
+            }
+
+            auto slot = stackDepth - 1;
+            if (slot >= UINT8_MAX) {
+                COMPILE_ERROR << "Too many locals.";
+            }
+            co->addLocal(CSE_TEMP_NAME, slot);
+            temp.slot = slot;
+        }
+    }
+
+    /**
+     * Reads the temp instead of computing a common subexpression, returns
+     * false if the expression must be computed.
+     */
+    bool genCseOccurrence(const Exp& exp) {
+        if (cseOccurrences_.empty()) {
+            return false;
+        }
+
+        auto occurrence = cseOccurrences_.find(&exp);
+        if (occurrence == cseOccurrences_.end()) {
+            return false;
+        }
+
+        // A hoisted definition reads the temp once it is computed.
+        const auto& temp = cseTemps_[occurrence->second.temp];
+        if (occurrence->second.isDefinition && (!temp.hoisted || temp.slot == -1)) {
+            return false;
+        }
+
+        emit(OP_GET_LOCAL);
+        emit(temp.slot);
+        return true;
+    }
+
+    /**
+     * Stores the value of the definition into its placeholder temp.
+     */
+    void genCseDefinition(const Exp& exp) {
+        if (cseOccurrences_.empty()) {
+            return;
+        }
+
+        auto occurrence = cseOccurrences_.find(&exp);
+        if (occurrence == cseOccurrences_.end() || !occurrence->second.isDefinition) {
+            return;
+        }
+
+        const auto& temp = cseTemps_[occurrence->second.temp];
+        if (!temp.hoisted) {
+            emit(OP_SET_LOCAL);
+            emit(temp.slot);
+        }
+    }
+
+    /**
+     * Drops the temps of the previous compilation.
+     */
+    void resetCse() {
+        cseTemps_.clear();
+        cseOccurrences_.clear();
+        cseStats_ = {};
+    }
+
+    /**
+     * Whether we're at the top-level (globals) scope.
+     */
+    bool isGlobalScope() { return co->scopeLevel == 0; }
+
+    /**
+     * Enters a new block scope.
+     */
+    void scopeEnter() { co->scopeLevel++; }
+
+    /**
+     * Exits a block scope, dropping its locals from the stack.
+     */
+    void scopeExit() {
+        size_t varsCount = 0;
+        while (!co->locals.empty() && co->locals.back().scopeLevel == co->scopeLevel) {
+            co->locals.pop_back();
+            varsCount++;
+        }
+
+        if (varsCount > UINT8_MAX) {
+            COMPILE_ERROR << "Too many locals in a block.";
+        }
+
+        if (varsCount > 0) {
+            emit(OP_SCOPE_EXIT);
+            emit(varsCount);
+        }
+
+        co->scopeLevel--;
+    }
+
+    /**
+     * Returns the name of a symbol expression (variable names).
+     */
+    const std::string& symbolName(const Exp& exp) {
+        if (exp.type != ExpType::SYMBOL) {
+            COMPILE_ERROR << "Expected a variable name.";
+        }
+        return exp.string;
+    }
+
     /**
      * Returns current bytecode offset.
      */
     size_t getOffset() { return co->code.size(); }
 
+    /**
+     * Adds a constant to the pool (no dedup).
+     */
+    size_t addConst(const ChrisValue& value) {
+        if (co->constants.size() == CONSTANTS_LIMIT) {
+            COMPILE_ERROR << "Too many constants.";
+        }
+        co->constants.push_back(value);
+        return co->constants.size() - 1;
+    }
+
+    /**
+     * Emits the push of the constant.
+     */
+    void emitConst(size_t index) {
+        if (index < SHORT_CONSTANTS_LIMIT) {
+            emit(OP_CONST);
+            emit(index);
+        } else {
+            emit(OP_CONST_WIDE);
+            emit((index >> 8) & 0xff);
+            emit(index & 0xff);
+        }
+    }
+
+    /**
+     * Returns the index of an interned constant of the program pool
+     * (adds it on the first use).
+     */
+    template <typename Key, typename Make>
+    size_t internConst(std::unordered_map<Key, size_t>& interned, const Key& key, Make make) {
+        auto it = interned.find(key);
+        if (it != interned.end()) {
+            return it->second;
+        }
+        auto index = addConst(make());
+        interned.emplace(key, index);
+        return index;
+    }
+
+    /**
+     * Drops the program constants added since the count (failed compile).
+     */
+    void truncateProgramConstants(size_t count) {
+        program->constants.resize(count);
+        for (auto it = programInts_.begin(); it != programInts_.end();) {
+            it = it->second >= count ? programInts_.erase(it) : std::next(it);
+        }
+        for (auto it = programStrings_.begin(); it != programStrings_.end();) {
+            it = it->second >= count ? programStrings_.erase(it) : std::next(it);
+        }
+    }
+
     /**
      * Allocates a numeric constant.
      */
@@ -207,11 +1191,26 @@ private:
         return co->constants.size() - 1;
     }
 
+    /**
+     * Allocates an integer constant (deduplicated by the integer value,
+     * never merged with an equal double).
+     */
+    size_t intConstIdx(int64_t value) {
+        if (co == program) {
+            return internConst(programInts_, value, [&]() { return INT(value); });
+        }
+        ALLOC_CONST(IS_INT, AS_INT, INT, value);
+        return co->constants.size() - 1;
+    }
+
     /**
      * Allocates a string constant.
      */
     size_t stringConstIdx(const std::string& value) {
-        ALLOC_CONST(IS_NUMBER, AS_CPPSTRING, ALLOC_STRING, value);
+        if (co == program) {
+            return internConst(programStrings_, value, [&]() { return ALLOC_STRING(value); });
+        }
+        ALLOC_CONST(IS_STRING, AS_CPPSTRING, ALLOC_STRING, value);
         return co->constants.size() - 1;
     }
 
@@ -226,21 +1225,29 @@ private:
     /**
      * Emits data to the bytecode.
      */
-    void emit(uint8_t code) { co->code.push_back(code); }
+    void emit(uint8_t code) {
+        co->lines.add(co->code.size(), location_.line, location_.column);
+        co->code.push_back(code);
+    }
 
     /**
-     * Writes byte at offset.
+     * Makes the expression location current (if known).
      */
-    void writeByteAtOffset(size_t offset, uint8_t value) {
-        co->code[offset] = value;
+    void setLocation(const Exp& exp) {
+        if (exp.line > 0) {
+            location_ = {lineBase_ + exp.line, exp.column};
+        }
     }
 
     /**
-     * Patches jump address.
+     * Sets the location of the expression being compiled on an error
+     * without one.
      */
-    void patchJumpAddress(size_t offset, uint16_t value) {
-        writeByteAtOffset(offset, (value >> 8) & 0xff);
-        writeByteAtOffset(offset + 1, value & 0xff);
+    void addLocation(ChrisError& e) {
+        if (e.line == 0) {
+            e.line = location_.line;
+            e.column = location_.column;
+        }
     }
 
     /**
@@ -249,16 +1256,66 @@ private:
     CodeObject* co;
 
     /**
-     * Compares ops map.
+     * Main code object of the incremental mode.
      */
-    static std::map<std::string, uint8_t> compareOps_;
-};
+    CodeObject* program = nullptr;
 
-/**
- * Compare ops map.
- */
-std::map<std::string, uint8_t> ChrisCompiler::compareOps_ = {
-    {"<", 0}, {">", 1}, {"==", 2}, {">=", 3}, {"<=", 4}, {"!=", 5},
+    /**
+     * Dropped loops of the incremental mode (see getDroppedLoops).
+     */
+    std::vector<LoopInfo> droppedLoops_;
+
+    size_t rewinds_ = 0;
+
+    /**
+     * Interned ints and strings of the program pool (by pool index).
+     */
+    std::unordered_map<int64_t, size_t> programInts_;
+    std::unordered_map<std::string, size_t> programStrings_;
+
+    /**
+     * Code objects of the last compilation.
+     */
+    std::vector<CodeObject*> codeObjects_;
+
+    /**
+     * Functions being compiled, main code first and the innermost last
+     * (used to resolve captured variables).
+     */
+    std::vector<CodeObject*> functions_;
+
+    /**
+     * Operand stack depth (relative to the frame) at the current point
+     * of the generated code, used to assign local slots.
+     */
+    size_t stackDepth = 0;
+
+    /**
+     * Common subexpression elimination.
+     */
+    bool cseEnabled_ = true;
+    CseAnalysis cseAnalysis_;
+    std::vector<CseTemp> cseTemps_;
+    std::unordered_map<const Exp*, CseOccurrence> cseOccurrences_;
+    CseStats cseStats_;
+
+    /**
+     * Control-flow graphs of the functions being compiled (by level in
+     * `functions_`), and the one of the current function.
+     */
+    std::vector<std::unique_ptr<ControlFlowGraph>> cfgs_;
+    ControlFlowGraph* cfg_ = nullptr;
+    bool cfgOptimizations_ = true;
+
+    /**
+     * Source location of the expression being compiled.
+     */
+    SourceLocation location_{0, 0};
+
+    /**
+     * Added to the expression lines (incremental mode).
+     */
+    int lineBase_ = 0;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,577 @@
+/**
+ * Common subexpression elimination.
+ */
+
+#ifndef CommonSubexpressions_h
+#define CommonSubexpressions_h
+
+#include <algorithm>
+#include <numeric>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "../parser/ChrisParser.h"
+
+/**
+ * Temporary slot holding the value of a common subexpression.
+ */
+struct CseTemp {
+    /**
+     * Defining occurrence (evaluated before all the reuses).
+     */
+    const Exp* exp;
+
+    /**
+     * Statement of the region with the defining occurrence.
+     */
+    size_t statement;
+
+    /**
+     * Whether the value is computed right before the statement (nothing
+     * observable moves: the definition isn't in a branch, and only
+     * variables and constants are evaluated before it). Otherwise the
+     * defining occurrence stores it into a placeholder slot.
+     */
+    bool hoisted;
+
+    /**
+     * Stack slot (assigned by the compiler).
+     */
+    int slot;
+};
+
+/**
+ * Occurrence of a common subexpression: the defining one, or a reuse
+ * of the temp.
+ */
+struct CseOccurrence {
+    size_t temp;
+    bool isDefinition;
+};
+
+/**
+ * Static savings of the eliminated subexpressions: bytecode size, and
+ * instructions per evaluation of the regions.
+ */
+struct CseStats {
+    size_t eliminated = 0;
+    size_t bytesSaved = 0;
+    size_t instructionsSaved = 0;
+};
+
+/**
+ * Finds the common subexpressions of a region (the statements of a
+ * block, or a function body).
+ *
+ * Pure subtrees (SYMF_PURE operators over variables and constants) are
+ * hash-consed: equal subtrees get the same structural hash, and are
+ * compared once grouped by it. A repeated one is evaluated once into a
+ * temp if the first occurrence dominates the others (it isn't in an `if`
+ * branch they aren't in), and nothing which may assign variables (calls,
+ * set, nested blocks) is evaluated in between. Variables are hashed with
+ * their declaration, so shadowing only changes the expressions which
+ * read the name.
+ */
+class CseAnalysis {
+    public:
+    /**
+     * Appends the temps of the region (in the statements order) and maps
+     * their occurrences.
+     * `needsScopeExit` is set when dropping the temps costs a
+     * SCOPE_EXIT instruction (the region has no locals otherwise).
+     */
+    void analyze(const Exp* statements, size_t count, bool needsScopeExit,
+                 std::vector<CseTemp>& temps,
+                 std::unordered_map<const Exp*, CseOccurrence>& occurrences,
+                 CseStats& stats) {
+        reset();
+
+        for (statement_ = 0; statement_ < count; statement_++) {
+            compoundSeen_ = false;
+            scanStatement(statements[statement_]);
+        }
+
+        if (nodes_.size() > 1) {
+            select(needsScopeExit, temps, occurrences, stats);
+        }
+    }
+
+    private:
+    /**
+     * Value of a scanned expression: structural hash and code cost.
+     */
+    struct Value {
+        bool isPure = false;
+        uint64_t hash = 0;
+        size_t bytes = 0;
+        size_t instructions = 0;
+    };
+
+    /**
+     * Pure compound subexpression found by the scan.
+     */
+    struct Node {
+        const Exp* exp;
+        Value value;
+
+        /**
+         * Barriers (possible assignments) scanned before.
+         */
+        size_t generation;
+
+        size_t statement;
+
+        /**
+         * Evaluated unconditionally, and only variables and constants are
+         * evaluated before it in the statement.
+         */
+        bool hoistable;
+
+        /**
+         * Innermost `if` branch (-1 if none).
+         */
+        int branch;
+
+        /**
+         * Nodes of the subtree are [firstNested, own index) (post-order).
+         */
+        size_t firstNested;
+    };
+
+    /**
+     * `if` branch: the branches scanned while in it (itself included) are
+     * numbered [first, end).
+     */
+    struct Branch {
+        size_t first;
+        size_t end;
+    };
+
+    /**
+     * Equal expressions: [start, end) of the grouped node indices.
+     */
+    struct Group {
+        size_t start;
+        size_t end;
+    };
+
+    enum HashKind : uint64_t {
+        HASH_NUMBER,
+        HASH_STRING,
+        HASH_BOOLEAN,
+        HASH_VARIABLE,
+        HASH_OPERATION,
+    };
+
+    void reset() {
+        nodes_.clear();
+        branches_.clear();
+        declarations_.clear();
+        generation_ = 0;
+        branch_ = -1;
+    }
+
+    /**
+     * Scans a statement of the region. A declaration after its initializer
+     * renumbers the name: it may shadow a variable, the expressions read
+     * before keep their values.
+     */
+    void scanStatement(const Exp& exp) {
+        if (exp.type == ExpType::LIST && exp.list.size() >= 3 &&
+            exp.list[1].type == ExpType::SYMBOL) {
+            auto symbol = exp.list[0].symbol;
+
+            if (symbol == SYM_VAR) {
+                scan(exp.list[2]);
+                declare(exp.list[1].string);
+                return;
+            }
+
+            // Function definitions have no effects.
+            if (symbol == SYM_DEF) {
+                declare(exp.list[1].string);
+                compoundSeen_ = true;
+                return;
+            }
+        }
+        scan(exp);
+    }
+
+    /**
+     * Scans an operand of a pure operator.
+     */
+    Value scanOperand(const Exp& exp) {
+        switch (exp.type) {
+            case ExpType::NUMBER:
+                return leaf(HASH_NUMBER, exp.number, 0);
+
+            case ExpType::STRING:
+                return leaf(HASH_STRING, std::hash<std::string_view>{}(exp.string), 0);
+
+            case ExpType::SYMBOL:
+                if (exp.symbol == SYM_TRUE || exp.symbol == SYM_FALSE) {
+                    return leaf(HASH_BOOLEAN, exp.symbol, 0);
+                }
+                return leaf(HASH_VARIABLE, std::hash<std::string_view>{}(exp.string),
+                            declaration(exp.string));
+
+            case ExpType::LIST:
+                break;
+        }
+        return scan(exp);
+    }
+
+    /**
+     * Scans the expression in evaluation order (the value is pure only
+     * for compound expressions: the other leaves are never shared).
+     */
+    Value scan(const Exp& exp) {
+        if (exp.type != ExpType::LIST || exp.list.empty()) {
+            return {false};
+        }
+
+        auto symbol = exp.list[0].symbol;
+
+        // Branches: only the test is evaluated unconditionally.
+        if (symbol == SYM_IF && (exp.list.size() == 3 || exp.list.size() == 4)) {
+            scan(exp.list[1]);
+            for (size_t i = 2; i < exp.list.size(); i++) {
+                auto parent = branch_;
+                branch_ = (int)branches_.size();
+                branches_.push_back({branches_.size(), 0});
+                scan(exp.list[i]);
+                branches_[branch_].end = branches_.size();
+                branch_ = parent;
+            }
+            compoundSeen_ = true;
+            return {false};
+        }
+
+        // Pure binary operators:
+        auto flags = SymbolTable::flags(symbol);
+        if ((flags & SYMF_PURE) && exp.list.size() == 3) {
+            auto hoistable = !compoundSeen_ && branch_ == -1;
+            auto firstNested = nodes_.size();
+
+            auto op1 = scanOperand(exp.list[1]);
+            auto op2 = scanOperand(exp.list[2]);
+            compoundSeen_ = true;
+
+            if (!op1.isPure || !op2.isPure) {
+                return {false};
+            }
+
+            Value value{true, combine(HASH_OPERATION | symbol << 3, op1.hash, op2.hash),
+                        op1.bytes + op2.bytes + operatorBytes(symbol),
+                        op1.instructions + op2.instructions + 1};
+
+            // Results which may be new objects aren't shared.
+            if (!(flags & SYMF_ALLOCATES)) {
+                nodes_.push_back({&exp, value, generation_, statement_, hoistable, branch_,
+                                  firstNested});
+            }
+            return value;
+        }
+
+        // Nested functions are separate regions, creating a closure has no
+        // effects.
+        if (symbol == SYM_LAMBDA) {
+            compoundSeen_ = true;
+            return {false};
+        }
+
+        // Nested blocks are separate regions, and so are loops (their
+        // operands are evaluated again after the assignments of the body).
+        if (symbol == SYM_BEGIN || symbol == SYM_DEF || symbol == SYM_WHILE) {
+            barrier();
+            return {false};
+        }
+
+        // Anything else (calls, set, containers) is a barrier after its
+        // operands.
+        for (size_t i = symbol == SYM_NONE ? 0 : 1; i < exp.list.size(); i++) {
+            scan(exp.list[i]);
+        }
+        barrier();
+        return {false};
+    }
+
+    /**
+     * New variable with the name.
+     */
+    void declare(std::string_view name) {
+        declarations_[name] = declarations_.size() + 1;
+    }
+
+    /**
+     * Declaration of the variable in the region (0 if declared outside).
+     */
+    uint64_t declaration(std::string_view name) {
+        if (declarations_.empty()) {
+            return 0;
+        }
+        auto it = declarations_.find(name);
+        return it == declarations_.end() ? 0 : it->second;
+    }
+
+    /**
+     * Variables may be assigned from here on.
+     */
+    void barrier() {
+        generation_++;
+        compoundSeen_ = true;
+    }
+
+    /**
+     * Variable or constant: one 2-byte instruction.
+     */
+    static Value leaf(uint64_t kind, uint64_t a, uint64_t b) {
+        return {true, combine(kind, a, b), 2, 1};
+    }
+
+    static uint64_t combine(uint64_t kind, uint64_t a, uint64_t b) {
+        return mix(mix(kind ^ a) + b);
+    }
+
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdull;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ull;
+        return x ^ (x >> 33);
+    }
+
+    static size_t operatorBytes(Symbol symbol) {
+        // OP_COMPARE has the compare op operand.
+        return symbol >= SYM_LT && symbol <= SYM_NE ? 2 : 1;
+    }
+
+    /**
+     * Whether the expressions are equal (the hashes told the names apart).
+     */
+    static bool isSame(const Exp& a, const Exp& b) {
+        if (a.type != b.type) {
+            return false;
+        }
+        switch (a.type) {
+            case ExpType::NUMBER:
+                return a.number == b.number;
+            case ExpType::STRING:
+            case ExpType::SYMBOL:
+                return a.string == b.string;
+            case ExpType::LIST:
+                break;
+        }
+        if (a.list.size() != b.list.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.list.size(); i++) {
+            if (!isSame(a.list[i], b.list[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Whether the node (of the same generation) is evaluated before the
+     * other one on all paths to it.
+     */
+    bool dominates(const Node& node, const Node& other) {
+        if (node.branch == -1) {
+            return true;
+        }
+        const auto& branch = branches_[node.branch];
+        return other.branch >= (int)branch.first && other.branch < (int)branch.end;
+    }
+
+    /**
+     * Groups the equal nodes of [first, last) in evaluation order, the
+     * largest expressions first. A node colliding by the hash is left
+     * unshared.
+     */
+    void group(size_t first, size_t last) {
+        order_.resize(last - first);
+        std::iota(order_.begin(), order_.end(), first);
+        std::sort(order_.begin(), order_.end(), [&](size_t a, size_t b) {
+            auto hashA = nodes_[a].value.hash;
+            auto hashB = nodes_[b].value.hash;
+            return hashA != hashB ? hashA < hashB : a < b;
+        });
+
+        groups_.clear();
+        size_t grouped = 0;
+
+        for (size_t start = 0, end = 0; start < order_.size(); start = end) {
+            const auto& node = nodes_[order_[start]];
+            auto groupStart = grouped;
+
+            for (end = start; end < order_.size() &&
+                 nodes_[order_[end]].value.hash == node.value.hash; end++) {
+                if (end == start || isSame(*node.exp, *nodes_[order_[end]].exp)) {
+                    order_[grouped++] = order_[end];
+                }
+            }
+
+            if (grouped - groupStart > 1) {
+                groups_.push_back({groupStart, grouped});
+            } else {
+                grouped = groupStart;
+            }
+        }
+
+        std::sort(groups_.begin(), groups_.end(), [&](const Group& a, const Group& b) {
+            auto bytesA = nodes_[order_[a.start]].value.bytes;
+            auto bytesB = nodes_[order_[b.start]].value.bytes;
+            return bytesA != bytesB ? bytesA > bytesB : order_[a.start] < order_[b.start];
+        });
+    }
+
+    /**
+     * Picks the profitable temps, the largest subexpressions first (the
+     * occurrences nested in a picked one are left as they are).
+     *
+     * Nodes of different generations never share a temp, so the nodes
+     * (in evaluation order) are grouped by generation.
+     */
+    void select(bool needsScopeExit, std::vector<CseTemp>& temps,
+                std::unordered_map<const Exp*, CseOccurrence>& occurrences,
+                CseStats& stats) {
+        picked_.assign(nodes_.size(), false);
+
+        // Picked temps with their reuses:
+        std::vector<std::pair<CseTemp, std::vector<const Exp*>>> picks;
+        int64_t bytesSaved = needsScopeExit ? -2 : 0;
+        int64_t instructionsSaved = needsScopeExit ? -1 : 0;
+        size_t eliminated = 0;
+
+        for (size_t first = 0, last = 0; first < nodes_.size(); first = last) {
+            for (last = first; last < nodes_.size() &&
+                 nodes_[last].generation == nodes_[first].generation; last++) {
+            }
+            if (last - first < 2) {
+                continue;
+            }
+
+            group(first, last);
+
+            for (const auto& group : groups_) {
+                const auto& value = nodes_[order_[group.start]].value;
+                auto bytes = (int64_t)value.bytes;
+                auto instructions = (int64_t)value.instructions;
+
+                // Definitions and the nodes they dominate:
+                std::vector<std::pair<size_t, std::vector<size_t>>> definitions;
+
+                for (auto k = group.start; k < group.end; k++) {
+                    auto i = order_[k];
+                    if (picked_[i]) {
+                        continue;
+                    }
+                    auto definition = std::find_if(
+                        definitions.begin(), definitions.end(),
+                        [&](const auto& d) { return dominates(nodes_[d.first], nodes_[i]); });
+                    if (definition != definitions.end()) {
+                        definition->second.push_back(i);
+                    } else {
+                        definitions.push_back({i, {}});
+                    }
+                }
+
+                for (const auto& definition : definitions) {
+                    const auto& node = nodes_[definition.first];
+                    auto reuses = (int64_t)definition.second.size();
+
+                    // The definition reads the temp (hoisted), or stores into
+                    // a placeholder slot; each reuse is a GET_LOCAL.
+                    auto overheadBytes = node.hoistable ? 2 : 4;
+                    auto overheadInstructions = node.hoistable ? 1 : 2;
+                    auto savedBytes = reuses * (bytes - 2) - overheadBytes;
+                    auto savedInstructions = reuses * (instructions - 1) - overheadInstructions;
+
+                    if (reuses == 0 || savedBytes <= 0 || savedInstructions <= 0) {
+                        continue;
+                    }
+
+                    picks.push_back({{node.exp, node.statement, node.hoistable, -1}, {}});
+                    pick(definition.first);
+
+                    for (auto i : definition.second) {
+                        picks.back().second.push_back(nodes_[i].exp);
+                        pick(i);
+                    }
+
+                    bytesSaved += savedBytes;
+                    instructionsSaved += savedInstructions;
+                    eliminated += reuses;
+                }
+            }
+        }
+
+        // Not worth the temps slots.
+        if (picks.empty() || bytesSaved <= 0 || instructionsSaved <= 0) {
+            return;
+        }
+
+        // The compiler pushes the temps in the statements order.
+        std::stable_sort(picks.begin(), picks.end(), [](const auto& a, const auto& b) {
+            return a.first.statement < b.first.statement;
+        });
+
+        for (const auto& pick : picks) {
+            auto temp = temps.size();
+            temps.push_back(pick.first);
+            occurrences[pick.first.exp] = {temp, true};
+            for (auto exp : pick.second) {
+                occurrences[exp] = {temp, false};
+            }
+        }
+
+        stats.eliminated += eliminated;
+        stats.bytesSaved += bytesSaved;
+        stats.instructionsSaved += instructionsSaved;
+    }
+
+    /**
+     * Marks the node and its subtree as picked (never compiled, or compiled
+     * as a part of a temp).
+     */
+    void pick(size_t index) {
+        std::fill(picked_.begin() + nodes_[index].firstNested, picked_.begin() + index + 1, true);
+    }
+
+    std::vector<Node> nodes_;
+
+    std::vector<Branch> branches_;
+
+    /**
+     * Grouping of a generation: node indices, groups of equal nodes in
+     * them, and the picked nodes.
+     */
+    std::vector<size_t> order_;
+    std::vector<Group> groups_;
+    std::vector<bool> picked_;
+
+    /**
+     * Variables declared in the region by name (the names are owned by
+     * the expressions): the latest declaration number.
+     */
+    std::unordered_map<std::string_view, uint64_t> declarations_;
+
+    size_t generation_ = 0;
+
+    /**
+     * Innermost `if` branch being scanned (-1 if none).
+     */
+    int branch_ = -1;
+
+    size_t statement_ = 0;
+
+    /**
+     * A compound expression was evaluated in the current statement.
+     */
+    bool compoundSeen_ = false;
+};
+
+#endif
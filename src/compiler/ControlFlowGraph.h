@@ -0,0 +1,482 @@
+/**
+ * Control-flow graph: the basic blocks between the AST and the bytecode.
+ */
+
+#ifndef ControlFlowGraph_h
+#define ControlFlowGraph_h
+
+#include <vector>
+
+#include "../Logger.h"
+#include "../bytecode/OpCode.h"
+#include "../vm/ChrisValue.h"
+
+/**
+ * Max code size (jumps use 2-byte addresses).
+ */
+#define CODE_LIMIT 0x10000
+
+/**
+ * Max size of an exit block (SCOPE_EXIT + RETURN, HALT) which is copied
+ * into the blocks jumping to it instead of the jump.
+ */
+#define EXIT_DUPLICATION_LIMIT 4
+
+/**
+ * How a basic block ends.
+ */
+enum class BlockExit : uint8_t {
+    NONE,    // the code ends (HALT, RETURN, tail call)
+    JUMP,    // continues at the target
+    BRANCH,  // pops the test: the target if true, the alternate otherwise
+};
+
+/**
+ * Basic block: straight-line instructions, and explicit successors.
+ */
+struct BasicBlock {
+    /**
+     * Emitted instructions (offsets in the code being compiled), and
+     * the entries of their locations in the line table.
+     */
+    size_t start = 0;
+    size_t end = 0;
+    LineTable::Mark linesStart{};
+    LineTable::Mark linesEnd{};
+
+    /**
+     * Successors.
+     */
+    BlockExit exit = BlockExit::NONE;
+    int target = -1;
+    int alternate = -1;
+
+    /**
+     * Location of the jump instructions.
+     */
+    SourceLocation location{0, 0};
+
+    /**
+     * Exit block copied after the instructions (instead of a jump to it).
+     */
+    int duplicate = -1;
+
+    /**
+     * Unlikely to run: laid out after the hot code.
+     */
+    bool cold = false;
+
+    /**
+     * Reached from the entry block.
+     */
+    bool reachable = false;
+
+    /**
+     * Address in the linearized code.
+     */
+    size_t address = 0;
+};
+
+/**
+ * Control-flow graph of the code appended to a code object.
+ *
+ * The compiler emits straight-line code as before, and structures the
+ * control flow as blocks with explicit successors instead of emitting
+ * jumps and back-patching them. When the unit is done, the passes
+ * simplify the graph:
+ *
+ *   - branches on a constant become jumps,
+ *   - jumps to empty blocks are threaded to the final target (also
+ *     through an empty branch, when the jumping block ends with a
+ *     boolean constant),
+ *   - jumps after the instructions which never fall through are
+ *     dropped, and small exit blocks are copied instead of jumped to,
+ *   - unreachable blocks are removed,
+ *
+ * and the linearizer lays the blocks out (hot blocks in the source
+ * order, so a branch falls through to its likely successor, cold ones
+ * last), emitting only the jumps to the blocks which don't follow, and
+ * moves the line table entries of the blocks along.
+ */
+class ControlFlowGraph {
+    public:
+    /**
+     * Starts the graph of the code appended to the code object from the
+     * entry offset (the entry block).
+     */
+    void begin(CodeObject* co, size_t entry) {
+        co_ = co;
+        entry_ = entry;
+        blocks_.clear();
+        order_.clear();
+        start(newBlock());
+    }
+
+    /**
+     * Adds a block, returns its ID (it's emitted by `start`).
+     */
+    int newBlock() {
+        blocks_.emplace_back();
+        return blocks_.size() - 1;
+    }
+
+    /**
+     * Emits the code into the block from now on (the previous block is
+     * ended by a jump or a branch).
+     */
+    void start(int block) {
+        auto& b = blocks_[block];
+        b.start = co_->code.size();
+        b.linesStart = co_->lines.mark();
+        order_.push_back(block);
+        current_ = block;
+    }
+
+    /**
+     * Ends the current block with a jump to the target.
+     */
+    void jump(int target, SourceLocation location) {
+        auto& b = endBlock(BlockExit::JUMP, location);
+        b.target = target;
+    }
+
+    /**
+     * Ends the current block with a branch on the test on the stack.
+     */
+    void branch(int target, int alternate, SourceLocation location) {
+        auto& b = endBlock(BlockExit::BRANCH, location);
+        b.target = target;
+        b.alternate = alternate;
+    }
+
+    /**
+     * Position in the emission order (for `markCold`).
+     */
+    size_t position() const { return order_.size(); }
+
+    /**
+     * Marks the blocks emitted between the positions as cold.
+     */
+    void markCold(size_t from, size_t to) {
+        for (auto i = from; i < to; i++) {
+            blocks_[order_[i]].cold = true;
+        }
+    }
+
+    /**
+     * Ends the last block, simplifies the graph (if `optimize` is set)
+     * and replaces the emitted code with the linearized blocks.
+     */
+    void finish(bool optimize) {
+        endBlock(BlockExit::NONE, {0, 0});
+
+        if (optimize) {
+            foldConstantBranches();
+            threadJumps();
+            dropExitJumps();
+        }
+
+        markReachable();
+        layOut(optimize);
+        linearize();
+    }
+
+    /**
+     * Blocks of the graph (by ID).
+     */
+    const std::vector<BasicBlock>& getBlocks() const { return blocks_; }
+
+    /**
+     * Blocks in the linearized order.
+     */
+    const std::vector<int>& getLayout() const { return layout_; }
+
+    private:
+    BasicBlock& endBlock(BlockExit exit, SourceLocation location) {
+        auto& b = blocks_[current_];
+        b.end = co_->code.size();
+        b.linesEnd = co_->lines.mark();
+        b.exit = exit;
+        b.location = location;
+        return b;
+    }
+
+    /**
+     * Offset of the last instruction of the block (its end if empty).
+     */
+    size_t lastInstruction(const BasicBlock& b) {
+        auto last = b.end;
+        for (auto offset = b.start; offset < b.end;
+             offset += opcodeTable[co_->code[offset]].length) {
+            last = offset;
+        }
+        return last;
+    }
+
+    /**
+     * Value of the boolean constant pushed by the instruction, -1 if it
+     * isn't one.
+     */
+    int booleanConstant(size_t offset, const BasicBlock& b) {
+        if (offset == b.end) {
+            return -1;
+        }
+        size_t index;
+        if (co_->code[offset] == OP_CONST) {
+            index = co_->code[offset + 1];
+        } else if (co_->code[offset] == OP_CONST_WIDE) {
+            index = (co_->code[offset + 1] << 8) | co_->code[offset + 2];
+        } else {
+            return -1;
+        }
+        const auto& value = co_->constants[index];
+        return IS_BOOLEAN(value) ? AS_BOOLEAN(value) : -1;
+    }
+
+    /**
+     * Branches on a constant test (if true ...) become jumps.
+     */
+    void foldConstantBranches() {
+        for (auto& b : blocks_) {
+            if (b.exit != BlockExit::BRANCH) {
+                continue;
+            }
+            auto last = lastInstruction(b);
+            auto value = booleanConstant(last, b);
+            if (value != -1) {
+                b.end = last;
+                b.exit = BlockExit::JUMP;
+                b.target = value ? b.target : b.alternate;
+            }
+        }
+    }
+
+    /**
+     * Final target of a jump to the block: skips the empty blocks which
+     * only jump further.
+     */
+    int resolve(int block) {
+        for (size_t hops = 0; hops < blocks_.size(); hops++) {
+            const auto& b = blocks_[block];
+            if (b.start != b.end || b.exit != BlockExit::JUMP) {
+                break;
+            }
+            block = b.target;
+        }
+        return block;
+    }
+
+    /**
+     * Threads the jumps through empty blocks. A block ending with a
+     * boolean constant and jumping to an empty branch (a nested `if` as
+     * the test) jumps straight to the successor taken.
+     *
+     * The blocks are visited backwards: forward edges are resolved before
+     * the blocks which jump to them.
+     */
+    void threadJumps() {
+        for (auto i = order_.rbegin(); i != order_.rend(); i++) {
+            auto& b = blocks_[*i];
+            if (b.exit == BlockExit::NONE) {
+                continue;
+            }
+
+            b.target = resolve(b.target);
+            if (b.exit == BlockExit::BRANCH) {
+                b.alternate = resolve(b.alternate);
+                continue;
+            }
+
+            const auto& target = blocks_[b.target];
+            if (target.start != target.end || target.exit != BlockExit::BRANCH) {
+                continue;
+            }
+            auto last = lastInstruction(b);
+            auto value = booleanConstant(last, b);
+            if (value != -1) {
+                b.end = last;
+                b.target = resolve(value ? target.target : target.alternate);
+            }
+        }
+    }
+
+    /**
+     * Drops the jumps which are never taken (after a tail call), and
+     * copies small exit blocks instead of jumping to them.
+     */
+    void dropExitJumps() {
+        for (auto& b : blocks_) {
+            if (b.exit != BlockExit::JUMP) {
+                continue;
+            }
+
+            auto last = lastInstruction(b);
+            if (last != b.end && opcodeHasFlag(co_->code[last], OPF_NO_FALLTHROUGH)) {
+                b.exit = BlockExit::NONE;
+                continue;
+            }
+
+            const auto& target = blocks_[b.target];
+            if (target.exit == BlockExit::NONE && target.duplicate == -1 &&
+                target.end - target.start <= EXIT_DUPLICATION_LIMIT && &target != &b) {
+                b.exit = BlockExit::NONE;
+                b.duplicate = b.target;
+            }
+        }
+    }
+
+    /**
+     * Marks the blocks reached from the entry.
+     */
+    void markReachable() {
+        worklist_.assign(1, order_[0]);
+        blocks_[order_[0]].reachable = true;
+
+        while (!worklist_.empty()) {
+            const auto& b = blocks_[worklist_.back()];
+            worklist_.pop_back();
+
+            for (auto successor : {b.target, b.alternate}) {
+                if (b.exit != BlockExit::NONE && successor != -1 &&
+                    !blocks_[successor].reachable) {
+                    blocks_[successor].reachable = true;
+                    worklist_.push_back(successor);
+                }
+            }
+        }
+    }
+
+    /**
+     * Orders the reachable blocks: the hot ones in the emission order,
+     * then the cold ones (if `hotCold` is set).
+     */
+    void layOut(bool hotCold) {
+        layout_.clear();
+        for (auto cold : {false, true}) {
+            for (auto block : order_) {
+                const auto& b = blocks_[block];
+                if (b.reachable && (hotCold && b.cold) == cold) {
+                    layout_.push_back(block);
+                }
+            }
+        }
+    }
+
+    /**
+     * Size of the jumps ending the block, followed by the next one.
+     */
+    size_t exitSize(const BasicBlock& b, int next) {
+        switch (b.exit) {
+            case BlockExit::NONE:
+                return b.duplicate == -1
+                    ? 0
+                    : blocks_[b.duplicate].end - blocks_[b.duplicate].start;
+            case BlockExit::JUMP:
+                return b.target == next ? 0 : 3;
+            case BlockExit::BRANCH:
+                return b.target == next || b.alternate == next ? 3 : 6;
+        }
+        return 0;
+    }
+
+    /**
+     * Replaces the emitted code with the blocks in the layout order.
+     */
+    void linearize() {
+        // Jump sizes only depend on the next block: assign the addresses
+        // first.
+        auto address = entry_;
+        for (size_t i = 0; i < layout_.size(); i++) {
+            auto& b = blocks_[layout_[i]];
+            auto next = i + 1 < layout_.size() ? layout_[i + 1] : -1;
+            b.address = address;
+            address += b.end - b.start + exitSize(b, next);
+        }
+
+        code_.assign(co_->code.begin() + entry_, co_->code.end());
+        co_->code.resize(entry_);
+        lines_ = co_->lines;
+        co_->lines.rewind(blocks_[order_[0]].linesStart);
+
+        for (size_t i = 0; i < layout_.size(); i++) {
+            const auto& b = blocks_[layout_[i]];
+            auto next = i + 1 < layout_.size() ? layout_[i + 1] : -1;
+
+            copyCode(b);
+
+            switch (b.exit) {
+                case BlockExit::NONE:
+                    if (b.duplicate != -1) {
+                        copyCode(blocks_[b.duplicate]);
+                    }
+                    break;
+                case BlockExit::JUMP:
+                    if (b.target != next) {
+                        emitJump(OP_JMP, b.target, b.location);
+                    }
+                    break;
+                case BlockExit::BRANCH:
+                    if (b.alternate == next) {
+                        emitJump(OP_JMP_IF_TRUE, b.target, b.location);
+                    } else {
+                        emitJump(OP_JMP_IF_FALSE, b.alternate, b.location);
+                        if (b.target != next) {
+                            emitJump(OP_JMP, b.target, b.location);
+                        }
+                    }
+                    break;
+            }
+        }
+    }
+
+    /**
+     * Appends the instructions of the block, and their locations.
+     */
+    void copyCode(const BasicBlock& b) {
+        co_->lines.append(lines_, b.linesStart, b.linesEnd, b.start, co_->code.size(), b.end);
+        co_->code.insert(co_->code.end(), code_.begin() + (b.start - entry_),
+                         code_.begin() + (b.end - entry_));
+    }
+
+    /**
+     * Appends a jump to the block.
+     */
+    void emitJump(OpCode opcode, int block, SourceLocation location) {
+        auto address = blocks_[block].address;
+        if (address >= CODE_LIMIT) {
+            COMPILE_ERROR << "Code object is too large.";
+        }
+        co_->lines.add(co_->code.size(), location.line, location.column);
+        co_->code.push_back(opcode);
+        co_->code.push_back((address >> 8) & 0xff);
+        co_->code.push_back(address & 0xff);
+    }
+
+    /**
+     * Code object, and the offset of the graph code.
+     */
+    CodeObject* co_ = nullptr;
+    size_t entry_ = 0;
+
+    /**
+     * Blocks by ID, in the emission order, and in the layout order.
+     */
+    std::vector<BasicBlock> blocks_;
+    std::vector<int> order_;
+    std::vector<int> layout_;
+
+    /**
+     * Block the code is emitted into.
+     */
+    int current_ = -1;
+
+    /**
+     * Scratch: the emitted code and its line table, and the blocks to
+     * visit.
+     */
+    std::vector<uint8_t> code_;
+    LineTable lines_;
+    std::vector<int> worklist_;
+};
+
+#endif
@@ -9,87 +9,114 @@
 
 #include "../bytecode/OpCode.h"
 #include "../vm/ChrisValue.h"
+#include "../vm/Global.h"
 
 /**
  * Chris disassembler.
  */
 class ChrisDisassembler {
     public:
+    ChrisDisassembler(std::shared_ptr<Global> global, std::ostream& out = std::cout)
+        : global(global), out(out) {}
+
     /**
      * Disasembles a code unit.
      */
     void disassemble(CodeObject* co) {
-        std::cout << "\n------------- Disassembly: " << co->name
+        out << "\n------------- Disassembly: " << co->name
             << "-------------\n\n";
         size_t offset = 0;
+        int line = 0;
         while (offset < co->code.size()) {
+            printLine(co, offset, line);
             offset = disassembleInstruction(co, offset);
-            std::cout << "\n";
+            out << "\n";
         }
     }
-    private:
+
     /**
-     * Disassembles individual instruction.
+     * Disassembles individual instruction, returns the next offset.
      */
     size_t disassembleInstruction(CodeObject* co, size_t offset) {
-        std::ios_base::fmtflags f(std::cout.flags());
+        std::ios_base::fmtflags f(out.flags());
 
         // Print bytecode offset:
-        std::cout << std::uppercase << std::hex << std::setfill('0') << std::setw(4)
+        out << std::uppercase << std::hex << std::setfill('0') << std::setw(4)
             << offset << "    ";
 
+        out.flags(f);
+
         auto opcode = co->code[offset];
 
-        switch (opcode) {
-            case OP_HALT:
-            case OP_ADD:
-            case OP_SUB:
-            case OP_MUL:
-            case OP_DIV:
-                return disassembleSimple(co, opcode, offset);
-            case OP_CONST:
-                return disassembleConst(co, opcode, offset);
-            case OP_COMPARE:
-                return disassembleCompare(co, opcode, offset);
-            case OP_JMP_IF_FALSE:
-            case OP_JMP:
-                return disassembleJump(co, opcode, offset);
-            default:
-                DIE << "disassembleInstruction: no disassembly for "
-                    << opcodeToString(opcode);
+        if (!isValidOpcode(opcode)) {
+            DIE << "disassembleInstruction: unknown opcode " << (int)opcode;
         }
 
-        std::cout.flags(f);
+        const auto& info = opcodeTable[opcode];
 
-        return 0; // Unreachable
+        dumpBytes(co, offset, info.length);
+        printOpCode(opcode);
+
+        switch (info.operand) {
+            case OperandType::NONE:
+                break;
+            case OperandType::CONST:
+            case OperandType::CLOSURE:
+                printConst(co, co->code[offset + 1]);
+                break;
+            case OperandType::CONST_WIDE:
+                printConst(co, (co->code[offset + 1] << 8) | co->code[offset + 2]);
+                break;
+            case OperandType::COMPARE:
+                printCompare(co, offset + 1);
+                break;
+            case OperandType::ADDRESS:
+                printAddress(co, offset + 1);
+                break;
+            case OperandType::GLOBAL:
+                printGlobal(co, offset + 1);
+                break;
+            case OperandType::UPVALUE:
+                printUpvalue(co, offset + 1);
+                break;
+            case OperandType::LOCAL:
+            case OperandType::COUNT:
+            case OperandType::LOOP:
+                out << (int)co->code[offset + 1];
+                break;
+        }
+
+        return offset + info.length;
     }
 
+    private:
     /**
-     * Diassembles simple instruction.
+     * Prints the source line where it changes (blank otherwise).
      */
-    size_t disassembleSimple(CodeObject* co, uint8_t opcode, size_t offset) {
-        dumpBytes(co, offset, 1);
-        printOpCode(opcode);
-        return offset + 1;
+    void printLine(CodeObject* co, size_t offset, int& line) {
+        auto location = co->lines.find(offset);
+        if (location.line != line && location.line > 0) {
+            out << std::right << std::setfill(' ') << std::setw(4)
+                << location.line << "  ";
+        } else {
+            out << "      ";
+        }
+        line = location.line;
     }
 
     /**
-     * Disassembles const instruction
+     * Prints const operand.
      */
-    size_t disassembleConst(CodeObject* co, uint8_t opcode, size_t offset) {
-        dumpBytes(co, offset, 2);
-        printOpCode(opcode);
-        auto constIndex = co->code[offset + 1];
-        std::cout << (int)constIndex << " ("
+    void printConst(CodeObject* co, size_t constIndex) {
+        out << constIndex << " ("
             << chrisValueToConstantString(co->constants[constIndex]) << ")";
-        return offset + 2;
     }
 
     /**
      * Dumps raw memory from the bytecode.
      */
     void dumpBytes(CodeObject* co, size_t offset, size_t count) {
-        std::ios_base::fmtflags f(std::cout.flags());
+        std::ios_base::fmtflags f(out.flags());
         std::stringstream ss;
 
         for (auto i = 0; i < count; i++) {
@@ -97,48 +124,57 @@ class ChrisDisassembler {
                 << (((int)co->code[offset + i]) & 0xFF) << " ";
         }
 
-        std::cout << std::left << std::setfill(' ') << std::setw(12) << ss.str();
-        std::cout.flags(f);
+        out << std::left << std::setfill(' ') << std::setw(12) << ss.str();
+        out.flags(f);
     }
 
     /**
      * Prints opcode.
      */
     void printOpCode(uint8_t opcode) {
-        std::ios_base::fmtflags f(std::cout.flags());
-        std::cout << std::left << std::setfill(' ') << std::setw(20)
+        std::ios_base::fmtflags f(out.flags());
+        out << std::left << std::setfill(' ') << std::setw(20)
             << opcodeToString(opcode) << " ";
-        std::cout.flags(f);
+        out.flags(f);
     }
 
     /**
-     * Disassembles compare instruction.
+     * Prints compare operand.
      */
-    size_t disassembleCompare(CodeObject* co, uint8_t opcode, size_t offset) {
-        dumpBytes(co, offset, 2);
-        printOpCode(OP_COMPARE);
-        auto compareOp = co->code[offset + 1];
-        std::cout << (int)compareOp << " (";
-        std::cout << inverseCompareOps_[compareOp] << ")";
-        return offset + 2;
+    void printCompare(CodeObject* co, size_t offset) {
+        auto compareOp = co->code[offset];
+        out << (int)compareOp << " (";
+        out << inverseCompareOps_[compareOp] << ")";
     }
 
     /**
-     * Disassembles conditional jump
+     * Prints jump address operand.
      */
-    size_t disassembleJump(CodeObject* co, uint8_t opcode, size_t offset) {
-        std::ios_base::fmtflags f(std::cout.flags());
+    void printAddress(CodeObject* co, size_t offset) {
+        std::ios_base::fmtflags f(out.flags());
 
-        dumpBytes(co, offset, 3);
-        printOpCode(opcode);
-        uint16_t address = readWordAtOffset(co, offset + 1);
+        uint16_t address = readWordAtOffset(co, offset);
 
-        std::cout << std::uppercase << std::hex << std::setfill('0') << std::setw(4)
+        out << std::uppercase << std::hex << std::setfill('0') << std::setw(4)
             << (int)address << " ";
 
-        std::cout.flags(f);
+        out.flags(f);
+    }
 
-        return offset + 3; // instruction + 2 bytes address
+    /**
+     * Prints global operand.
+     */
+    void printGlobal(CodeObject* co, size_t offset) {
+        auto globalIndex = co->code[offset];
+        out << (int)globalIndex << " (" << global->get(globalIndex).name << ")";
+    }
+
+    /**
+     * Prints upvalue operand.
+     */
+    void printUpvalue(CodeObject* co, size_t offset) {
+        auto upvalueIndex = co->code[offset];
+        out << (int)upvalueIndex << " (" << co->upvalues[upvalueIndex].name << ")";
     }
 
     /**
@@ -148,6 +184,16 @@ class ChrisDisassembler {
         return (uint16_t)((co->code[offset] << 8) | co->code[offset + 1]);
     }
 
+    /**
+     * Global object.
+     */
+    std::shared_ptr<Global> global;
+
+    /**
+     * Output stream.
+     */
+    std::ostream& out;
+
     static std::array<std::string, 6> inverseCompareOps_;
 };
 
@@ -0,0 +1,373 @@
+/**
+ * Chris VM metrics.
+ */
+
+#ifndef ChrisMetrics_h
+#define ChrisMetrics_h
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+
+/**
+ * Histogram sub-buckets per power of 2 (as bits): 16 sub-buckets keep
+ * the relative error of the recorded values within 1/16.
+ */
+#define HISTOGRAM_SUB_BUCKET_BITS 4
+
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+
+/**
+ * Buckets covering the whole uint64_t range.
+ */
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * Prometheus histogram buckets: le = 2^k ns for k in this range
+ * (about 1 microsecond .. 34 seconds).
+ */
+#define PROMETHEUS_MIN_BUCKET_BITS 10
+#define PROMETHEUS_MAX_BUCKET_BITS 35
+
+/**
+ * Log-linear (HDR-style) latency histogram in nanoseconds.
+ *
+ * Values below HISTOGRAM_SUB_BUCKETS get a bucket each, every following
+ * power of 2 is split into HISTOGRAM_SUB_BUCKETS equal buckets. Powers
+ * of 2 are exact bucket boundaries. Counters are relaxed atomics, so
+ * any number of threads can record concurrently.
+ */
+class LatencyHistogram {
+    public:
+    /**
+     * Records a value.
+     */
+    void record(uint64_t value) {
+        counts[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+
+        auto prevMax = max.load(std::memory_order_relaxed);
+        while (value > prevMax &&
+               !max.compare_exchange_weak(prevMax, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    /**
+     * Value at the quantile (0..1), the upper bound of its bucket
+     * (capped by the max recorded value).
+     */
+    uint64_t percentile(double quantile) const {
+        auto count = total.load(std::memory_order_relaxed);
+        if (count == 0) {
+            return 0;
+        }
+
+        // Nearest rank: ceil(quantile * count).
+        auto rank = (uint64_t)(quantile * count);
+        if (rank < quantile * count) {
+            rank++;
+        }
+        if (rank == 0) {
+            rank = 1;
+        }
+
+        uint64_t seen = 0;
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return std::min(bucketUpperBound(i), maxValue());
+            }
+        }
+        return maxValue();
+    }
+
+    /**
+     * Number of values up to 2^bits (Prometheus `le`). 2^bits starts a
+     * bucket, which is included: values up to 1/16 above are counted.
+     */
+    uint64_t countUpTo(size_t bits) const {
+        auto end = bucketIndex((uint64_t)1 << bits) + 1;
+        uint64_t count = 0;
+        for (size_t i = 0; i < end; i++) {
+            count += counts[i].load(std::memory_order_relaxed);
+        }
+        return count;
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+
+    uint64_t sumValue() const { return sum.load(std::memory_order_relaxed); }
+
+    uint64_t maxValue() const { return max.load(std::memory_order_relaxed); }
+
+    /**
+     * Bucket of the value.
+     */
+    static size_t bucketIndex(uint64_t value) {
+        if (value < HISTOGRAM_SUB_BUCKETS) {
+            return value;
+        }
+        auto exponent = 63 - __builtin_clzll(value);
+        auto shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+        auto subBucket = (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+        return (shift + 1) * HISTOGRAM_SUB_BUCKETS + subBucket;
+    }
+
+    /**
+     * Largest value of the bucket.
+     */
+    static uint64_t bucketUpperBound(size_t index) {
+        if (index < HISTOGRAM_SUB_BUCKETS) {
+            return index;
+        }
+        auto shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+        auto subBucket = index % HISTOGRAM_SUB_BUCKETS;
+        auto lower = (uint64_t)(HISTOGRAM_SUB_BUCKETS + subBucket) << shift;
+        return lower + (((uint64_t)1 << shift) - 1);
+    }
+
+    private:
+    std::atomic<uint64_t> counts[HISTOGRAM_BUCKETS] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+};
+
+/**
+ * Snapshot of the metrics of a program.
+ */
+struct ProgramStats {
+    uint64_t executions;
+    uint64_t errors;
+    uint64_t instructions;
+    uint64_t allocations;
+
+    /**
+     * Execution latency in nanoseconds.
+     */
+    uint64_t latencyP50;
+    uint64_t latencyP90;
+    uint64_t latencyP99;
+    uint64_t latencyMax;
+    uint64_t latencySum;
+};
+
+/**
+ * Metrics of a program, shared by all the VMs (and threads) running it.
+ */
+class ProgramMetrics {
+    public:
+    ProgramMetrics(const std::string& name) : name(name) {}
+
+    /**
+     * Records an execution.
+     */
+    void record(uint64_t durationNs, uint64_t instructions, uint64_t allocations,
+                bool failed) {
+        executions.fetch_add(1, std::memory_order_relaxed);
+        if (failed) {
+            errors.fetch_add(1, std::memory_order_relaxed);
+        }
+        this->instructions.fetch_add(instructions, std::memory_order_relaxed);
+        this->allocations.fetch_add(allocations, std::memory_order_relaxed);
+        latency.record(durationNs);
+    }
+
+    ProgramStats stats() const {
+        return {
+            executions.load(std::memory_order_relaxed),
+            errors.load(std::memory_order_relaxed),
+            instructions.load(std::memory_order_relaxed),
+            allocations.load(std::memory_order_relaxed),
+            latency.percentile(0.5),
+            latency.percentile(0.9),
+            latency.percentile(0.99),
+            latency.maxValue(),
+            latency.sumValue(),
+        };
+    }
+
+    /**
+     * Program name (the metrics label).
+     */
+    const std::string name;
+
+    std::atomic<uint64_t> executions{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> instructions{0};
+    std::atomic<uint64_t> allocations{0};
+
+    /**
+     * Latency of exec/run.
+     */
+    LatencyHistogram latency;
+};
+
+/**
+ * Metrics registry: programs by name.
+ *
+ * Registration takes a lock (once per compiled program), recording is
+ * lock-free.
+ */
+class ChrisMetrics {
+    public:
+    /**
+     * Metrics of the program (created on first use). The pointer stays
+     * valid as long as the registry.
+     */
+    ProgramMetrics* program(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& metrics = programs[name];
+        if (metrics == nullptr) {
+            metrics = std::make_unique<ProgramMetrics>(name);
+        }
+        return metrics.get();
+    }
+
+    /**
+     * Stats of the program (zeros if unknown).
+     */
+    ProgramStats stats(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = programs.find(name);
+        if (it == programs.end()) {
+            return {};
+        }
+        return it->second->stats();
+    }
+
+    /**
+     * Writes the metrics in the Prometheus text exposition format.
+     */
+    void writePrometheus(std::ostream& os) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        writeCounter(os, "chris_executions_total", "Program executions.",
+                     [](const ProgramMetrics& m) { return m.executions.load(); });
+        writeCounter(os, "chris_errors_total", "Program executions failed with an error.",
+                     [](const ProgramMetrics& m) { return m.errors.load(); });
+        writeCounter(os, "chris_instructions_total", "Executed bytecode instructions.",
+                     [](const ProgramMetrics& m) { return m.instructions.load(); });
+        writeCounter(os, "chris_allocations_total", "Allocated heap objects.",
+                     [](const ProgramMetrics& m) { return m.allocations.load(); });
+
+        os << "# HELP chris_exec_duration_seconds Program execution latency.\n";
+        os << "# TYPE chris_exec_duration_seconds histogram\n";
+        for (const auto& entry : programs) {
+            const auto& latency = entry.second->latency;
+            auto label = escapeLabel(entry.first);
+
+            // Read the count first: concurrent records may make buckets
+            // exceed it slightly, never the other way around.
+            auto count = latency.count();
+            for (size_t bits = PROMETHEUS_MIN_BUCKET_BITS; bits <= PROMETHEUS_MAX_BUCKET_BITS;
+                 bits++) {
+                os << "chris_exec_duration_seconds_bucket{program=\"" << label
+                    << "\",le=\"";
+                writeSeconds(os, (uint64_t)1 << bits);
+                os << "\"} " << std::min(latency.countUpTo(bits), count) << "\n";
+            }
+            os << "chris_exec_duration_seconds_bucket{program=\"" << label
+                << "\",le=\"+Inf\"} " << count << "\n";
+            os << "chris_exec_duration_seconds_sum{program=\"" << label << "\"} ";
+            writeSeconds(os, latency.sumValue());
+            os << "\n";
+            os << "chris_exec_duration_seconds_count{program=\"" << label << "\"} "
+                << count << "\n";
+        }
+    }
+
+    /**
+     * Prometheus exposition as a string.
+     */
+    std::string toPrometheus() {
+        std::ostringstream ss;
+        writePrometheus(ss);
+        return ss.str();
+    }
+
+    /**
+     * Writes the Prometheus exposition to the file, atomically (a
+     * temporary file is renamed, so scrapers never see a partial file).
+     */
+    bool writePrometheusFile(const std::string& path) {
+        auto tmpPath = path + ".tmp";
+        {
+            std::ofstream out(tmpPath);
+            if (!out) {
+                return false;
+            }
+            writePrometheus(out);
+            if (!out) {
+                return false;
+            }
+        }
+        return std::rename(tmpPath.c_str(), path.c_str()) == 0;
+    }
+
+    private:
+    template <typename Getter>
+    void writeCounter(std::ostream& os, const char* name, const char* help, Getter get) {
+        os << "# HELP " << name << " " << help << "\n";
+        os << "# TYPE " << name << " counter\n";
+        for (const auto& entry : programs) {
+            os << name << "{program=\"" << escapeLabel(entry.first) << "\"} "
+                << get(*entry.second) << "\n";
+        }
+    }
+
+    /**
+     * Writes nanoseconds as exact decimal seconds ("0.001048576").
+     */
+    static void writeSeconds(std::ostream& os, uint64_t ns) {
+        os << ns / 1000000000;
+
+        auto fraction = ns % 1000000000;
+        if (fraction == 0) {
+            return;
+        }
+
+        char digits[10];
+        std::snprintf(digits, sizeof(digits), "%09llu", (unsigned long long)fraction);
+
+        auto length = 9;
+        while (digits[length - 1] == '0') {
+            length--;
+        }
+        os << '.';
+        os.write(digits, length);
+    }
+
+    /**
+     * Escapes a label value (backslash, quote and newline).
+     */
+    static std::string escapeLabel(const std::string& value) {
+        std::string escaped;
+        for (auto c : value) {
+            if (c == '\\' || c == '"') {
+                escaped += '\\';
+                escaped += c;
+            } else if (c == '\n') {
+                escaped += "\\n";
+            } else {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    std::mutex mutex;
+
+    std::map<std::string, std::unique_ptr<ProgramMetrics>> programs;
+};
+
+#endif
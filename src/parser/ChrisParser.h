@@ -1,18 +1,19 @@
 /**
- * LR parser for C++ generated by the Syntax tool.
+ * LR parser for the Chris grammar (ChrisGrammar.bnf).
  *
- * https://www.npmjs.com/package/syntax-cli
- *
- *   npm install -g syntax-cli
+ * Generated by the Syntax tool (LALR1 mode), with the runtime customized:
+ * the dense `table_` and the moved token and semantic values, the
+ * tokenizer matching at the cursor (match_continuous), the location stack,
+ * the symbol interning, and the integer literal checks.
  *
- *   syntax-cli --help
+ * On a grammar change, edit ChrisGrammar.bnf and regenerate the tables:
  *
- * To regenerate run:
+ *   syntax-cli -g src/parser/ChrisGrammar.bnf -m LALR1 -o /tmp/ChrisParser.h
+ *   node src/parser/dense-tables.js /tmp/ChrisParser.h src/parser/ChrisParser.h
  *
- *   syntax-cli \
- *     --grammar ~/path-to-grammar-file \
- *     --mode <parsing-mode> \
- *     --output ~/ParserClassName.h
+ * The script only replaces the "BEGIN GENERATED" / "END GENERATED" regions
+ * (the productions and the parsing table). The semantic actions (_handlerN)
+ * and the tokenizer rules mirror the grammar by hand.
  */
 #ifndef __Syntax_LR_Parser_h
 #define __Syntax_LR_Parser_h
@@ -50,9 +51,13 @@
 //   }
 //
 // clang-format off
+#include <charconv>
 #include <string>
 #include <vector>
 
+#include "../Logger.h"
+#include "Symbols.h"
+
 /**
  * Expression type.
  */
@@ -69,12 +74,23 @@ enum class ExpType {
 struct Exp {
     ExpType type;
     
-    int number;
+    int64_t number;
     std::string string;
     std::vector<Exp> list;
 
+    /**
+     * Interned ID of a symbol (SYM_NONE for the user-defined names).
+     */
+    Symbol symbol = SYM_NONE;
+
+    /**
+     * Source location (of the opening paren for lists, 0 if unknown).
+     */
+    int line = 0;
+    int column = 0;
+
     // Numbers:
-    Exp(int number) : type(ExpType::NUMBER), number(number) {}
+    Exp(int64_t number) : type(ExpType::NUMBER), number(number) {}
 
     // Strings, Symbols:
     Exp(std::string& strVal) {
@@ -84,13 +100,35 @@ struct Exp {
         } else {
             type = ExpType::SYMBOL;
             string = strVal;
+            symbol = SymbolTable::intern(string);
         }
     }
 
     // Lists:
-    Exp(std::vector<Exp> list) : type(ExpType::LIST), list(list) {}
+    Exp(std::vector<Exp> list) : type(ExpType::LIST), list(std::move(list)) {}
+
+    /**
+     * Sets the source location.
+     */
+    Exp& at(int line, int column) {
+        this->line = line;
+        this->column = column;
+        return *this;
+    }
 };
 
+/**
+ * Parses an integer literal (syntax error if it doesn't fit in int64).
+ */
+inline int64_t parseInteger(const std::string& literal, int line, int column) {
+    int64_t value = 0;
+    auto [end, ec] = std::from_chars(literal.data(), literal.data() + literal.size(), value);
+    if (ec != std::errc() || end != literal.data() + literal.size()) {
+        SYNTAX_ERROR(line, column) << "Integer literal out of range: " << literal;
+    }
+    return value;
+}
+
 using Value = Exp;  // clang-format on
 
 namespace syntax {
@@ -142,6 +180,14 @@ struct Token {
 
 using SharedToken = std::shared_ptr<Token>;
 
+/**
+ * Start location of a shifted token (@1, @2, ... in semantic actions).
+ */
+struct TokenLocation {
+  int startLine;
+  int startColumn;
+};
+
 typedef TokenType (*LexRuleHandler)(const Tokenizer&, const std::string&);
 
 // ------------------------------------------------------------------
@@ -227,15 +273,17 @@ class Tokenizer {
       return toToken(TokenType::__EOF);
     }
 
-    auto strSlice = str_.substr(cursor_);
-
-    auto lexRulesForState = lexRulesByStartConditions_.at(getCurrentState());
+    const auto& lexRulesForState =
+        lexRulesByStartConditions_.at(getCurrentState());
 
     for (const auto& ruleIndex : lexRulesForState) {
-      auto rule = lexRules_[ruleIndex];
+      const auto& rule = lexRules_[ruleIndex];
       std::smatch sm;
 
-      if (std::regex_search(strSlice, sm, rule.regex)) {
+      // Match only at the cursor, without copying the rest of the string.
+      if (std::regex_search(str_.cbegin() + cursor_, str_.cend(), sm,
+                            rule.regex,
+                            std::regex_constants::match_continuous)) {
         yytext = sm[0];
 
         captureLocations_(yytext);
@@ -263,7 +311,7 @@ class Tokenizer {
       return toToken(TokenType::__EOF);
     }
 
-    throwUnexpectedToken(std::string(1, strSlice[0]), currentLine_,
+    throwUnexpectedToken(std::string(1, str_[cursor_]), currentLine_,
                          currentColumn_);
   }
 
@@ -304,13 +352,10 @@ class Tokenizer {
 
     std::stringstream errMsg;
 
-    errMsg << "Syntax Error:\n\n"
-           << lineStr << "\n"
-           << pad << "^\nUnexpected token \"" << symbol << "\" at " << line
-           << ":" << column << "\n\n";
+    errMsg << lineStr << "\n"
+           << pad << "^\nUnexpected token \"" << symbol << "\"";
 
-    std::cerr << errMsg.str();
-    throw new std::runtime_error(errMsg.str().c_str());
+    throw ChrisError(ErrorType::SYNTAX, errMsg.str(), line, column);
   }
 
   /**
@@ -333,13 +378,11 @@ class Tokenizer {
     tokenStartColumn_ = tokenStartOffset_ - currentLineBeginOffset_;
 
     // Extract `\n` in the matched token.
-    std::stringstream ss{matched};
-    std::string lineStr;
-    std::getline(ss, lineStr, '\n');
-    while (ss.tellg() > 0 && ss.tellg() <= len) {
-      currentLine_++;
-      currentLineBeginOffset_ = tokenStartOffset_ + ss.tellg();
-      std::getline(ss, lineStr, '\n');
+    for (size_t i = 0; i < len; i++) {
+      if (matched[i] == '\n') {
+        currentLine_++;
+        currentLineBeginOffset_ = tokenStartOffset_ + i + 1;
+      }
     }
 
     tokenEndOffset_ = cursor_ + len;
@@ -456,16 +499,20 @@ std::map<TokenizerState, std::vector<size_t>> Tokenizer::lexRulesByStartConditio
 #endif
 // clang-format on
 
-#define POP_V()              \
-  parser.valuesStack.back(); \
+#define POP_V()                         \
+  std::move(parser.valuesStack.back()); \
   parser.valuesStack.pop_back()
 
-#define POP_T()              \
-  parser.tokensStack.back(); \
+#define POP_T()                         \
+  std::move(parser.tokensStack.back()); \
   parser.tokensStack.pop_back()
 
-#define PUSH_VR() parser.valuesStack.push_back(__)
-#define PUSH_TR() parser.tokensStack.push_back(__)
+#define POP_L()                         \
+  parser.locationsStack.back();         \
+  parser.locationsStack.pop_back()
+
+#define PUSH_VR() parser.valuesStack.push_back(std::move(__))
+#define PUSH_TR() parser.tokensStack.push_back(std::move(__))
 
 /**
  * Parsing table type.
@@ -475,6 +522,7 @@ enum class TE {
   Shift,
   Reduce,
   Transit,
+  Error,
 };
 
 /**
@@ -505,10 +553,6 @@ struct Production {
   ProductionHandler handler;
 };
 
-// Key: Encoded symbol (terminal or non-terminal) index
-// Value: TableEntry
-using Row = std::map<int, TableEntry>;
-
 /**
  * Parser class.
  */
@@ -516,6 +560,18 @@ using Row = std::map<int, TableEntry>;
 class ChrisParser {
   // clang-format on
  public:
+  /**
+   * Initial capacity of the parsing stacks (kept across parses).
+   */
+  static constexpr size_t STACK_RESERVE = 64;
+
+  ChrisParser() {
+    valuesStack.reserve(STACK_RESERVE);
+    tokensStack.reserve(STACK_RESERVE);
+    locationsStack.reserve(STACK_RESERVE);
+    statesStack.reserve(STACK_RESERVE);
+  }
+
   /**
    * Parsing values stack.
    */
@@ -526,6 +582,11 @@ class ChrisParser {
    */
   std::vector<std::string> tokensStack;
 
+  /**
+   * Token locations stack (parallel to the token values).
+   */
+  std::vector<TokenLocation> locationsStack;
+
   /**
    * Parsing states stack.
    */
@@ -552,46 +613,44 @@ class ChrisParser {
     // Initialize the tokenizer and the string.
     tokenizer.initString(str);
 
-    // Initialize the stacks.
+    // Initialize the stacks (keeps the allocated capacity).
     valuesStack.clear();
     tokensStack.clear();
+    locationsStack.clear();
     statesStack.clear();
 
     // Initial 0 state.
     statesStack.push_back(0);
 
     auto token = tokenizer.getNextToken();
-    auto shiftedToken = token;
 
     // Main parsing loop.
     for (;;) {
       auto state = statesStack.back();
       auto column = (int)token->type;
 
-      if (table_[state].count(column) == 0) {
+      const auto& entry = table_[state][column];
+
+      if (entry.type == TE::Error) {
         throwUnexpectedToken(token);
       }
 
-      auto entry = table_[state].at(column);
-
       // Shift a token, go to state.
       if (entry.type == TE::Shift) {
         // Push token.
-        tokensStack.push_back(token->value);
+        tokensStack.push_back(std::move(token->value));
+        locationsStack.push_back({token->startLine, token->startColumn});
 
         // Push next state number: "s5" -> 5
         statesStack.push_back(entry.value);
 
-        shiftedToken = token;
         token = tokenizer.getNextToken();
       }
 
       // Reduce by production.
       else if (entry.type == TE::Reduce) {
         auto productionNumber = entry.value;
-        auto production = productions_[productionNumber];
-
-        tokenizer.yytext = shiftedToken->value;
+        const auto& production = productions_[productionNumber];
 
         auto rhsLength = production.rhsLength;
         while (rhsLength > 0) {
@@ -605,7 +664,7 @@ class ChrisParser {
         auto previousState = statesStack.back();
 
         auto symbolToReduceWith = production.opcode;
-        auto nextStateEntry = table_[previousState].at(symbolToReduceWith);
+        const auto& nextStateEntry = table_[previousState][symbolToReduceWith];
         assert(nextStateEntry.type == TE::Transit);
 
         statesStack.push_back(nextStateEntry.value);
@@ -618,7 +677,7 @@ class ChrisParser {
 
         // Pop the parsed value.
         // clang-format off
-        auto result = valuesStack.back(); valuesStack.pop_back();
+        auto result = std::move(valuesStack.back()); valuesStack.pop_back();
         // clang-format on
 
         if (statesStack.size() != 1 || statesStack.back() != 0 ||
@@ -643,20 +702,35 @@ class ChrisParser {
    */
   [[noreturn]] void throwUnexpectedToken(SharedToken token) {
     if (token->type == TokenType::__EOF && !tokenizer.hasMoreTokens()) {
-      std::string errMsg = "Unexpected end of input.\n";
-      std::cerr << errMsg;
-      throw std::runtime_error(errMsg.c_str());
+      throw ChrisError(ErrorType::SYNTAX, "Unexpected end of input.",
+                       token->startLine, token->startColumn);
     }
     tokenizer.throwUnexpectedToken(token->value, token->startLine,
                                    token->startColumn);
   }
 
   // clang-format off
+  // BEGIN GENERATED: tables (dense-tables.js)
   static constexpr size_t PRODUCTIONS_COUNT = 9;
-  static std::array<Production, PRODUCTIONS_COUNT> productions_;
+  static const std::array<Production, PRODUCTIONS_COUNT> productions_;
 
+  // Dense parsing table: [state][encoded symbol].
   static constexpr size_t ROWS_COUNT = 11;
-  static std::array<Row, ROWS_COUNT> table_;
+  static constexpr size_t COLUMNS_COUNT = 10;
+  static constexpr TableEntry table_[ROWS_COUNT][COLUMNS_COUNT] = {
+      {{TE::Transit, 1}, {TE::Transit, 2}, {TE::Transit, 3}, {TE::Error, 0}, {TE::Shift, 4}, {TE::Shift, 5}, {TE::Shift, 6}, {TE::Shift, 7}, {TE::Error, 0}, {TE::Error, 0}},
+      {{TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Accept, 0}},
+      {{TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Reduce, 1}, {TE::Reduce, 1}, {TE::Reduce, 1}, {TE::Reduce, 1}, {TE::Reduce, 1}, {TE::Reduce, 1}},
+      {{TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Reduce, 2}, {TE::Reduce, 2}, {TE::Reduce, 2}, {TE::Reduce, 2}, {TE::Reduce, 2}, {TE::Reduce, 2}},
+      {{TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Reduce, 3}, {TE::Reduce, 3}, {TE::Reduce, 3}, {TE::Reduce, 3}, {TE::Reduce, 3}, {TE::Reduce, 3}},
+      {{TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Reduce, 4}, {TE::Reduce, 4}, {TE::Reduce, 4}, {TE::Reduce, 4}, {TE::Reduce, 4}, {TE::Reduce, 4}},
+      {{TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Reduce, 5}, {TE::Reduce, 5}, {TE::Reduce, 5}, {TE::Reduce, 5}, {TE::Reduce, 5}, {TE::Reduce, 5}},
+      {{TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Transit, 8}, {TE::Reduce, 7}, {TE::Reduce, 7}, {TE::Reduce, 7}, {TE::Reduce, 7}, {TE::Reduce, 7}, {TE::Error, 0}},
+      {{TE::Transit, 10}, {TE::Transit, 2}, {TE::Transit, 3}, {TE::Error, 0}, {TE::Shift, 4}, {TE::Shift, 5}, {TE::Shift, 6}, {TE::Shift, 7}, {TE::Shift, 9}, {TE::Error, 0}},
+      {{TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Reduce, 6}, {TE::Reduce, 6}, {TE::Reduce, 6}, {TE::Reduce, 6}, {TE::Reduce, 6}, {TE::Reduce, 6}},
+      {{TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Error, 0}, {TE::Reduce, 8}, {TE::Reduce, 8}, {TE::Reduce, 8}, {TE::Reduce, 8}, {TE::Reduce, 8}, {TE::Error, 0}}
+  };
+  // END GENERATED: tables
   // clang-format on
 };
 
@@ -700,8 +774,9 @@ PUSH_VR();
 void _handler4(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
+auto _1loc = POP_L();
 
-auto __ = Exp(std::stoi(_1)) ;
+auto __ = Exp(parseInteger(_1, _1loc.startLine, _1loc.startColumn)); __.at(_1loc.startLine, _1loc.startColumn) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -711,8 +786,9 @@ PUSH_VR();
 void _handler5(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
+auto _1loc = POP_L();
 
-auto __ = Exp(_1) ;
+auto __ = Exp(_1); __.at(_1loc.startLine, _1loc.startColumn) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -722,8 +798,9 @@ PUSH_VR();
 void _handler6(yyparse& parser) {
 // Semantic action prologue.
 auto _1 = POP_T();
+auto _1loc = POP_L();
 
-auto __ = Exp(_1) ;
+auto __ = Exp(_1); __.at(_1loc.startLine, _1loc.startColumn) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -733,10 +810,12 @@ PUSH_VR();
 void _handler7(yyparse& parser) {
 // Semantic action prologue.
 parser.tokensStack.pop_back();
+parser.locationsStack.pop_back();
 auto _2 = POP_V();
 parser.tokensStack.pop_back();
+auto _1loc = POP_L();
 
-auto __ = _2 ;
+_2.at(_1loc.startLine, _1loc.startColumn); auto __ = std::move(_2) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -759,7 +838,7 @@ void _handler9(yyparse& parser) {
 auto _2 = POP_V();
 auto _1 = POP_V();
 
-_1.list.push_back(_2); auto __ = _1 ;
+_1.list.push_back(std::move(_2)); auto __ = std::move(_1) ;
 
  // Semantic action epilogue.
 PUSH_VR();
@@ -768,7 +847,8 @@ PUSH_VR();
 // clang-format on
 
 // clang-format off
-std::array<Production, yyparse::PRODUCTIONS_COUNT> yyparse::productions_ = {{{-1, 1, &_handler1},
+// BEGIN GENERATED: productions (dense-tables.js)
+const std::array<Production, yyparse::PRODUCTIONS_COUNT> yyparse::productions_ = {{{-1, 1, &_handler1},
 {0, 1, &_handler2},
 {0, 1, &_handler3},
 {1, 1, &_handler4},
@@ -777,25 +857,7 @@ std::array<Production, yyparse::PRODUCTIONS_COUNT> yyparse::productions_ = {{{-1
 {2, 3, &_handler7},
 {3, 0, &_handler8},
 {3, 2, &_handler9}}};
-// clang-format on
-
-// ------------------------------------------------------------------
-// Parsing table.
-
-// clang-format off
-std::array<Row, yyparse::ROWS_COUNT> yyparse::table_ = {
-    Row {{0, {TE::Transit, 1}}, {1, {TE::Transit, 2}}, {2, {TE::Transit, 3}}, {4, {TE::Shift, 4}}, {5, {TE::Shift, 5}}, {6, {TE::Shift, 6}}, {7, {TE::Shift, 7}}},
-    Row {{9, {TE::Accept, 0}}},
-    Row {{4, {TE::Reduce, 1}}, {5, {TE::Reduce, 1}}, {6, {TE::Reduce, 1}}, {7, {TE::Reduce, 1}}, {8, {TE::Reduce, 1}}, {9, {TE::Reduce, 1}}},
-    Row {{4, {TE::Reduce, 2}}, {5, {TE::Reduce, 2}}, {6, {TE::Reduce, 2}}, {7, {TE::Reduce, 2}}, {8, {TE::Reduce, 2}}, {9, {TE::Reduce, 2}}},
-    Row {{4, {TE::Reduce, 3}}, {5, {TE::Reduce, 3}}, {6, {TE::Reduce, 3}}, {7, {TE::Reduce, 3}}, {8, {TE::Reduce, 3}}, {9, {TE::Reduce, 3}}},
-    Row {{4, {TE::Reduce, 4}}, {5, {TE::Reduce, 4}}, {6, {TE::Reduce, 4}}, {7, {TE::Reduce, 4}}, {8, {TE::Reduce, 4}}, {9, {TE::Reduce, 4}}},
-    Row {{4, {TE::Reduce, 5}}, {5, {TE::Reduce, 5}}, {6, {TE::Reduce, 5}}, {7, {TE::Reduce, 5}}, {8, {TE::Reduce, 5}}, {9, {TE::Reduce, 5}}},
-    Row {{3, {TE::Transit, 8}}, {4, {TE::Reduce, 7}}, {5, {TE::Reduce, 7}}, {6, {TE::Reduce, 7}}, {7, {TE::Reduce, 7}}, {8, {TE::Reduce, 7}}},
-    Row {{0, {TE::Transit, 10}}, {1, {TE::Transit, 2}}, {2, {TE::Transit, 3}}, {4, {TE::Shift, 4}}, {5, {TE::Shift, 5}}, {6, {TE::Shift, 6}}, {7, {TE::Shift, 7}}, {8, {TE::Shift, 9}}},
-    Row {{4, {TE::Reduce, 6}}, {5, {TE::Reduce, 6}}, {6, {TE::Reduce, 6}}, {7, {TE::Reduce, 6}}, {8, {TE::Reduce, 6}}, {9, {TE::Reduce, 6}}},
-    Row {{4, {TE::Reduce, 8}}, {5, {TE::Reduce, 8}}, {6, {TE::Reduce, 8}}, {7, {TE::Reduce, 8}}, {8, {TE::Reduce, 8}}}
-};
+// END GENERATED: productions
 // clang-format on
 
 }  // namespace syntax
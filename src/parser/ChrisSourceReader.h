@@ -0,0 +1,227 @@
+/**
+ * Streaming source reader.
+ */
+
+#ifndef ChrisSourceReader_h
+#define ChrisSourceReader_h
+
+#include <cctype>
+#include <cerrno>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "../Logger.h"
+
+/**
+ * Default read chunk size.
+ */
+#define SOURCE_CHUNK_SIZE (64 * 1024)
+
+/**
+ * Splits a source stream (file, pipe, stdin) into top-level expressions.
+ *
+ * The input is read in fixed-size chunks, and only the expression being
+ * scanned is kept in memory, so the peak memory is proportional to the
+ * largest expression rather than to the size of the input.
+ */
+class ChrisSourceReader {
+    public:
+    ChrisSourceReader(int fd, size_t chunkSize = SOURCE_CHUNK_SIZE)
+        : fd(fd), buffer(chunkSize) {}
+
+    /**
+     * Reads the next top-level expression (with its leading comments)
+     * into `exp`. Returns false at the end of the input.
+     *
+     * Unbalanced input is returned as is, so the parser reports the error.
+     */
+    bool next(std::string& exp) {
+        exp.clear();
+
+        auto state = State::CODE;
+        int depth = 0;
+
+        // Whether the expression has started (anything but comments).
+        bool started = false;
+
+        // Start of the current atom in `exp` (npos if not in an atom).
+        auto atomStart = std::string::npos;
+
+        for (;;) {
+            if (pos == size && !fill()) {
+                return started;
+            }
+
+            auto c = buffer[pos];
+
+            if (state == State::CODE && depth == 0 && started &&
+                atomStart != std::string::npos && isDelimiter(c)) {
+                // Top-level atom ends before the delimiter.
+                return true;
+            }
+
+            pos++;
+
+            if (c == '\n') {
+                currentLine++;
+            }
+
+            switch (state) {
+                case State::LINE_COMMENT:
+                    if (c == '\n') {
+                        state = State::CODE;
+                    }
+                    exp += c;
+                    continue;
+
+                case State::BLOCK_COMMENT:
+                    if (c == '/' && exp.size() > commentStart + 2 && exp.back() == '*') {
+                        state = State::CODE;
+                    }
+                    exp += c;
+                    continue;
+
+                case State::STRING:
+                    exp += c;
+                    if (c == '"') {
+                        state = State::CODE;
+                        if (depth == 0) {
+                            return true;
+                        }
+                    }
+                    continue;
+
+                case State::CODE:
+                    break;
+            }
+
+            // Comments: "//" and "/*" at the start of an atom.
+            if ((c == '/' || c == '*') && atomStart != std::string::npos &&
+                atomStart == exp.size() - 1 && exp.back() == '/') {
+                state = c == '/' ? State::LINE_COMMENT : State::BLOCK_COMMENT;
+                commentStart = exp.size() - 1;
+                atomStart = std::string::npos;
+
+                // The "/" was taken for the start of an expression.
+                if (depth == 0 && exp.size() - 1 == expStart) {
+                    started = false;
+                }
+
+                exp += c;
+                continue;
+            }
+
+            if (isspace((unsigned char)c)) {
+                atomStart = std::string::npos;
+
+                // Skip whitespace between top-level expressions.
+                if (!exp.empty()) {
+                    exp += c;
+                }
+                continue;
+            }
+
+            if (!started) {
+                started = true;
+                expStart = exp.size();
+
+                // Lines in `exp` count from its leading comments.
+                if (expStart == 0) {
+                    line = currentLine;
+                }
+            }
+
+            exp += c;
+
+            if (c == '"') {
+                state = State::STRING;
+                atomStart = std::string::npos;
+            } else if (c == '(') {
+                depth++;
+                atomStart = std::string::npos;
+            } else if (c == ')') {
+                atomStart = std::string::npos;
+                if (--depth <= 0) {
+                    return true;
+                }
+            } else if (atomStart == std::string::npos) {
+                atomStart = exp.size() - 1;
+            }
+        }
+    }
+
+    /**
+     * Line where the last read expression (with its leading comments)
+     * starts.
+     */
+    int line = 0;
+
+    private:
+    /**
+     * Scanner state.
+     */
+    enum class State {
+        CODE,
+        STRING,
+        LINE_COMMENT,
+        BLOCK_COMMENT,
+    };
+
+    /**
+     * Whether the char ends an atom.
+     */
+    static bool isDelimiter(char c) {
+        return isspace((unsigned char)c) || c == '(' || c == ')' || c == '"';
+    }
+
+    /**
+     * Reads the next chunk, returns false at the end of the input.
+     */
+    bool fill() {
+        if (eof) {
+            return false;
+        }
+
+        ssize_t count;
+        do {
+            count = read(fd, buffer.data(), buffer.size());
+        } while (count < 0 && errno == EINTR);
+
+        if (count < 0) {
+            DIE << "ChrisSourceReader: read error " << errno;
+        }
+
+        pos = 0;
+        size = (size_t)count;
+        eof = size == 0;
+
+        return !eof;
+    }
+
+    /**
+     * Source file descriptor.
+     */
+    int fd;
+
+    /**
+     * Current chunk.
+     */
+    std::vector<char> buffer;
+    size_t pos = 0;
+    size_t size = 0;
+    bool eof = false;
+
+    /**
+     * Current line in the input.
+     */
+    int currentLine = 1;
+
+    /**
+     * Offsets (in the expression) of the expression and comment start.
+     */
+    size_t expStart = 0;
+    size_t commentStart = 0;
+};
+
+#endif
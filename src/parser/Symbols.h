@@ -0,0 +1,174 @@
+/**
+ * Interned symbols of the language.
+ */
+
+#ifndef Symbols_h
+#define Symbols_h
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+/**
+ * Symbol flags.
+ */
+
+/**
+ * Pure operator: no side effects, the result depends only on the
+ * operands (the compiler may evaluate equal expressions once).
+ */
+#define SYMF_PURE 0x01
+
+/**
+ * May allocate a new object as the result (its identity is observable,
+ * so the result isn't shared).
+ */
+#define SYMF_ALLOCATES 0x02
+
+/**
+ * Symbols with a fixed ID: X(name, string, flags).
+ *
+ * The parser interns them, and the compiler dispatches special forms
+ * on the ID (a jump table) instead of comparing strings.
+ */
+#define SYMBOL_LIST(X)                                          \
+    /* Math. */                                                 \
+    X(ADD,          "+",            SYMF_PURE | SYMF_ALLOCATES) \
+    X(SUB,          "-",            SYMF_PURE)                  \
+    X(MUL,          "*",            SYMF_PURE)                  \
+    X(DIV,          "/",            SYMF_PURE)                  \
+                                                                \
+    /* Comparison (OP_COMPARE order). */                        \
+    X(LT,           "<",            SYMF_PURE)                  \
+    X(GT,           ">",            SYMF_PURE)                  \
+    X(EQ,           "==",           SYMF_PURE)                  \
+    X(GE,           ">=",           SYMF_PURE)                  \
+    X(LE,           "<=",           SYMF_PURE)                  \
+    X(NE,           "!=",           SYMF_PURE)                  \
+                                                                \
+    /* Special forms. */                                        \
+    X(IF,           "if",           0)                          \
+    X(WHILE,        "while",        0)                          \
+    X(VAR,          "var",          0)                          \
+    X(SET,          "set",          0)                          \
+    X(BEGIN,        "begin",        0)                          \
+    X(DEF,          "def",          0)                          \
+    X(LAMBDA,       "lambda",       0)                          \
+                                                                \
+    /* Arrays. */                                               \
+    X(ARRAY,        "array",        0)                          \
+    X(MAKE_ARRAY,   "make-array",   0)                          \
+    X(ARRAY_GET,    "array-get",    0)                          \
+    X(ARRAY_SET,    "array-set",    0)                          \
+    X(ARRAY_LENGTH, "array-length", 0)                          \
+    X(ARRAY_PUSH,   "array-push",   0)                          \
+    X(ARRAY_SUM,    "array-sum",    0)                          \
+    X(ARRAY_ADD,    "array-add",    0)                          \
+    X(ARRAY_DOT,    "array-dot",    0)                          \
+                                                                \
+    /* Hash maps. */                                            \
+    X(HASH_MAP,     "hash-map",     0)                          \
+    X(MAP_GET,      "map-get",      0)                          \
+    X(MAP_SET,      "map-set",      0)                          \
+    X(MAP_HAS,      "map-has",      0)                          \
+    X(MAP_SIZE,     "map-size",     0)                          \
+                                                                \
+    /* Literals. */                                             \
+    X(TRUE,         "true",         0)                          \
+    X(FALSE,        "false",        0)
+
+/**
+ * Symbol IDs (SYM_NONE for the other symbols: variables, functions).
+ */
+#define SYMBOL_ENUM(name, string, flags) SYM_##name,
+
+enum Symbol : uint8_t {
+    SYM_NONE,
+    SYMBOL_LIST(SYMBOL_ENUM)
+    SYMBOLS_COUNT
+};
+
+#undef SYMBOL_ENUM
+
+/**
+ * Symbols table size (a power of 2, the load stays under 1/2).
+ */
+#define SYMBOLS_TABLE_SIZE 128
+
+static_assert(SYMBOLS_COUNT * 2 <= SYMBOLS_TABLE_SIZE, "Symbols table too small");
+
+/**
+ * Interns a symbol: the ID of a known symbol, SYM_NONE otherwise.
+ *
+ * Open addressing by the FNV-1a hash of the name: a lookup hashes the
+ * name once and compares it with at most a couple of entries.
+ */
+class SymbolTable {
+    public:
+    static Symbol intern(const std::string& name) {
+        static const SymbolTable table;
+
+        for (auto i = hash(name);; i++) {
+            auto symbol = table.slots[i & (SYMBOLS_TABLE_SIZE - 1)];
+            if (symbol == SYM_NONE) {
+                return SYM_NONE;
+            }
+            if (name == names()[symbol]) {
+                return symbol;
+            }
+        }
+    }
+
+    /**
+     * Name of the symbol.
+     */
+    static const char* name(Symbol symbol) { return names()[symbol]; }
+
+    /**
+     * SYMF_* flags of the symbol (0 for SYM_NONE).
+     */
+    static uint8_t flags(Symbol symbol) {
+        #define SYMBOL_FLAGS(name, string, flags) flags,
+        static const std::array<uint8_t, SYMBOLS_COUNT> flags = {
+            0, SYMBOL_LIST(SYMBOL_FLAGS)
+        };
+        #undef SYMBOL_FLAGS
+        return flags[symbol];
+    }
+
+    private:
+    SymbolTable() {
+        slots.fill(SYM_NONE);
+        for (size_t symbol = SYM_NONE + 1; symbol < SYMBOLS_COUNT; symbol++) {
+            auto i = hash(names()[symbol]);
+            while (slots[i & (SYMBOLS_TABLE_SIZE - 1)] != SYM_NONE) {
+                i++;
+            }
+            slots[i & (SYMBOLS_TABLE_SIZE - 1)] = (Symbol)symbol;
+        }
+    }
+
+    static const std::array<const char*, SYMBOLS_COUNT>& names() {
+        #define SYMBOL_NAME(name, string, flags) string,
+        static const std::array<const char*, SYMBOLS_COUNT> names = {
+            "", SYMBOL_LIST(SYMBOL_NAME)
+        };
+        #undef SYMBOL_NAME
+        return names;
+    }
+
+    static size_t hash(const std::string& name) {
+        uint32_t hash = 2166136261u;
+        for (auto c : name) {
+            hash = (hash ^ (uint8_t)c) * 16777619u;
+        }
+        return hash;
+    }
+
+    /**
+     * Symbol IDs by hash slot (SYM_NONE is empty).
+     */
+    std::array<Symbol, SYMBOLS_TABLE_SIZE> slots;
+};
+
+#endif
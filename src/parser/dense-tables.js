@@ -0,0 +1,94 @@
+/**
+ * Copies the LR tables of a syntax-cli generated parser into
+ * ChrisParser.h, as a dense constexpr table (state x symbol).
+ *
+ *   syntax-cli -g src/parser/ChrisGrammar.bnf -m LALR1 -o /tmp/ChrisParser.h
+ *   node src/parser/dense-tables.js /tmp/ChrisParser.h src/parser/ChrisParser.h
+ *
+ * Only the regions between the "BEGIN GENERATED" / "END GENERATED"
+ * markers are replaced, the rest of ChrisParser.h is kept as is.
+ */
+
+'use strict';
+
+const fs = require('fs');
+
+if (process.argv.length !== 4) {
+  console.error('Usage: node dense-tables.js <generated-parser.h> <ChrisParser.h>');
+  process.exit(1);
+}
+
+const [generatedPath, parserPath] = process.argv.slice(2);
+const generated = fs.readFileSync(generatedPath, 'utf8');
+
+/**
+ * Returns the first capture of the pattern in the generated parser.
+ */
+function extract(pattern, what) {
+  const match = generated.match(pattern);
+  if (!match) {
+    console.error(`${generatedPath}: ${what} not found`);
+    process.exit(1);
+  }
+  return match[1];
+}
+
+// Productions: {{{-1, 1, &_handler1}, ...}}
+const productionsCount = extract(/PRODUCTIONS_COUNT = (\d+);/, 'PRODUCTIONS_COUNT');
+const productions = extract(/yyparse::productions_ = (\{\{[\s\S]*?\}\}\});/, 'productions_');
+
+// Sparse table: one "Row {{column, {TE::Type, value}}, ...}" per state.
+const rows = extract(/yyparse::table_ = \{([\s\S]*?)\n\};/, 'table_')
+  .split('\n')
+  .filter(line => line.trim().startsWith('Row'))
+  .map(line => {
+    const row = new Map();
+    for (const [, column, type, value] of line.matchAll(/\{(\d+), \{TE::(\w+), (\d+)\}\}/g)) {
+      row.set(Number(column), `{TE::${type}, ${value}}`);
+    }
+    return row;
+  });
+
+const columnsCount = 1 + Math.max(...rows.map(row => Math.max(...row.keys())));
+
+const table = rows
+  .map(row => {
+    const entries = [];
+    for (let column = 0; column < columnsCount; column++) {
+      entries.push(row.get(column) || '{TE::Error, 0}');
+    }
+    return `      {${entries.join(', ')}}`;
+  })
+  .join(',\n');
+
+const regions = {
+  'tables': [
+    `  static constexpr size_t PRODUCTIONS_COUNT = ${productionsCount};`,
+    `  static const std::array<Production, PRODUCTIONS_COUNT> productions_;`,
+    ``,
+    `  // Dense parsing table: [state][encoded symbol].`,
+    `  static constexpr size_t ROWS_COUNT = ${rows.length};`,
+    `  static constexpr size_t COLUMNS_COUNT = ${columnsCount};`,
+    `  static constexpr TableEntry table_[ROWS_COUNT][COLUMNS_COUNT] = {`,
+    table,
+    `  };`,
+  ],
+  'productions': [
+    `const std::array<Production, yyparse::PRODUCTIONS_COUNT> yyparse::productions_ = ` +
+      `${productions.replace(/\},\s*\{/g, '},\n{')};`,
+  ],
+};
+
+let parser = fs.readFileSync(parserPath, 'utf8');
+
+for (const [name, lines] of Object.entries(regions)) {
+  const region = new RegExp(
+    `(// BEGIN GENERATED: ${name}[^\\n]*\\n)[\\s\\S]*?([ ]*// END GENERATED: ${name})`);
+  if (!region.test(parser)) {
+    console.error(`${parserPath}: region "${name}" not found`);
+    process.exit(1);
+  }
+  parser = parser.replace(region, (_, begin, end) => begin + lines.join('\n') + '\n' + end);
+}
+
+fs.writeFileSync(parserPath, parser);
@@ -0,0 +1,306 @@
+/**
+ * Chris sampling profiler.
+ */
+
+#ifndef ChrisProfiler_h
+#define ChrisProfiler_h
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <sys/time.h>
+
+#include "../Logger.h"
+#include "../vm/ChrisValue.h"
+
+/**
+ * Default sampling frequency (samples per second of CPU time).
+ */
+#define PROFILER_DEFAULT_HZ 1000
+
+/**
+ * Max frames recorded per sample (the innermost are kept).
+ */
+#define PROFILER_MAX_DEPTH 64
+
+/**
+ * Samples buffered between drains (a power of 2).
+ */
+#define PROFILER_RING_SIZE 1024
+
+/**
+ * Buffered samples at which the VM drains the ring at the safepoint.
+ */
+#define PROFILER_DRAIN_THRESHOLD (PROFILER_RING_SIZE / 2)
+
+/**
+ * Frame of a sample: the code object and the bytecode offset in it.
+ */
+struct ProfileFrame {
+    CodeObject* co;
+    uint32_t offset;
+};
+
+/**
+ * Call stack sample, the innermost frame first.
+ */
+struct ProfileSample {
+    uint32_t depth;
+
+    /**
+     * Whether outer frames were dropped (deeper than PROFILER_MAX_DEPTH).
+     */
+    bool truncated;
+
+    ProfileFrame frames[PROFILER_MAX_DEPTH];
+};
+
+/**
+ * Lock-free single-producer single-consumer ring of samples: the VM
+ * thread records, the consumer drains (possibly from another thread).
+ */
+class SampleRing {
+    public:
+    SampleRing() : samples(std::make_unique<ProfileSample[]>(PROFILER_RING_SIZE)) {}
+
+    /**
+     * Slot for the next sample, nullptr if the ring is full.
+     */
+    ProfileSample* acquire() {
+        auto head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) == PROFILER_RING_SIZE) {
+            return nullptr;
+        }
+        return &samples[head & (PROFILER_RING_SIZE - 1)];
+    }
+
+    /**
+     * Makes the acquired sample visible to the consumer.
+     */
+    void publish() {
+        head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /**
+     * Number of published samples not drained yet.
+     */
+    size_t size() const {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Passes the published samples to the function and frees their slots.
+     */
+    template <typename Fn>
+    void drain(Fn fn) {
+        auto tail = tail_.load(std::memory_order_relaxed);
+        auto head = head_.load(std::memory_order_acquire);
+        for (; tail != head; tail++) {
+            fn(samples[tail & (PROFILER_RING_SIZE - 1)]);
+        }
+        tail_.store(tail, std::memory_order_release);
+    }
+
+    private:
+    std::unique_ptr<ProfileSample[]> samples;
+
+    /**
+     * Write and read positions (free-running, wrapped by the mask).
+     */
+    std::atomic<size_t> head_{0};
+    std::atomic<size_t> tail_{0};
+};
+
+/**
+ * Sampling profiler.
+ *
+ * A SIGPROF timer only raises the sample flag of the profiled VM, and
+ * the VM records its call stack (code objects and offsets) into the
+ * ring at the next safepoint (call, return or jump). Nothing is read
+ * from a half-updated VM state inside the signal handler, and straight
+ * line code pays nothing. Samples are aggregated by stack and exported
+ * as folded stacks ("main;fib:3;fib:4 12") for flame graph tools,
+ * resolved to source lines with the line tables.
+ *
+ * The VM is the consumer: it drains the ring at the safepoint once it
+ * is half full, and before compiling (which changes the line tables),
+ * so the samples of long runs are all kept.
+ *
+ * The timer is per process, so one profiler can be active at a time.
+ */
+class ChrisProfiler {
+    public:
+    ~ChrisProfiler() { stop(); }
+
+    /**
+     * Starts sampling: the signal handler raises the flag.
+     */
+    void start(volatile std::sig_atomic_t* flag, int hz = PROFILER_DEFAULT_HZ) {
+        if (hz <= 0 || hz > 1000000) {
+            DIE << "Profiler: invalid frequency " << hz;
+        }
+
+        volatile std::sig_atomic_t* expected = nullptr;
+        if (!activeFlag().compare_exchange_strong(expected, flag)) {
+            DIE << "Profiler: another profiler is running.";
+        }
+
+        struct sigaction action = {};
+        action.sa_handler = &ChrisProfiler::onSignal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGPROF, &action, &prevAction) != 0) {
+            activeFlag().store(nullptr);
+            DIE << "Profiler: sigaction failed: " << strerror(errno);
+        }
+
+        // tv_usec must be below a second.
+        auto interval = 1000000 / hz;
+
+        struct itimerval timer = {};
+        timer.it_interval.tv_sec = interval / 1000000;
+        timer.it_interval.tv_usec = interval % 1000000;
+        timer.it_value = timer.it_interval;
+        if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+            auto error = errno;
+            sigaction(SIGPROF, &prevAction, nullptr);
+            activeFlag().store(nullptr);
+            DIE << "Profiler: setitimer failed: " << strerror(error);
+        }
+
+        running = true;
+    }
+
+    /**
+     * Stops the timer (the recorded samples are kept).
+     */
+    void stop() {
+        if (!running) {
+            return;
+        }
+
+        struct itimerval timer = {};
+        setitimer(ITIMER_PROF, &timer, nullptr);
+        sigaction(SIGPROF, &prevAction, nullptr);
+
+        activeFlag().store(nullptr);
+        running = false;
+    }
+
+    /**
+     * Slot for a sample (VM thread), nullptr if the ring is full.
+     */
+    ProfileSample* acquire() {
+        auto sample = ring.acquire();
+        if (sample == nullptr) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        return sample;
+    }
+
+    /**
+     * Publishes the acquired sample.
+     */
+    void publish() { ring.publish(); }
+
+    /**
+     * Whether the ring should be drained before it fills up.
+     */
+    bool needsDrain() const { return ring.size() >= PROFILER_DRAIN_THRESHOLD; }
+
+    /**
+     * Aggregates the buffered samples by stack.
+     *
+     * Single consumer: the VM thread while profiling, anyone after
+     * stop. Not concurrent with compilation in the profiled VM (the
+     * line tables are read).
+     */
+    void drain() {
+        ring.drain([&](const ProfileSample& sample) {
+            std::string stack = sample.truncated ? "[truncated]" : "";
+            for (auto i = (int)sample.depth - 1; i >= 0; i--) {
+                if (!stack.empty()) {
+                    stack += ';';
+                }
+                appendFrame(stack, sample.frames[i]);
+            }
+            stacks[stack]++;
+            samples++;
+        });
+    }
+
+    /**
+     * Writes the folded stacks: "frame;frame;... count" per line.
+     */
+    void writeFolded(std::ostream& os) {
+        drain();
+        for (const auto& entry : stacks) {
+            os << entry.first << " " << entry.second << "\n";
+        }
+    }
+
+    /**
+     * Number of aggregated samples.
+     */
+    size_t samplesCount() {
+        drain();
+        return samples;
+    }
+
+    /**
+     * Samples lost because the ring was full.
+     */
+    size_t droppedCount() const { return dropped.load(std::memory_order_relaxed); }
+
+    private:
+    /**
+     * Appends "name:line" of the frame.
+     */
+    static void appendFrame(std::string& stack, const ProfileFrame& frame) {
+        stack += frame.co->name;
+        auto location = frame.co->lines.find(frame.offset);
+        if (location.line > 0) {
+            stack += ':';
+            stack += std::to_string(location.line);
+        }
+    }
+
+    /**
+     * SIGPROF handler: async-signal-safe, only raises the flag.
+     */
+    static void onSignal(int) {
+        auto flag = activeFlag().load(std::memory_order_relaxed);
+        if (flag != nullptr) {
+            *flag = 1;
+        }
+    }
+
+    /**
+     * Sample flag of the profiled VM.
+     */
+    static std::atomic<volatile std::sig_atomic_t*>& activeFlag() {
+        static std::atomic<volatile std::sig_atomic_t*> flag{nullptr};
+        return flag;
+    }
+
+    SampleRing ring;
+
+    /**
+     * Aggregated samples by folded stack.
+     */
+    std::map<std::string, size_t> stacks;
+
+    size_t samples = 0;
+
+    std::atomic<size_t> dropped{0};
+
+    bool running = false;
+
+    struct sigaction prevAction = {};
+};
+
+#endif
@@ -0,0 +1,168 @@
+/**
+ * Chris execution tracer.
+ */
+
+#ifndef ChrisTracer_h
+#define ChrisTracer_h
+
+#include <iomanip>
+#include <ostream>
+#include <vector>
+
+#include "../bytecode/OpCode.h"
+#include "../disassembler/ChrisDisassembler.h"
+#include "../vm/ChrisValue.h"
+
+/**
+ * Default trace size in instructions (a power of 2).
+ */
+#define TRACE_DEFAULT_SIZE 4096
+
+/**
+ * Entry flag: the code of the instruction was dropped since (incremental
+ * mode), its bytes can't be decoded.
+ */
+#define TRACE_CODE_DROPPED (1u << 24)
+
+/**
+ * Traced instruction (32 bytes).
+ */
+struct TraceEntry {
+    CodeObject* co;
+
+    /**
+     * Bytecode offset (code objects are limited to 64KiB) in the low
+     * 16 bits, the opcode, and the flags. A single word: byte stores may alias any
+     * VM register and force reloads in the eval loop.
+     */
+    uint32_t instruction;
+
+    /**
+     * Operand stack depth before the instruction.
+     */
+    uint32_t depth;
+
+    /**
+     * Top of the stack before the instruction (if depth > 0).
+     */
+    ChrisValue top;
+
+    size_t offset() const { return instruction & 0xFFFF; }
+
+    uint8_t opcode() const { return (uint8_t)(instruction >> 16); }
+};
+
+/**
+ * Execution trace: a fixed-size ring of the last executed instructions.
+ *
+ * Recording is a few stores into the ring, with no formatting, I/O or
+ * allocation, so the trace can stay on in production. Entries are
+ * decoded (with the disassembler) only when the trace is dumped, e.g.
+ * after an error.
+ */
+class ChrisTracer {
+    public:
+    ChrisTracer(size_t size = TRACE_DEFAULT_SIZE) {
+        size_t capacity = 1;
+        while (capacity < size) {
+            capacity <<= 1;
+        }
+        entries.resize(capacity);
+        mask = capacity - 1;
+    }
+
+    /**
+     * Records the instruction at ip.
+     */
+    void record(CodeObject* co, const uint8_t* ip, const ChrisValue* stackBase,
+                const ChrisValue* sp) {
+        auto& entry = entries[count++ & mask];
+        entry.co = co;
+        entry.instruction = (uint32_t)(ip - co->code.data()) | ((uint32_t)*ip << 16);
+        entry.depth = (uint32_t)(sp - stackBase);
+        if (sp != stackBase) {
+            entry.top = sp[-1];
+        }
+    }
+
+    /**
+     * Prints the last `last` instructions, the oldest first.
+     *
+     * The code objects must be alive (they live as long as their VM).
+     */
+    void decode(std::ostream& os, ChrisDisassembler& disassembler, size_t last) const {
+        auto recorded = std::min(count, entries.size());
+        last = std::min(last, recorded);
+
+        for (auto i = count - last; i != count; i++) {
+            const auto& entry = entries[i & mask];
+
+            std::ios_base::fmtflags f(os.flags());
+            os << std::left << std::setfill(' ') << std::setw(12)
+                << entry.co->name << " ";
+            os.flags(f);
+
+            // Incremental mode rewinds the main code: the bytes at the
+            // offset may belong to a later expression.
+            if (!(entry.instruction & TRACE_CODE_DROPPED) &&
+                entry.offset() < entry.co->code.size() &&
+                entry.co->code[entry.offset()] == entry.opcode()) {
+                disassembler.disassembleInstruction(entry.co, entry.offset());
+            } else {
+                os << "(code changed) " << opcodeToString(entry.opcode());
+            }
+
+            os << "  ; depth " << entry.depth;
+            if (entry.depth > 0) {
+                os << ", top ";
+                // Containers are recorded by reference and may have changed
+                // since, only their type is shown.
+                if (IS_ARRAY(entry.top) || IS_MAP(entry.top)) {
+                    os << chrisValueToTypeString(entry.top);
+                } else {
+                    os << chrisValueToConstantString(entry.top);
+                }
+            }
+            os << "\n";
+        }
+    }
+
+    /**
+     * Marks the recorded instructions of the code as not decodable (its
+     * bytes were dropped and are reused).
+     */
+    void forget(CodeObject* co) {
+        for (auto& entry : entries) {
+            if (entry.co == co) {
+                entry.instruction |= TRACE_CODE_DROPPED;
+            }
+        }
+    }
+
+    /**
+     * Drops the recorded instructions.
+     */
+    void clear() { count = 0; }
+
+    /**
+     * Instructions recorded since the start (or the last clear).
+     */
+    size_t recordedCount() const { return count; }
+
+    /**
+     * Ring capacity in instructions.
+     */
+    size_t capacity() const { return entries.size(); }
+
+    private:
+    std::vector<TraceEntry> entries;
+
+    size_t mask;
+
+    /**
+     * Recorded instructions (free-running, wrapped by the mask).
+     */
+    size_t count = 0;
+};
+
+#endif
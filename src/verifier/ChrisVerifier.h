@@ -0,0 +1,230 @@
+/**
+ * Chris bytecode verifier.
+ */
+
+#ifndef ChrisVerifier_h
+#define ChrisVerifier_h
+
+#include <memory>
+#include <vector>
+
+#include "../Logger.h"
+#include "../bytecode/OpCode.h"
+#include "../vm/ChrisValue.h"
+#include "../vm/Global.h"
+
+/**
+ * Number of compare ops (operand of OP_COMPARE).
+ */
+#define COMPARE_OPS_COUNT 6
+
+/**
+ * Reports verification error.
+ */
+#define VERIFY_ERROR(offset) \
+    COMPILE_ERROR << "Verify error at offset " << (offset) << ": "
+
+/**
+ * Bytecode verifier.
+ *
+ * Checks that the code decodes into valid instructions, operands are in
+ * range, jumps land on instruction boundaries, and the stack depth is
+ * consistent on every path. Returns the max stack depth of the code.
+ */
+class ChrisVerifier {
+    public:
+    ChrisVerifier(std::shared_ptr<Global> global) : global(global) {}
+
+    /**
+     * Verifies the code of the unit starting from the entry offset,
+     * with the initial stack depth of the frame.
+     */
+    size_t verify(CodeObject* co, size_t entry = 0, int initialDepth = 0) {
+        auto size = co->code.size();
+
+        // Stack depth at each instruction.
+        depths.assign(size - entry, NOT_BOUNDARY);
+        worklist.clear();
+
+        // Decode linearly to find the instruction boundaries.
+        for (auto offset = entry; offset < size;) {
+            auto opcode = co->code[offset];
+
+            if (!isValidOpcode(opcode)) {
+                VERIFY_ERROR(offset) << "unknown opcode " << (int)opcode;
+            }
+
+            if (offset + opcodeTable[opcode].length > size) {
+                VERIFY_ERROR(offset) << "truncated " << opcodeTable[opcode].name;
+            }
+
+            depths[offset - entry] = NOT_REACHED;
+            offset += opcodeTable[opcode].length;
+        }
+
+        size_t maxDepth = initialDepth;
+
+        enqueue(co, entry, initialDepth, entry);
+
+        while (!worklist.empty()) {
+            auto offset = worklist.back();
+            worklist.pop_back();
+
+            auto opcode = co->code[offset];
+            const auto& info = opcodeTable[opcode];
+
+            auto depth = depths[offset - entry];
+
+            int pops = info.pops;
+            if (opcodeHasFlag(opcode, OPF_POPS_OPERAND)) {
+                pops += co->code[offset + 1];
+            }
+
+            if (depth < pops) {
+                VERIFY_ERROR(offset) << "stack underflow in " << info.name;
+            }
+
+            checkOperand(co, info, offset + 1, depth);
+
+            depth += info.pushes - pops;
+
+            if ((size_t)depth > maxDepth) {
+                maxDepth = depth;
+            }
+
+            if (opcodeHasFlag(opcode, OPF_BRANCH)) {
+                auto target = (size_t)((co->code[offset + 1] << 8) | co->code[offset + 2]);
+                enqueue(co, target, depth, entry);
+            }
+
+            if (!opcodeHasFlag(opcode, OPF_NO_FALLTHROUGH)) {
+                enqueue(co, offset + info.length, depth, entry);
+            }
+        }
+
+        return maxDepth;
+    }
+
+    private:
+    static constexpr int NOT_REACHED = -1;
+    static constexpr int NOT_BOUNDARY = -2;
+
+    /**
+     * Schedules an instruction, checking the depth is the same on all paths.
+     */
+    void enqueue(CodeObject* co, size_t offset, int depth, size_t entry) {
+        if (offset < entry || offset >= co->code.size()) {
+            VERIFY_ERROR(offset) << "control flow leaves the code";
+        }
+
+        auto& known = depths[offset - entry];
+
+        if (known == NOT_BOUNDARY) {
+            VERIFY_ERROR(offset) << "jump into the middle of an instruction";
+        }
+
+        if (known == NOT_REACHED) {
+            known = depth;
+            worklist.push_back(offset);
+        } else if (known != depth) {
+            VERIFY_ERROR(offset) << "inconsistent stack depth (" << known << " vs "
+                << depth << ")";
+        }
+    }
+
+    /**
+     * Checks the instruction operand.
+     */
+    void checkOperand(CodeObject* co, const OpCodeInfo& info, size_t offset, int depth) {
+        switch (info.operand) {
+            case OperandType::NONE:
+            case OperandType::ADDRESS:
+            case OperandType::COUNT:
+                break;
+            case OperandType::LOCAL:
+                if (co->code[offset] >= depth) {
+                    VERIFY_ERROR(offset) << "local slot out of frame";
+                }
+                break;
+            case OperandType::CONST:
+                checkConst(co, offset, co->code[offset]);
+                break;
+            case OperandType::CONST_WIDE:
+                checkConst(co, offset, (co->code[offset] << 8) | co->code[offset + 1]);
+                break;
+            case OperandType::UPVALUE:
+                if (co->code[offset] >= co->upvalues.size()) {
+                    VERIFY_ERROR(offset) << "upvalue index out of range";
+                }
+                break;
+            case OperandType::CLOSURE:
+                checkClosure(co, offset, depth);
+                break;
+            case OperandType::COMPARE:
+                if (co->code[offset] >= COMPARE_OPS_COUNT) {
+                    VERIFY_ERROR(offset) << "unknown compare op";
+                }
+                break;
+            case OperandType::GLOBAL:
+                if (co->code[offset] >= global->globals.size()) {
+                    VERIFY_ERROR(offset) << "global index out of range";
+                }
+                break;
+            case OperandType::LOOP:
+                if (co->code[offset] >= co->loops.size()) {
+                    VERIFY_ERROR(offset) << "loop index out of range";
+                }
+                break;
+        }
+    }
+
+    /**
+     * Checks the constant pushed by OP_CONST (or OP_CONST_WIDE).
+     */
+    void checkConst(CodeObject* co, size_t offset, size_t index) {
+        if (index >= co->constants.size()) {
+            VERIFY_ERROR(offset) << "constant index out of range";
+        }
+        // Functions with upvalues only run as closures.
+        if (IS_FUNCTION(co->constants[index]) &&
+            !AS_FUNCTION(co->constants[index])->co->upvalues.empty()) {
+            VERIFY_ERROR(offset) << "function with upvalues used as a constant";
+        }
+    }
+
+    /**
+     * Checks the function of OP_CLOSURE and its captures.
+     */
+    void checkClosure(CodeObject* co, size_t offset, int depth) {
+        auto index = co->code[offset];
+
+        if (index >= co->constants.size() || !IS_FUNCTION(co->constants[index])) {
+            VERIFY_ERROR(offset) << "closure of a non-function constant";
+        }
+
+        for (const auto& upvalue : AS_FUNCTION(co->constants[index])->co->upvalues) {
+            if (upvalue.isLocal ? upvalue.index >= (size_t)depth
+                                : upvalue.index >= co->upvalues.size()) {
+                VERIFY_ERROR(offset) << "captured variable " << upvalue.name
+                    << " out of range";
+            }
+        }
+    }
+
+    /**
+     * Global object.
+     */
+    std::shared_ptr<Global> global;
+
+    /**
+     * Stack depths by offset (reused across runs).
+     */
+    std::vector<int> depths;
+
+    /**
+     * Instructions to visit.
+     */
+    std::vector<size_t> worklist;
+};
+
+#endif
@@ -5,7 +5,10 @@
 #ifndef ChrisVM_h
 #define ChrisVM_h
 
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -13,7 +16,13 @@
 #include "../bytecode/OpCode.h"
 #include "../parser/ChrisParser.h"
 #include "../compiler/ChrisCompiler.h"
+#include "../metrics/ChrisMetrics.h"
+#include "../profiler/ChrisProfiler.h"
+#include "../tracer/ChrisTracer.h"
+#include "../verifier/ChrisVerifier.h"
 #include "ChrisValue.h"
+#include "Global.h"
+#include "Heap.h"
 
 using syntax::ChrisParser;
 
@@ -39,47 +48,209 @@ using syntax::ChrisParser;
 #define GET_CONST() (co->constants[READ_BYTE()])
 
 /**
- * Stack top (stack overflow after exceeding).
+ * Gets a constant by a 2-byte index.
  */
-#define STACK_LIMIT 512
+#define GET_CONST_WIDE() (co->constants[READ_SHORT()])
+
+/**
+ * Profiler safepoint (calls, returns and jumps, so every function and
+ * loop reaches one): records a sample if the timer raised the flag.
+ */
+#define PROFILER_SAFEPOINT()  \
+    do {                      \
+        if (samplePending) {  \
+            recordSample();   \
+        }                     \
+    } while (false)
+
+/**
+ * Default max operand stack size in slots (stack overflow after
+ * exceeding), configurable per VM.
+ */
+#define STACK_LIMIT (1024 * 1024)
+
+/**
+ * Initial operand stack size in slots (and call frames count).
+ */
+#define STACK_INITIAL_SIZE 64
+
+/**
+ * Max number of array elements.
+ */
+#define ARRAY_SIZE_LIMIT (1 << 28)
+
+/**
+ * Default iterations after which a loop is hot (the on-stack replacement
+ * hook is called).
+ */
+#define OSR_THRESHOLD 1000
+
+/**
+ * Code to continue a hot loop in (on-stack replacement): the instruction
+ * at the offset runs next. A nullptr code keeps running the current one.
+ */
+struct OsrEntry {
+    CodeObject* code;
+    size_t offset;
+};
+
+/**
+ * On-stack replacement hook: called once a loop of the code (by index)
+ * crosses the hot threshold, at the start of an iteration (`offset`
+ * follows the loop header). A faster tier (optimized or quickened
+ * bytecode) takes over by returning its code for the rest of the frame:
+ * it must use the same frame layout (the locals and the operand stack
+ * stay as they are), and must have been verified.
+ *
+ * Returning a nullptr code (e.g. the tier is not ready yet) re-arms the
+ * trigger at twice the iterations.
+ */
+using OsrHook = std::function<OsrEntry(CodeObject* code, size_t loop, size_t offset)>;
+
+/**
+ * Iteration statistics of a loop (for profiling).
+ */
+struct LoopStats {
+    std::string function;
+    SourceLocation location;
+    uint64_t iterations;
+    bool hot;
+    uint32_t replacements;
+};
+
+/**
+ * Call frame (activation record).
+ */
+struct Frame {
+    /**
+     * Return address (ip of the caller).
+     */
+    uint8_t* ra;
+
+    /**
+     * Base pointer of the caller.
+     */
+    ChrisValue* bp;
+
+    /**
+     * Code object of the caller.
+     */
+    CodeObject* co;
+
+    /**
+     * Closure of the caller (nullptr for plain functions).
+     */
+    ClosureObject* closure;
+};
+
+/**
+ * Counts the executed instructions in a register, and adds them to the
+ * VM counter when the eval loop exits (also on errors).
+ */
+struct InstructionCounter {
+    size_t& total;
+    size_t count = 0;
+
+    ~InstructionCounter() { total += count; }
+};
+
+/**
+ * Stack caching state, part of the dispatch key (opcode | state): the
+ * top of the operand stack is held in the `tos` local of the eval loop
+ * instead of the stack memory, and sp points past the rest of the
+ * stack. Opcodes have a version per state, so no instruction tests it.
+ */
+#define TOS_CACHED 0x100
+
+/**
+ * Addition: numbers or string concatenation.
+ */
+#define ADD_VALUES(op1, op2, result)                                          \
+    do {                                                                      \
+        int64_t intResult;                                                    \
+        /* Integer addition (promoted to double on overflow): */              \
+        if (IS_INT(op1) && IS_INT(op2) &&                                     \
+            !__builtin_add_overflow(AS_INT(op1), AS_INT(op2), &intResult)) {  \
+            result = INT(intResult);                                          \
+        } else if (IS_NUMERIC(op1) && IS_NUMERIC(op2)) {                      \
+            result = NUMBER(AS_DOUBLE(op1) + AS_DOUBLE(op2));                 \
+        } else if (IS_STRING(op1) && IS_STRING(op2)) {                        \
+            auto s1 = AS_CPPSTRING(op1);                                      \
+            auto s2 = AS_CPPSTRING(op2);                                      \
+            result = ALLOC_STRING(s1 + s2);                                   \
+        } else {                                                              \
+            DIE << "Operator +: expected numbers or strings";                 \
+        }                                                                     \
+    } while (false)
 
 /**
  * Binary operation.
+ *
+ * Integers use the overflow-checked builtin (`checkedOp`), the result
+ * is promoted to double on overflow. Mixed operands are doubles.
  */
-#define BINARY_OP(op)                \
-    do {                             \
-        auto op2 = AS_NUMBER(pop()); \
-        auto op1 = AS_NUMBER(pop()); \
-        push(NUMBER(op1 op op2));    \
+#define BINARY_OP(op, checkedOp, op1, op2, result)                    \
+    do {                                                              \
+        int64_t intResult;                                            \
+        if (IS_INT(op1) && IS_INT(op2) &&                             \
+            !checkedOp(AS_INT(op1), AS_INT(op2), &intResult)) {       \
+            result = INT(intResult);                                  \
+        } else if (IS_NUMERIC(op1) && IS_NUMERIC(op2)) {              \
+            result = NUMBER(AS_DOUBLE(op1) op AS_DOUBLE(op2));        \
+        } else {                                                      \
+            DIE << "Operator " #op ": expected numbers";              \
+        }                                                             \
     } while (false)
 
 /**
  * Generic value comparison.
  */
-#define COMPARE_VALUES(op, v1, v2)  \
-    do {                            \
-        bool res;                   \
-        switch (op) {               \
-            case 0:                 \
-                res = v1 < v2;      \
-                break;              \
-            case 1:                 \
-                res = v1 > v2;      \
-                break;              \
-            case 2:                 \
-                res = v1 == v2;     \
-                break;              \
-            case 3:                 \
-                res = v1 >= v2;     \
-                break;              \
-            case 4:                 \
-                res = v1 <= v2;     \
-                break;              \
-            case 5:                 \
-                res = v1 != v2;     \
-                break;              \
-        };                          \
-        push(BOOLEAN(res));         \
+#define COMPARE_VALUES(op, v1, v2, result)  \
+    do {                                    \
+        bool res;                           \
+        switch (op) {                       \
+            case 0:                         \
+                res = v1 < v2;              \
+                break;                      \
+            case 1:                         \
+                res = v1 > v2;              \
+                break;                      \
+            case 2:                         \
+                res = v1 == v2;             \
+                break;                      \
+            case 3:                         \
+                res = v1 >= v2;             \
+                break;                      \
+            case 4:                         \
+                res = v1 <= v2;             \
+                break;                      \
+            case 5:                         \
+                res = v1 != v2;             \
+                break;                      \
+        };                                  \
+        result = BOOLEAN(res);              \
+    } while (false)
+
+/**
+ * Comparison of numbers or strings.
+ */
+#define COMPARE_OP(op, op1, op2, result)                  \
+    do {                                                  \
+        if (IS_INT(op1) && IS_INT(op2)) {                 \
+            auto v1 = AS_INT(op1);                        \
+            auto v2 = AS_INT(op2);                        \
+            COMPARE_VALUES(op, v1, v2, result);           \
+        } else if (IS_NUMERIC(op1) && IS_NUMERIC(op2)) {  \
+            auto v1 = AS_DOUBLE(op1);                     \
+            auto v2 = AS_DOUBLE(op2);                     \
+            COMPARE_VALUES(op, v1, v2, result);           \
+        } else if (IS_STRING(op1) && IS_STRING(op2)) {    \
+            auto s1 = AS_STRING(op1);                     \
+            auto s2 = AS_STRING(op2);                     \
+            COMPARE_VALUES(op, s1, s2, result);           \
+        } else {                                          \
+            DIE << "Comparison: incompatible operands";   \
+        }                                                 \
     } while (false)
 
 /**
@@ -87,187 +258,1607 @@ using syntax::ChrisParser;
  */
 class ChrisVM {
     public:
-        ChrisVM() : parser(std::make_unique<ChrisParser>()),
-                    compiler(std::make_unique<ChrisCompiler>()) {}
+        /**
+         * The stack starts small and grows on demand up to `stackLimit`
+         * slots (the max call depth is the same).
+         */
+        ChrisVM(size_t stackLimit = STACK_LIMIT)
+            : heap(std::make_unique<Heap>()),
+              global(std::make_shared<Global>()),
+              parser(std::make_unique<ChrisParser>()),
+              compiler(std::make_unique<ChrisCompiler>(global)),
+              verifier(std::make_unique<ChrisVerifier>(global)),
+              stackLimit(stackLimit) {
+            stack.resize(std::min((size_t)STACK_INITIAL_SIZE, stackLimit));
+            stackEnd = stack.data() + stack.size();
+            frames.resize(stack.size());
+        }
+
+        ~ChrisVM() { stopProfiler(); }
 
         /**
          * Pushes a value onto the stack.
          */
         void push(const ChrisValue& value) {
-            if ((size_t)(sp - stack.begin()) == STACK_LIMIT) {
-                DIE << "push(): Stack overflow.\n";
+            if (sp == stackEnd) {
+                DIE << "push(): Stack overflow.";
             }
             *sp = value;
             sp++;
         }
 
+        /**
+         * Peeks an element from the stack.
+         */
+        ChrisValue& peek(size_t offset = 0) {
+            if ((size_t)(sp - stack.data()) <= offset) {
+                DIE << "peek(): empty stack.";
+            }
+            return *(sp - 1 - offset);
+        }
+
+        /**
+         * Pops multiple values from the stack.
+         */
+        void popN(size_t count) {
+            if ((size_t)(sp - stack.data()) < count) {
+                DIE << "popN(): empty stack.";
+            }
+            sp -= count;
+        }
+
         /**
          * Pops a value from the stack.
          */
         ChrisValue pop() {
-            if (sp == stack.begin()) {
-                DIE << "pop(): empty stack.\n";
+            if (sp == stack.data()) {
+                DIE << "pop(): empty stack.";
             }
             --sp;
             return *sp;
         }
     
+        /**
+         * Executes a program, reporting failures through `error`
+         * instead of throwing. The VM stays reusable after a failure.
+         */
+        bool tryExec(const std::string& program, ChrisValue& result) {
+            return catchErrors([&]() { return exec(program); }, result);
+        }
+
+        /**
+         * Incremental version of tryExec.
+         */
+        bool tryExecIncremental(const std::string& source, ChrisValue& result,
+                                int firstLine = 1) {
+            return catchErrors([&]() { return execIncremental(source, firstLine); }, result);
+        }
+
+        /**
+         * Runs a compiled program, reporting failures through `error`.
+         */
+        bool tryRun(CodeObject* program, ChrisValue& result) {
+            return catchErrors([&]() { return run(program); }, result);
+        }
+
         /**
         * Executes a program.
+        *
+        * Throws ChrisError on syntax, compile or runtime errors.
         */
         ChrisValue exec(const std::string& program) {
+            auto code = compile(program);
+
+            // Debug disassembly:
+            compiler->disassemblyBytecode();
+
+            return run(code);
+        }
+
+        /**
+         * Compiles a program, which can be cached and executed
+         * any number of times with `run`.
+         *
+         * With metrics enabled, the executions are recorded under the
+         * name (programs with the same name share the metrics).
+         */
+        CodeObject* compile(const std::string& program, const std::string& name = "main") {
+            HeapScope heapScope(heap.get());
+
+            co = nullptr;
+            drainProfiler();
+
             // 1. Parse the program
             auto ast = parser->parse(program);
 
             // 2. Compile program to Chris bytecode
             co = compiler->compile(ast);
 
+            // 3. Verify the bytecode
+            verify(0);
+
+            if (metrics != nullptr) {
+                co->metrics = metrics->program(name);
+            }
+
+            return co;
+        }
+
+        /**
+         * Runs a compiled program.
+         */
+        ChrisValue run(CodeObject* program) {
+            HeapScope heapScope(heap.get());
+
+            co = program;
+
             // Set instruction pointer to the beginning:
             ip = &co->code[0];
 
-            // Init the stack:
-            sp = &stack[0];
+            resetStack();
 
-            // Debug disassembly:
-            compiler->disassemblyBytecode();
+            return execute();
+        }
 
-            return eval();
+        /**
+         * Defines a global (or returns the slot of an existing one)
+         * and binds it to the value. Globals defined before compiling
+         * a program are visible to the program.
+         */
+        size_t defineGlobal(const std::string& name, const ChrisValue& value) {
+            return global->addConst(name, value);
         }
 
-        /** 
-         * Main eval loop.
+        /**
+         * Defines a native function global (arity NATIVE_VARIADIC accepts
+         * any number of arguments). Calls compiled after the definition
+         * use the native fast path.
          */
-        ChrisValue eval() {
-            for (;;) {
-                auto opcode = READ_BYTE();
-                //log(opcode);
-                switch (opcode) {
-                    case OP_HALT:
-                        return pop();
+        size_t defineNative(const std::string& name, NativeFn fn, int arity) {
+            HeapScope heapScope(heap.get());
+            return global->addConst(name, ALLOC_NATIVE(fn, name, arity));
+        }
 
-                    // ---------------------
-                    // Constants:
-                    case OP_CONST:
-                        push(GET_CONST());
-                        break;
+        /**
+         * Starts sampling the call stacks of this VM into the profiler.
+         */
+        void startProfiler(ChrisProfiler& profiler, int hz = PROFILER_DEFAULT_HZ) {
+            stopProfiler();
+            profiler.start(&samplePending, hz);
+            this->profiler = &profiler;
+        }
 
-                    // ---------------------
-                    // Math ops:
-                    case OP_ADD:
-                    {
-                        auto op2 = pop();
-                        auto op1 = pop();
+        /**
+         * Stops sampling (the profiler keeps the samples).
+         */
+        void stopProfiler() {
+            if (profiler != nullptr) {
+                profiler->stop();
+                profiler = nullptr;
+            }
+            samplePending = 0;
+        }
 
-                        // Numeric addition:
-                        if (IS_NUMBER(op1) && IS_NUMBER(op2)) {
-                            auto v1 = AS_NUMBER(op1);
-                            auto v2 = AS_NUMBER(op2);
-                            push(NUMBER(v1 + v2));
-                        }
-                        
-                        // String concatenation
-                        else if (IS_STRING(op1) && IS_STRING(op2)) {
-                            auto s1 = AS_CPPSTRING(op1);
-                            auto s2 = AS_CPPSTRING(op2);
-                            push(ALLOC_STRING(s1 + s2));
-                        }
-                        break;
-                    }
+        /**
+         * Records the executed instructions into the tracer (nullptr
+         * turns tracing off). Takes effect from the next run.
+         */
+        void setTracer(ChrisTracer* tracer) { this->tracer = tracer; }
 
-                    case OP_SUB:
-                    {
-                        BINARY_OP(-);
-                        break;
-                    }
+        /**
+         * Prints the last traced instructions.
+         */
+        void dumpTrace(std::ostream& os, size_t last) {
+            if (tracer == nullptr) {
+                return;
+            }
+            ChrisDisassembler disassembler(global, os);
+            tracer->decode(os, disassembler, last);
+        }
 
-                    case OP_MUL:
-                    {
-                        BINARY_OP(*);
-                        break;
-                    }
+        /**
+         * Turns top-of-stack caching in the eval loop on or off (the
+         * traced loop never caches).
+         */
+        void setStackCaching(bool enabled) { stackCaching = enabled; }
 
-                    case OP_DIV:
-                    {
-                        BINARY_OP(/);
-                        break;
-                    }
+        /**
+         * Records executions into the metrics registry (nullptr turns
+         * metrics off). Applies to programs compiled afterwards.
+         */
+        void setMetrics(ChrisMetrics* metrics) { this->metrics = metrics; }
 
-                    // Comparison
-                    case OP_COMPARE:
-                    {
-                        auto op = READ_BYTE();
+        /**
+         * Calls the hook when a loop gets hot (nullptr turns it off).
+         */
+        void setOsrHook(OsrHook hook) { osrHook = std::move(hook); }
 
-                        auto op2 = pop();
-                        auto op1 = pop();
+        /**
+         * Iterations after which a loop is hot (counted over all the
+         * entries of the loop, at least 1).
+         */
+        void setOsrThreshold(uint64_t iterations) {
+            if (iterations == 0) {
+                DIE << "OSR threshold must be at least 1.";
+            }
 
-                        if (IS_NUMBER(op1) && IS_NUMBER(op2)) {
-                            auto v1 = AS_NUMBER(op1);
-                            auto v2 = AS_NUMBER(op2);
-                            COMPARE_VALUES(op, v1, v2);
-                        } else if (IS_STRING(op1) && IS_STRING(op2)) {
-                            auto s1 = AS_STRING(op1);
-                            auto s2 = AS_STRING(op2);
-                            COMPARE_VALUES(op, s1, s2);
-                        }
-                        break;
+            osrThreshold = iterations;
+
+            // Re-arms the loops that are not hot yet (those already past
+            // the threshold get hot on their next iteration).
+            for (auto code : loopCode) {
+                for (auto& loop : code->loops) {
+                    if (!loop.hot) {
+                        loop.osrAt = std::max(iterations, loop.iterations + 1);
                     }
+                }
+            }
+        }
 
-                    // ---------------------
-                    // Conditional jump:
-                    case OP_JMP_IF_FALSE: {
-                        auto cond = AS_BOOLEAN(pop());
+        /**
+         * Iteration statistics of the loops of all the compiled code, the
+         * most iterated first.
+         */
+        std::vector<LoopStats> getLoopStats() {
+            retireDroppedLoops();
 
-                        auto address = READ_SHORT();
+            auto stats = retiredLoops;
+            for (auto code : loopCode) {
+                for (const auto& loop : code->loops) {
+                    stats.push_back({code->name, loop.location, loop.iterations, loop.hot,
+                                     loop.replacements});
+                }
+            }
+            std::stable_sort(stats.begin(), stats.end(), [](const auto& a, const auto& b) {
+                return a.iterations > b.iterations;
+            });
+            return stats;
+        }
 
-                        if (!cond) {
-                            ip = TO_ADDRESS(address);
-                        }
-                        
-                        break;
-                    }
+        /**
+         * Heap of the VM objects (all released with the VM).
+         */
+        const Heap& getHeap() { return *heap; }
 
-                    // ---------------------
-                    // Unconditional jump:
-                    case OP_JMP: {
-                        ip = TO_ADDRESS(READ_SHORT());
-                        break;
-                    }
-                    
-                    default:
-                        DIE << "Unknown opcode: " << std::hex << opcode;
-                }
+        /**
+         * Returns the slot of a global, -1 if not defined.
+         */
+        int getGlobalSlot(const std::string& name) {
+            return global->getGlobalIndex(name);
+        }
+
+        /**
+         * Binds a global by slot (e.g. before running a cached program).
+         */
+        void setGlobal(size_t slot, const ChrisValue& value) {
+            global->set(slot, value);
+        }
+
+        /**
+         * Returns the value of a global by slot.
+         */
+        const ChrisValue& getGlobal(size_t slot) {
+            return global->get(slot).value;
+        }
+
+        /**
+         * Executes an expression as a continuation of the previous ones
+         * (REPL, streaming): the code is appended to the same long-lived
+         * program, and only the newly appended code is executed.
+         *
+         * `firstLine` is the line of the source in the whole input
+         * (compile and runtime errors report absolute lines).
+         */
+        ChrisValue execIncremental(const std::string& source, int firstLine = 1) {
+            HeapScope heapScope(heap.get());
+
+            co = nullptr;
+            drainProfiler();
+
+            auto ast = parser->parse(source);
+
+            auto entry = compiler->compileIncremental(ast, firstLine);
+
+            co = compiler->getProgram();
+            retireDroppedLoops();
+
+            // The trace may still refer to the dropped main code.
+            if (compiler->getRewinds() != tracedRewinds && tracer != nullptr) {
+                tracer->forget(co);
+            }
+            tracedRewinds = compiler->getRewinds();
+            verify(entry);
+
+            if (metrics != nullptr && co->metrics == nullptr) {
+                co->metrics = metrics->program("main");
             }
+
+            ip = &co->code[entry];
+
+            resetStack();
+
+            return execute();
         }
 
+    private:
         /**
-         * Parser.
+         * Runs the code at ip, recording the execution into the metrics
+         * of the program (latency, instructions, allocations).
          */
-        std::unique_ptr<ChrisParser> parser;
+        ChrisValue execute() {
+            auto programMetrics = metrics != nullptr ? co->metrics : nullptr;
+
+            if (programMetrics == nullptr) {
+                return eval();
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            auto allocations = heap->allocationsCount();
+            instructionCount = 0;
+            countInstructions = true;
+
+            auto record = [&](bool failed) {
+                countInstructions = false;
+                std::chrono::nanoseconds duration = std::chrono::steady_clock::now() - start;
+                programMetrics->record(duration.count(), instructionCount,
+                                       heap->allocationsCount() - allocations, failed);
+            };
+
+            try {
+                auto result = eval();
+                record(false);
+                return result;
+            } catch (const ChrisError&) {
+                record(true);
+                throw;
+            }
+        }
 
         /**
-         * Compiler.
+         * Inits the stack (and the frames) for a new run.
          */
-        std::unique_ptr<ChrisCompiler> compiler;
+        void resetStack() {
+            // Variables captured by closures which outlive a failed run
+            // keep their last values.
+            closeUpvalues(stack.data());
+
+            sp = stack.data();
+            bp = sp;
+            fp = frames.data();
+            closure = nullptr;
+
+            // Pre-size for the main code.
+            ensureStack(co->maxStackDepth);
+        }
 
         /**
-         * Instruction pointer (aka Program counter).
+         * Makes room for a frame of `depth` slots starting at bp.
+         *
+         * Checked once per frame (the verifier computes the max depth of
+         * each code object), so pushes don't need to grow the stack.
          */
-        uint8_t* ip;
+        void ensureStack(size_t depth) {
+            if (bp + depth > stackEnd) {
+                growStack(bp - stack.data() + depth);
+            }
+        }
 
         /**
-         * Stack pointer.
+         * Grows the stack to at least `size` slots.
+         *
+         * The stack is contiguous (callee frames overlap the caller's
+         * operands), so growing relocates it and rebases all pointers
+         * into it: sp, bp, saved frames and open upvalues.
          */
-        ChrisValue* sp;
+        void growStack(size_t size) {
+            if (size > stackLimit) {
+                DIE << "Stack overflow: needs " << size << " slots, limit "
+                    << stackLimit << ".";
+            }
+
+            auto newSize = std::min(std::max({size, stack.size() * 2,
+                                              (size_t)STACK_INITIAL_SIZE}),
+                                    stackLimit);
+
+            auto oldBase = stack.data();
+            stack.resize(newSize);
+            auto newBase = stack.data();
+
+            sp = newBase + (sp - oldBase);
+            bp = newBase + (bp - oldBase);
+
+            for (auto frame = frames.data(); frame != fp; frame++) {
+                frame->bp = newBase + (frame->bp - oldBase);
+            }
+
+            for (auto upvalue = openUpvalues; upvalue != nullptr; upvalue = upvalue->next) {
+                upvalue->location = newBase + (upvalue->location - oldBase);
+            }
+
+            stackEnd = newBase + stack.size();
+        }
+
+        /**
+         * Grows the call frames (same limit as the stack: each frame
+         * takes at least one slot).
+         */
+        void growFrames() {
+            if (frames.size() >= stackLimit) {
+                DIE << "Call: frames overflow.";
+            }
+
+            auto index = fp - frames.data();
+            frames.resize(std::min(std::max(frames.size() * 2, (size_t)STACK_INITIAL_SIZE),
+                                   stackLimit));
+            fp = frames.data() + index;
+        }
 
         /**
-         * Operands stack.
+         * Returns the open upvalue of the stack slot, creating it if needed
+         * (closures capturing the same variable share the upvalue).
          */
-        std::array<ChrisValue, STACK_LIMIT> stack;
+        Upvalue* captureUpvalue(ChrisValue* slot) {
+            Upvalue* prev = nullptr;
+            auto upvalue = openUpvalues;
+
+            // Sorted by slot, the innermost first.
+            while (upvalue != nullptr && upvalue->location > slot) {
+                prev = upvalue;
+                upvalue = upvalue->next;
+            }
+
+            if (upvalue != nullptr && upvalue->location == slot) {
+                return upvalue;
+            }
+
+            auto created = allocObject<Upvalue>(slot);
+            created->next = upvalue;
+
+            if (prev == nullptr) {
+                openUpvalues = created;
+            } else {
+                prev->next = created;
+            }
+
+            return created;
+        }
 
         /**
-         * Code object.
+         * Closes the upvalues of the slots starting from `last`: the
+         * values move from the stack into the upvalues.
+         */
+        void closeUpvalues(ChrisValue* last) {
+            while (openUpvalues != nullptr && openUpvalues->location >= last) {
+                auto upvalue = openUpvalues;
+                upvalue->closed = *upvalue->location;
+                upvalue->location = &upvalue->closed;
+                openUpvalues = upvalue->next;
+            }
+        }
+
+        /**
+         * Returns the function called with the arguments on the stack.
+         */
+        FunctionObject* getCallee(size_t argsCount) {
+            auto fnValue = peek(argsCount);
+
+            if (!IS_CALLABLE(fnValue)) {
+                DIE << "Call: " << chrisValueToConstantString(fnValue)
+                    << " is not a function";
+            }
+
+            auto callee = AS_FUNCTION(fnValue);
+
+            if (callee->co->arity != argsCount) {
+                DIE << "Call: " << callee->co->name << " expects "
+                    << callee->co->arity << " arguments, got " << argsCount;
+            }
+
+            return callee;
+        }
+
+        /**
+         * Calls the native with the arguments on the stack, replacing the
+         * callee and the arguments with the result.
+         */
+        void callNative(size_t argsCount) {
+            auto native = AS_NATIVE(peek(argsCount));
+
+            if (native->arity != NATIVE_VARIADIC && (size_t)native->arity != argsCount) {
+                DIE << "Call: " << native->name << " expects " << native->arity
+                    << " arguments, got " << argsCount;
+            }
+
+            // Arguments are passed in place (no copies).
+            auto args = sp - argsCount;
+            auto result = native->function(args, argsCount);
+
+            sp = args;
+            sp[-1] = result;
+        }
+
+        /**
+         * Restores the caller frame.
+         */
+        void returnToCaller() {
+            if (fp == frames.data()) {
+                DIE << "Return outside of a function.";
+            }
+
+            --fp;
+            ip = fp->ra;
+            bp = fp->bp;
+            co = fp->co;
+            closure = fp->closure;
+        }
+
+        /**
+         * Checks the value is an array.
+         */
+        ArrayObject* toArray(const ChrisValue& value, const char* op) {
+            if (!IS_ARRAY(value)) {
+                DIE << op << ": expected an array, got "
+                    << chrisValueToTypeString(value);
+            }
+            return AS_ARRAY(value);
+        }
+
+        /**
+         * Checks the value is a numeric array (bulk operations).
+         */
+        ArrayObject* toNumericArray(const ChrisValue& value, const char* op) {
+            auto array = toArray(value, op);
+            if (!array->isNumeric) {
+                DIE << op << ": expected a numeric array";
+            }
+            return array;
+        }
+
+        /**
+         * Checks the value is an integer in [0, size).
+         */
+        size_t toIndex(const ChrisValue& value, size_t size) {
+            if (!IS_INT(value) || AS_INT(value) < 0 || (size_t)AS_INT(value) >= size) {
+                DIE << "Array index " << chrisValueToConstantString(value)
+                    << " out of range [0, " << size << ")";
+            }
+            return AS_INT(value);
+        }
+
+        /**
+         * Converts a numeric array to a generic one.
+         */
+        void generalizeArray(ArrayObject* array) {
+            array->values.reserve(array->numbers.size());
+            for (auto number : array->numbers) {
+                array->values.push_back(NUMBER(number));
+            }
+            array->numbers = std::vector<double>();
+            array->isNumeric = false;
+        }
+
+        /**
+         * Returns an array element.
+         */
+        ChrisValue arrayGet(ArrayObject* array, size_t index) {
+            return array->isNumeric ? NUMBER(array->numbers[index]) : array->values[index];
+        }
+
+        /**
+         * Sets an array element.
+         */
+        void arraySet(ArrayObject* array, size_t index, const ChrisValue& value) {
+            if (array->isNumeric) {
+                if (IS_NUMERIC(value)) {
+                    array->numbers[index] = AS_DOUBLE(value);
+                    return;
+                }
+                generalizeArray(array);
+            }
+            array->values[index] = value;
+        }
+
+        /**
+         * Appends an element.
+         */
+        void arrayPush(ArrayObject* array, const ChrisValue& value) {
+            if (array->size() == ARRAY_SIZE_LIMIT) {
+                DIE << "array-push: array is too large";
+            }
+            if (array->isNumeric) {
+                if (IS_NUMERIC(value)) {
+                    array->numbers.push_back(AS_DOUBLE(value));
+                    return;
+                }
+                generalizeArray(array);
+            }
+            array->values.push_back(value);
+        }
+
+        /**
+         * Checks the value is a map.
+         */
+        MapObject* toMap(const ChrisValue& value, const char* op) {
+            if (!IS_MAP(value)) {
+                DIE << op << ": expected a map, got " << chrisValueToTypeString(value);
+            }
+            return AS_MAP(value);
+        }
+
+        /**
+         * Checks and normalizes a map key.
+         */
+        ChrisValue toMapKey(const ChrisValue& value, const char* op) {
+            if (!MapObject::isKey(value)) {
+                DIE << op << ": " << chrisValueToTypeString(value) << " can't be a key";
+            }
+            return MapObject::normalizeKey(value);
+        }
+
+        /**
+         * Integer division, fails (returns true) unless the quotient is
+         * an exact integer.
+         */
+        static bool checkedDiv(int64_t a, int64_t b, int64_t* result) {
+            if (b == 0 || (a == INT64_MIN && b == -1) || a % b != 0) {
+                return true;
+            }
+            *result = a / b;
+            return false;
+        }
+
+        /**
+         * Closure of the callee (nullptr for plain functions).
+         */
+        static ClosureObject* calleeClosure(FunctionObject* callee) {
+            return callee->type == ObjectType::CLOSURE ? (ClosureObject*)callee : nullptr;
+        }
+
+        /**
+         * Verifies the code objects of the last compilation (the main
+         * code starting from the entry offset).
+         */
+        void verify(size_t entry) {
+            for (auto code : compiler->getCodeObjects()) {
+                auto isMain = code == co;
+
+                // Function frames start with the callee and the arguments.
+                auto maxDepth = verifier->verify(code, isMain ? entry : 0,
+                                                 isMain ? 0 : code->arity + 1);
+
+                if (maxDepth > stackLimit) {
+                    COMPILE_ERROR << code->name << ": stack overflow, needs "
+                        << maxDepth << " slots.";
+                }
+
+                code->maxStackDepth = maxDepth;
+
+                // Arms the new loops.
+                for (auto& loop : code->loops) {
+                    if (loop.osrAt == 0) {
+                        loop.osrAt = osrThreshold;
+                    }
+                }
+
+                if (!code->loops.empty() &&
+                    std::find(loopCode.begin(), loopCode.end(), code) == loopCode.end()) {
+                    loopCode.push_back(code);
+                }
+            }
+        }
+
+        /**
+         * The loop crossed the hot threshold (ip follows its header): lets
+         * the on-stack replacement hook take it over.
+         */
+        void enterHotLoop(LoopInfo& loop) {
+            loop.hot = true;
+
+            if (!osrHook) {
+                return;
+            }
+
+            auto entry = osrHook(co, &loop - co->loops.data(), ip - co->code.data());
+            if (entry.code == nullptr) {
+                loop.osrAt *= 2;
+                return;
+            }
+
+            loop.replacements++;
+            co = entry.code;
+            ip = &co->code[entry.offset];
+            ensureStack(co->maxStackDepth);
+        }
+
+        /**
+         * Keeps the statistics of the main code loops dropped by the
+         * incremental rewinds.
+         */
+        void retireDroppedLoops() {
+            auto& dropped = compiler->getDroppedLoops();
+            for (const auto& loop : dropped) {
+                retiredLoops.push_back({"main", loop.location, loop.iterations, loop.hot,
+                                        loop.replacements});
+            }
+            dropped.clear();
+        }
+
+        /**
+         * Aggregates the recorded samples while the line tables they
+         * refer to are still current (before compiling).
+         */
+        void drainProfiler() {
+            if (profiler != nullptr) {
+                profiler->drain();
+            }
+        }
+
+        /**
+         * Records the call stack (the current instruction and the return
+         * addresses of the frames) into the profiler. Called at the
+         * safepoints, after the opcode is read.
+         */
+        void recordSample() {
+            samplePending = 0;
+
+            if (profiler == nullptr) {
+                return;
+            }
+
+            auto sample = profiler->acquire();
+            if (sample == nullptr) {
+                return;
+            }
+
+            uint32_t depth = 0;
+            sample->frames[depth++] = {co, (uint32_t)(ip - co->code.data() - 1)};
+
+            auto frame = fp;
+            while (frame != frames.data() && depth < PROFILER_MAX_DEPTH) {
+                --frame;
+                // The return address follows the call instruction.
+                auto callOffset = frame->ra - frame->co->code.data() - 1;
+                sample->frames[depth++] = {frame->co, (uint32_t)callOffset};
+            }
+
+            sample->depth = depth;
+            sample->truncated = frame != frames.data();
+
+            profiler->publish();
+
+            if (profiler->needsDrain()) {
+                profiler->drain();
+            }
+        }
+
+        /**
+         * Runs an exec function, catching errors into `error`.
+         */
+        template <typename ExecFn>
+        bool catchErrors(ExecFn exec, ChrisValue& result) {
+            try {
+                result = exec();
+                return true;
+            } catch (const ChrisError& e) {
+                error = e;
+                if (e.type == ErrorType::RUNTIME && co != nullptr) {
+                    error.offset = (int)(ip - &co->code[0]) - 1;
+                    auto location = co->lines.find(error.offset);
+                    error.line = location.line;
+                    error.column = location.column;
+                }
+                return false;
+            }
+        }
+
+    public:
+
+        /**
+         * Main eval loop (separate instances record the trace, count
+         * instructions and cache the top of the stack, so the plain loop
+         * pays nothing for them).
+         */
+        ChrisValue eval() {
+            if (tracer != nullptr) {
+                return countInstructions ? evalLoop<true, true, false>()
+                                         : evalLoop<true, false, false>();
+            }
+            if (stackCaching) {
+                return countInstructions ? evalLoop<false, true, true>()
+                                         : evalLoop<false, false, true>();
+            }
+            return countInstructions ? evalLoop<false, true, false>()
+                                     : evalLoop<false, false, false>();
+        }
+
+        /**
+         * With CACHE, the hot stack opcodes (constants, variables, math,
+         * comparisons, jumps) keep the top of the stack in `tos`: e.g.
+         * a binary op reads one operand from memory instead of popping
+         * two and pushing the result. The other opcodes spill it first.
+         */
+        template <bool TRACE, bool COUNT, bool CACHE>
+        ChrisValue evalLoop() {
+            InstructionCounter counter{instructionCount};
+
+            // Cached top of the stack (valid in the TOS_CACHED state).
+            ChrisValue tos{};
+            unsigned state = 0;
+
+            for (;;) {
+                if constexpr (TRACE) {
+                    tracer->record(co, ip, stack.data(), sp);
+                }
+                if constexpr (COUNT) {
+                    counter.count++;
+                }
+
+                auto opcode = READ_BYTE();
+
+            dispatch:
+                switch (CACHE ? opcode | state : opcode) {
+                    case OP_HALT:
+                        return pop();
+
+                    case OP_HALT | TOS_CACHED:
+                        return tos;
+
+                    // ---------------------
+                    // Constants:
+                    case OP_CONST:
+                        if constexpr (CACHE) {
+                            tos = GET_CONST();
+                            state = TOS_CACHED;
+                        } else {
+                            push(GET_CONST());
+                        }
+                        break;
+
+                    case OP_CONST | TOS_CACHED: {
+                        auto value = GET_CONST();
+                        push(tos);
+                        tos = value;
+                        break;
+                    }
+
+                    case OP_CONST_WIDE:
+                        if constexpr (CACHE) {
+                            tos = GET_CONST_WIDE();
+                            state = TOS_CACHED;
+                        } else {
+                            push(GET_CONST_WIDE());
+                        }
+                        break;
+
+                    case OP_CONST_WIDE | TOS_CACHED: {
+                        auto value = GET_CONST_WIDE();
+                        push(tos);
+                        tos = value;
+                        break;
+                    }
+
+                    // ---------------------
+                    // Math ops:
+                    case OP_ADD: {
+                        auto op2 = pop();
+                        auto op1 = pop();
+                        ChrisValue result;
+                        ADD_VALUES(op1, op2, result);
+                        push(result);
+                        break;
+                    }
+
+                    case OP_ADD | TOS_CACHED: {
+                        auto op1 = pop();
+                        ADD_VALUES(op1, tos, tos);
+                        break;
+                    }
+
+                    case OP_SUB: {
+                        auto op2 = pop();
+                        auto op1 = pop();
+                        ChrisValue result;
+                        BINARY_OP(-, __builtin_sub_overflow, op1, op2, result);
+                        push(result);
+                        break;
+                    }
+
+                    case OP_SUB | TOS_CACHED: {
+                        auto op1 = pop();
+                        BINARY_OP(-, __builtin_sub_overflow, op1, tos, tos);
+                        break;
+                    }
+
+                    case OP_MUL: {
+                        auto op2 = pop();
+                        auto op1 = pop();
+                        ChrisValue result;
+                        BINARY_OP(*, __builtin_mul_overflow, op1, op2, result);
+                        push(result);
+                        break;
+                    }
+
+                    case OP_MUL | TOS_CACHED: {
+                        auto op1 = pop();
+                        BINARY_OP(*, __builtin_mul_overflow, op1, tos, tos);
+                        break;
+                    }
+
+                    // Exact integer quotients stay integers.
+                    case OP_DIV: {
+                        auto op2 = pop();
+                        auto op1 = pop();
+                        ChrisValue result;
+                        BINARY_OP(/, checkedDiv, op1, op2, result);
+                        push(result);
+                        break;
+                    }
+
+                    case OP_DIV | TOS_CACHED: {
+                        auto op1 = pop();
+                        BINARY_OP(/, checkedDiv, op1, tos, tos);
+                        break;
+                    }
+
+                    // Comparison
+                    case OP_COMPARE: {
+                        auto op = READ_BYTE();
+                        auto op2 = pop();
+                        auto op1 = pop();
+                        ChrisValue result;
+                        COMPARE_OP(op, op1, op2, result);
+                        push(result);
+                        break;
+                    }
+
+                    case OP_COMPARE | TOS_CACHED: {
+                        auto op = READ_BYTE();
+                        auto op1 = pop();
+                        COMPARE_OP(op, op1, tos, tos);
+                        break;
+                    }
+
+                    // ---------------------
+                    // Conditional jump:
+                    case OP_JMP_IF_FALSE: {
+                        PROFILER_SAFEPOINT();
+                        auto value = pop();
+                        if (!IS_BOOLEAN(value)) {
+                            DIE << "Condition is not a boolean";
+                        }
+                        auto cond = AS_BOOLEAN(value);
+
+                        auto address = READ_SHORT();
+
+                        if (!cond) {
+                            ip = TO_ADDRESS(address);
+                        }
+                        
+                        break;
+                    }
+
+                    case OP_JMP_IF_FALSE | TOS_CACHED: {
+                        PROFILER_SAFEPOINT();
+                        if (!IS_BOOLEAN(tos)) {
+                            DIE << "Condition is not a boolean";
+                        }
+                        auto cond = AS_BOOLEAN(tos);
+
+                        // Popping the cached top only changes the state.
+                        state = 0;
+
+                        auto address = READ_SHORT();
+
+                        if (!cond) {
+                            ip = TO_ADDRESS(address);
+                        }
+
+                        break;
+                    }
+
+                    case OP_JMP_IF_TRUE: {
+                        PROFILER_SAFEPOINT();
+                        auto value = pop();
+                        if (!IS_BOOLEAN(value)) {
+                            DIE << "Condition is not a boolean";
+                        }
+                        auto address = READ_SHORT();
+
+                        if (AS_BOOLEAN(value)) {
+                            ip = TO_ADDRESS(address);
+                        }
+
+                        break;
+                    }
+
+                    case OP_JMP_IF_TRUE | TOS_CACHED: {
+                        PROFILER_SAFEPOINT();
+                        if (!IS_BOOLEAN(tos)) {
+                            DIE << "Condition is not a boolean";
+                        }
+                        state = 0;
+
+                        auto address = READ_SHORT();
+
+                        if (AS_BOOLEAN(tos)) {
+                            ip = TO_ADDRESS(address);
+                        }
+
+                        break;
+                    }
+
+                    // ---------------------
+                    // Global variable value:
+                    case OP_GET_GLOBAL: {
+                        auto globalIndex = READ_BYTE();
+                        if constexpr (CACHE) {
+                            tos = global->get(globalIndex).value;
+                            state = TOS_CACHED;
+                        } else {
+                            push(global->get(globalIndex).value);
+                        }
+                        break;
+                    }
+
+                    case OP_GET_GLOBAL | TOS_CACHED: {
+                        auto value = global->get(READ_BYTE()).value;
+                        push(tos);
+                        tos = value;
+                        break;
+                    }
+
+                    case OP_SET_GLOBAL: {
+                        auto globalIndex = READ_BYTE();
+                        global->get(globalIndex).value = peek(0);
+                        break;
+                    }
+
+                    case OP_SET_GLOBAL | TOS_CACHED:
+                        global->get(READ_BYTE()).value = tos;
+                        break;
+
+                    // ---------------------
+                    // Stack manipulation:
+                    case OP_POP:
+                        pop();
+                        break;
+
+                    case OP_POP | TOS_CACHED:
+                        state = 0;
+                        break;
+
+                    // ---------------------
+                    // Local variables (frame-relative stack slots):
+                    case OP_GET_LOCAL: {
+                        auto localIndex = READ_BYTE();
+                        if constexpr (CACHE) {
+                            tos = bp[localIndex];
+                            state = TOS_CACHED;
+                        } else {
+                            push(bp[localIndex]);
+                        }
+                        break;
+                    }
+
+                    case OP_GET_LOCAL | TOS_CACHED: {
+                        auto slot = bp + READ_BYTE();
+                        // The local may be the cached top itself.
+                        auto value = slot == sp ? tos : *slot;
+                        push(tos);
+                        tos = value;
+                        break;
+                    }
+
+                    case OP_SET_LOCAL: {
+                        auto localIndex = READ_BYTE();
+                        bp[localIndex] = peek(0);
+                        break;
+                    }
+
+                    case OP_SET_LOCAL | TOS_CACHED: {
+                        auto slot = bp + READ_BYTE();
+                        if (slot != sp) {
+                            *slot = tos;
+                        }
+                        break;
+                    }
+
+                    // ---------------------
+                    // Scope exit (clean up block locals):
+                    case OP_SCOPE_EXIT: {
+                        auto count = READ_BYTE();
+
+                        // Captured locals outlive the scope:
+                        closeUpvalues(sp - 1 - count);
+
+                        // Move the result below the locals:
+                        *(sp - 1 - count) = peek(0);
+
+                        popN(count);
+                        break;
+                    }
+
+                    case OP_SCOPE_EXIT | TOS_CACHED: {
+                        auto count = READ_BYTE();
+
+                        // The result is cached: the locals are the top
+                        // of the stack memory, only dropped.
+                        closeUpvalues(sp - count);
+                        popN(count);
+                        break;
+                    }
+
+                    // ---------------------
+                    // Function calls:
+                    case OP_NATIVE_CALL:
+                        PROFILER_SAFEPOINT();
+                        if (IS_NATIVE(peek(*ip))) {
+                            callNative(READ_BYTE());
+                            break;
+                        }
+                        // The global was rebound to a Chris function:
+                        [[fallthrough]];
+
+                    case OP_CALL: {
+                        PROFILER_SAFEPOINT();
+                        auto argsCount = READ_BYTE();
+
+                        // Natives passed around as values:
+                        if (IS_NATIVE(peek(argsCount))) {
+                            callNative(argsCount);
+                            break;
+                        }
+
+                        auto callee = getCallee(argsCount);
+
+                        if (fp == frames.data() + frames.size()) {
+                            growFrames();
+                        }
+
+                        // The callee frame starts at the function itself. Made
+                        // room for before switching frames, so a stack overflow
+                        // is reported at the call.
+                        ensureStack(sp - argsCount - 1 - bp + callee->co->maxStackDepth);
+
+                        // Save the caller:
+                        *fp++ = Frame{ip, bp, co, closure};
+
+                        // The arguments stay in place.
+                        co = callee->co;
+                        closure = calleeClosure(callee);
+                        bp = sp - argsCount - 1;
+                        ip = &co->code[0];
+                        break;
+                    }
+
+                    // ---------------------
+                    // Tail call: reuses the current frame.
+                    case OP_TAIL_CALL: {
+                        PROFILER_SAFEPOINT();
+                        auto argsCount = READ_BYTE();
+
+                        // Captured locals of the current frame outlive it:
+                        closeUpvalues(bp);
+
+                        // A native has no frame: return its result.
+                        if (IS_NATIVE(peek(argsCount))) {
+                            callNative(argsCount);
+                            *bp = peek(0);
+                            sp = bp + 1;
+                            returnToCaller();
+                            break;
+                        }
+
+                        auto callee = getCallee(argsCount);
+
+                        // The frame is reused from its base (made room for
+                        // at the call, see OP_CALL).
+                        ensureStack(callee->co->maxStackDepth);
+
+                        // Move the callee and the arguments down to the
+                        // frame base, discarding the current frame slots.
+                        auto frameStart = sp - argsCount - 1;
+                        if (frameStart != bp) {
+                            std::copy(frameStart, sp, bp);
+                            sp = bp + argsCount + 1;
+                        }
+
+                        co = callee->co;
+                        closure = calleeClosure(callee);
+                        ip = &co->code[0];
+                        break;
+                    }
+
+                    // ---------------------
+                    // Return from a function (the result stays on top,
+                    // cached or not):
+                    case OP_RETURN:
+                    case OP_RETURN | TOS_CACHED: {
+                        PROFILER_SAFEPOINT();
+                        returnToCaller();
+                        break;
+                    }
+
+                    // ---------------------
+                    // Arrays:
+                    case OP_ARRAY: {
+                        auto count = READ_BYTE();
+                        auto value = ALLOC_ARRAY();
+                        auto array = AS_ARRAY(value);
+
+                        for (auto element = sp - count; element != sp; element++) {
+                            arrayPush(array, *element);
+                        }
+
+                        popN(count);
+                        push(value);
+                        break;
+                    }
+
+                    case OP_MAKE_ARRAY: {
+                        auto init = pop();
+                        auto size = pop();
+
+                        if (!IS_INT(size) || AS_INT(size) < 0 || AS_INT(size) > ARRAY_SIZE_LIMIT) {
+                            DIE << "make-array: invalid size " << chrisValueToConstantString(size);
+                        }
+
+                        auto value = ALLOC_ARRAY();
+                        auto array = AS_ARRAY(value);
+
+                        if (IS_NUMERIC(init)) {
+                            array->numbers.assign(AS_INT(size), AS_DOUBLE(init));
+                        } else {
+                            array->isNumeric = false;
+                            array->values.assign(AS_INT(size), init);
+                        }
+
+                        push(value);
+                        break;
+                    }
+
+                    case OP_ARRAY_GET: {
+                        auto index = pop();
+                        auto array = toArray(pop(), "array-get");
+                        push(arrayGet(array, toIndex(index, array->size())));
+                        break;
+                    }
+
+                    case OP_ARRAY_SET: {
+                        auto value = pop();
+                        auto index = pop();
+                        auto array = toArray(pop(), "array-set");
+                        arraySet(array, toIndex(index, array->size()), value);
+                        push(value);
+                        break;
+                    }
+
+                    case OP_ARRAY_LENGTH: {
+                        auto array = toArray(pop(), "array-length");
+                        push(INT((int64_t)array->size()));
+                        break;
+                    }
+
+                    case OP_ARRAY_PUSH: {
+                        auto value = pop();
+                        auto array = toArray(peek(0), "array-push");
+                        arrayPush(array, value);
+                        break;
+                    }
+
+                    // ---------------------
+                    // Bulk array operations:
+                    case OP_ARRAY_SUM: {
+                        auto array = toNumericArray(pop(), "array-sum");
+
+                        double sum = 0;
+                        for (auto number : array->numbers) {
+                            sum += number;
+                        }
+
+                        push(NUMBER(sum));
+                        break;
+                    }
+
+                    case OP_ARRAY_ADD: {
+                        auto scalar = pop();
+                        auto array = toNumericArray(pop(), "array-add");
+
+                        if (!IS_NUMERIC(scalar)) {
+                            DIE << "array-add: expected a number";
+                        }
+
+                        auto value = ALLOC_ARRAY();
+                        auto& numbers = AS_ARRAY(value)->numbers;
+                        auto addend = AS_DOUBLE(scalar);
+
+                        numbers.resize(array->numbers.size());
+                        for (size_t i = 0; i < numbers.size(); i++) {
+                            numbers[i] = array->numbers[i] + addend;
+                        }
+
+                        push(value);
+                        break;
+                    }
+
+                    case OP_ARRAY_DOT: {
+                        auto array2 = toNumericArray(pop(), "array-dot");
+                        auto array1 = toNumericArray(pop(), "array-dot");
+
+                        if (array1->numbers.size() != array2->numbers.size()) {
+                            DIE << "array-dot: arrays of different sizes";
+                        }
+
+                        double dot = 0;
+                        for (size_t i = 0; i < array1->numbers.size(); i++) {
+                            dot += array1->numbers[i] * array2->numbers[i];
+                        }
+
+                        push(NUMBER(dot));
+                        break;
+                    }
+
+                    // ---------------------
+                    // Hash maps:
+                    case OP_MAP: {
+                        auto count = READ_BYTE();
+                        auto value = ALLOC_MAP();
+                        auto map = AS_MAP(value);
+
+                        for (auto pair = sp - count; pair != sp; pair += 2) {
+                            auto key = toMapKey(pair[0], "hash-map");
+                            map->set(key, MapObject::hashKey(key), pair[1]);
+                        }
+
+                        popN(count);
+                        push(value);
+                        break;
+                    }
+
+                    case OP_MAP_GET: {
+                        auto key = toMapKey(pop(), "map-get");
+                        auto map = toMap(pop(), "map-get");
+
+                        auto entry = map->find(key, MapObject::hashKey(key));
+                        if (entry == nullptr) {
+                            DIE << "map-get: key " << chrisValueToConstantString(key)
+                                << " not found";
+                        }
+
+                        push(entry->value);
+                        break;
+                    }
+
+                    case OP_MAP_SET: {
+                        auto value = pop();
+                        auto key = toMapKey(pop(), "map-set");
+                        auto map = toMap(pop(), "map-set");
+
+                        map->set(key, MapObject::hashKey(key), value);
+                        push(value);
+                        break;
+                    }
+
+                    case OP_MAP_HAS: {
+                        auto key = toMapKey(pop(), "map-has");
+                        auto map = toMap(pop(), "map-has");
+                        push(BOOLEAN(map->find(key, MapObject::hashKey(key)) != nullptr));
+                        break;
+                    }
+
+                    case OP_MAP_SIZE: {
+                        auto map = toMap(pop(), "map-size");
+                        push(INT((int64_t)map->count));
+                        break;
+                    }
+
+                    // ---------------------
+                    // Captured variables:
+                    case OP_GET_UPVALUE: {
+                        auto upvalueIndex = READ_BYTE();
+                        push(*closure->upvalues[upvalueIndex]->location);
+                        break;
+                    }
+
+                    case OP_SET_UPVALUE: {
+                        auto upvalueIndex = READ_BYTE();
+                        *closure->upvalues[upvalueIndex]->location = peek(0);
+                        break;
+                    }
+
+                    // ---------------------
+                    // Closure creation:
+                    case OP_CLOSURE: {
+                        auto fnCo = AS_FUNCTION(GET_CONST())->co;
+                        auto value = ALLOC_CLOSURE(fnCo);
+                        auto created = AS_CLOSURE(value);
+
+                        for (const auto& upvalue : fnCo->upvalues) {
+                            created->upvalues.push_back(upvalue.isLocal
+                                ? captureUpvalue(bp + upvalue.index)
+                                : closure->upvalues[upvalue.index]);
+                        }
+
+                        push(value);
+                        break;
+                    }
+
+                    // ---------------------
+                    // Loop header (the stack is untouched):
+                    case OP_LOOP:
+                    case OP_LOOP | TOS_CACHED: {
+                        auto& loop = co->loops[READ_BYTE()];
+                        if (++loop.iterations == loop.osrAt) {
+                            enterHotLoop(loop);
+                        }
+                        break;
+                    }
+
+                    // ---------------------
+                    // Unconditional jump:
+                    case OP_JMP:
+                    case OP_JMP | TOS_CACHED: {
+                        PROFILER_SAFEPOINT();
+                        ip = TO_ADDRESS(READ_SHORT());
+                        break;
+                    }
+                    
+                    default:
+                        // Opcodes without a cached version: spill the top
+                        // and run the uncached one.
+                        if (CACHE && state == TOS_CACHED) {
+                            push(tos);
+                            state = 0;
+                            goto dispatch;
+                        }
+                        DIE << "Unknown opcode: " << std::hex << (int)opcode;
+                }
+            }
+        }
+
+        /**
+         * Heap (declared first: destroyed after everything referencing
+         * the objects).
+         */
+        std::unique_ptr<Heap> heap;
+
+        /**
+         * Global object.
+         */
+        std::shared_ptr<Global> global;
+
+        /**
+         * Parser.
+         */
+        std::unique_ptr<ChrisParser> parser;
+
+        /**
+         * Compiler.
+         */
+        std::unique_ptr<ChrisCompiler> compiler;
+
+        /**
+         * Bytecode verifier.
+         */
+        std::unique_ptr<ChrisVerifier> verifier;
+
+        /**
+         * Instruction pointer (aka Program counter).
+         */
+        uint8_t* ip;
+
+        /**
+         * Stack pointer.
+         */
+        ChrisValue* sp;
+
+        /**
+         * Base pointer (aka Frame pointer): locals are addressed
+         * relative to it.
+         */
+        ChrisValue* bp;
+
+        /**
+         * Operands stack (grows on demand).
+         */
+        std::vector<ChrisValue> stack;
+
+        /**
+         * End of the allocated stack.
+         */
+        ChrisValue* stackEnd = nullptr;
+
+        /**
+         * Max stack size in slots.
+         */
+        size_t stackLimit;
+
+        /**
+         * Frame pointer (next free call frame).
+         */
+        Frame* fp;
+
+        /**
+         * Call frames stack (grows on demand).
+         */
+        std::vector<Frame> frames;
+
+        /**
+         * Code object.
+         */
+        CodeObject* co = nullptr;
+
+        /**
+         * Running closure (nullptr for the main code and plain functions).
+         */
+        ClosureObject* closure = nullptr;
+
+        /**
+         * Open upvalues (captured variables still on the stack), sorted
+         * by stack slot, the innermost first.
+         */
+        Upvalue* openUpvalues = nullptr;
+
+        /**
+         * Metrics registry (nullptr if disabled).
+         */
+        ChrisMetrics* metrics = nullptr;
+
+        /**
+         * Whether the eval loop caches the top of the stack (on by
+         * default, off for A/B comparisons).
+         */
+        bool stackCaching = true;
+
+        /**
+         * Whether the eval loop counts instructions (into
+         * `instructionCount`), set for the runs with metrics.
+         */
+        bool countInstructions = false;
+
+        size_t instructionCount = 0;
+
+        /**
+         * Execution tracer (nullptr if not tracing).
+         */
+        ChrisTracer* tracer = nullptr;
+
+        /**
+         * Main code rewinds already reported to the tracer.
+         */
+        size_t tracedRewinds = 0;
+
+        /**
+         * Active profiler (nullptr if not profiling).
+         */
+        ChrisProfiler* profiler = nullptr;
+
+        /**
+         * Raised by the profiler signal handler, checked at the
+         * safepoints.
+         */
+        volatile std::sig_atomic_t samplePending = 0;
+
+        /**
+         * On-stack replacement of hot loops.
+         */
+        OsrHook osrHook;
+        uint64_t osrThreshold = OSR_THRESHOLD;
+
+        /**
+         * Code objects with loops (for the statistics).
+         */
+        std::vector<CodeObject*> loopCode;
+
+        /**
+         * Statistics of the loops dropped with the incremental main code.
+         */
+        std::vector<LoopStats> retiredLoops;
+
+        /**
+         * Last error (filled in by tryExec).
          */
-        CodeObject* co;
+        ChrisError error;
 };
 
 #endif
\ No newline at end of file
@@ -5,13 +5,21 @@
 #ifndef ChrisValue_h
 #define ChrisValue_h
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <string>
+#include <vector>
+
+#include "../bytecode/LineTable.h"
+#include "Heap.h"
 
 /**
  * Chris value type.
  */
 enum class ChrisValueType {
     NUMBER,
+    INT,
     BOOLEAN,
     OBJECT,
 };
@@ -22,6 +30,12 @@ enum class ChrisValueType {
 enum class ObjectType {
     STRING,
     CODE,
+    FUNCTION,
+    CLOSURE,
+    NATIVE,
+    ARRAY,
+    MAP,
+    UPVALUE,
 };
 
 /**
@@ -39,6 +53,11 @@ struct StringObject : public Object {
     StringObject(const std::string& str)
         : Object(ObjectType::STRING), string(str) {}
     std::string string;
+
+    /**
+     * Cached hash (strings are immutable), 0 if not computed yet.
+     */
+    uint32_t hash = 0;
 };
 
 /**
@@ -48,22 +67,91 @@ struct ChrisValue {
     ChrisValueType type;
     union {
         double number;
+        int64_t integer;
         bool boolean;
         Object* object;
     };
 };
 
+/**
+ * Local variable.
+ */
+struct LocalVar {
+    std::string name;
+    size_t scopeLevel;
+
+    /**
+     * Stack slot (relative to the frame base pointer).
+     */
+    size_t slot;
+};
+
+/**
+ * Captured variable of a function (compile time).
+ */
+struct UpvalueInfo {
+    std::string name;
+
+    /**
+     * Whether it captures a local of the enclosing function (otherwise
+     * an upvalue of the enclosing function).
+     */
+    bool isLocal;
+
+    /**
+     * Local slot or upvalue index in the enclosing function.
+     */
+    size_t index;
+};
+
+/**
+ * Loop of a code object: its header (OP_LOOP) counts the iterations.
+ */
+struct LoopInfo {
+    /**
+     * Source location of the loop.
+     */
+    SourceLocation location;
+
+    /**
+     * Executed iterations: the header runs (the final test included),
+     * over all the entries of the loop.
+     */
+    uint64_t iterations = 0;
+
+    /**
+     * Whether the loop crossed the hot threshold, and the times a faster
+     * tier took it over (on-stack replacement).
+     */
+    bool hot = false;
+    uint32_t replacements = 0;
+
+    /**
+     * Iterations at which the on-stack replacement hook is called next
+     * (set by the VM, 0 until the code is verified).
+     */
+    uint64_t osrAt = 0;
+};
+
+class ProgramMetrics;
+
 /**
  * Code object.
  */
 struct CodeObject: public Object {
-    CodeObject(const std::string& name) : Object(ObjectType::CODE), name(name) {}
+    CodeObject(const std::string& name, size_t arity = 0)
+        : Object(ObjectType::CODE), name(name), arity(arity) {}
 
     /**
      * Name of the unit (usually function name).
      */
     std::string name;
 
+    /**
+     * Number of parameters.
+     */
+    size_t arity;
+
     /**
      * Constant pool.
      */
@@ -73,22 +161,217 @@ struct CodeObject: public Object {
      * Bytecode.
      */
     std::vector<uint8_t> code;
+
+    /**
+     * Source locations of the bytecode (kept off the code vector).
+     */
+    LineTable lines;
+
+    /**
+     * Metrics of the program (main code objects, if enabled).
+     */
+    ProgramMetrics* metrics = nullptr;
+
+    /**
+     * Max operand stack depth of a frame, including the callee and the
+     * arguments (computed by the verifier).
+     */
+    size_t maxStackDepth = 0;
+
+    /**
+     * Current scope level (compile time).
+     */
+    size_t scopeLevel = 0;
+
+    /**
+     * Local variables in scope (compile time).
+     */
+    std::vector<LocalVar> locals;
+
+    /**
+     * Adds a local with the current scope level.
+     */
+    void addLocal(const std::string& name, size_t slot) {
+        locals.push_back({name, scopeLevel, slot});
+    }
+
+    /**
+     * Returns the slot of the innermost local with the name, -1 if not found.
+     */
+    int getLocalIndex(const std::string& name) {
+        for (int i = (int)locals.size() - 1; i >= 0; i--) {
+            if (locals[i].name == name) {
+                return locals[i].slot;
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * Loops (indexed by the OP_LOOP operand).
+     */
+    std::vector<LoopInfo> loops;
+
+    /**
+     * Captured variables, in the order of the closure upvalues.
+     */
+    std::vector<UpvalueInfo> upvalues;
+
+    /**
+     * Returns the index of the upvalue with the name, -1 if not found.
+     */
+    int getUpvalueIndex(const std::string& name) {
+        for (size_t i = 0; i < upvalues.size(); i++) {
+            if (upvalues[i].name == name) {
+                return i;
+            }
+        }
+        return -1;
+    }
+};
+
+/**
+ * Function object.
+ */
+struct FunctionObject : public Object {
+    FunctionObject(CodeObject* co, ObjectType type = ObjectType::FUNCTION)
+        : Object(type), co(co) {}
+
+    /**
+     * Reference to the code object: contains function code, locals, etc.
+     */
+    CodeObject* co;
+};
+
+/**
+ * Captured variable (runtime).
+ *
+ * While the frame of the variable is live the upvalue is "open" and
+ * points to the stack slot, so reads and writes are shared with the
+ * frame. When the slot goes away the value is moved into the upvalue
+ * itself ("closed"). Upvalues are internal objects (never values).
+ */
+struct Upvalue : public Object {
+    Upvalue(ChrisValue* location) : Object(ObjectType::UPVALUE), location(location) {}
+
+    /**
+     * Stack slot (open) or `closed` (closed).
+     */
+    ChrisValue* location;
+
+    /**
+     * Value after the slot is gone.
+     */
+    ChrisValue closed;
+
+    /**
+     * Next open upvalue (lower stack slot).
+     */
+    Upvalue* next = nullptr;
+};
+
+/**
+ * Closure object: a function with its captured variables.
+ *
+ * Upvalues are flat (one per captured variable, no environment chain),
+ * variables captured from outer functions are shared through the
+ * enclosing closure at creation time.
+ */
+struct ClosureObject : public FunctionObject {
+    ClosureObject(CodeObject* co) : FunctionObject(co, ObjectType::CLOSURE) {
+        upvalues.reserve(co->upvalues.size());
+    }
+
+    std::vector<Upvalue*> upvalues;
+};
+
+/**
+ * Native function: receives a view of the arguments on the operand stack
+ * (valid only during the call).
+ */
+using NativeFn = ChrisValue (*)(const ChrisValue* args, size_t argsCount);
+
+/**
+ * Arity of natives accepting any number of arguments.
+ */
+#define NATIVE_VARIADIC -1
+
+/**
+ * Native (host) function object.
+ */
+struct NativeObject : public Object {
+    NativeObject(NativeFn function, const std::string& name, int arity)
+        : Object(ObjectType::NATIVE), function(function), name(name), arity(arity) {}
+
+    NativeFn function;
+
+    std::string name;
+
+    /**
+     * Number of parameters (NATIVE_VARIADIC for any).
+     */
+    int arity;
+};
+
+/**
+ * Array object.
+ *
+ * Numeric arrays store the elements as a contiguous double[], so bulk
+ * operations run as plain C++ loops. Storing a non-numeric value turns
+ * the array into a generic ChrisValue[] (`isNumeric` is false).
+ */
+struct ArrayObject : public Object {
+    ArrayObject() : Object(ObjectType::ARRAY) {}
+
+    bool isNumeric = true;
+
+    /**
+     * Elements of a numeric array.
+     */
+    std::vector<double> numbers;
+
+    /**
+     * Elements of a generic array.
+     */
+    std::vector<ChrisValue> values;
+
+    /**
+     * Number of elements.
+     */
+    size_t size() const { return isNumeric ? numbers.size() : values.size(); }
 };
 
 // ------------------------------------------------------------------------
 // Constructors:
 #define NUMBER(value) ((ChrisValue) { .type = ChrisValueType::NUMBER, .number = value})
+#define INT(value) ((ChrisValue) { .type = ChrisValueType::INT, .integer = value})
 #define BOOLEAN(value) ((ChrisValue) { .type = ChrisValueType::BOOLEAN, .boolean = value})
 
 #define ALLOC_STRING(value) \
-    ((ChrisValue) { .type = ChrisValueType::OBJECT, .object = (Object*)new StringObject(value)})
+    ((ChrisValue) { .type = ChrisValueType::OBJECT, .object = (Object*)allocObject<StringObject>(value)})
 
-#define ALLOC_CODE(name) \
-    ((ChrisValue) { .type = ChrisValueType::OBJECT, .object = (Object*) new CodeObject(name)})
+#define ALLOC_CODE(name, arity) \
+    ((ChrisValue) { .type = ChrisValueType::OBJECT, .object = (Object*)allocObject<CodeObject>(name, arity)})
+
+#define ALLOC_FUNCTION(co) \
+    ((ChrisValue) { .type = ChrisValueType::OBJECT, .object = (Object*)allocObject<FunctionObject>(co)})
+
+#define ALLOC_CLOSURE(co) \
+    ((ChrisValue) { .type = ChrisValueType::OBJECT, .object = (Object*)allocObject<ClosureObject>(co)})
+
+#define ALLOC_ARRAY() \
+    ((ChrisValue) { .type = ChrisValueType::OBJECT, .object = (Object*)allocObject<ArrayObject>()})
+
+#define ALLOC_MAP() \
+    ((ChrisValue) { .type = ChrisValueType::OBJECT, .object = (Object*)allocObject<MapObject>()})
+
+#define ALLOC_NATIVE(fn, name, arity) \
+    ((ChrisValue) { .type = ChrisValueType::OBJECT, .object = (Object*)allocObject<NativeObject>(fn, name, arity)})
 
 // ------------------------------------------------------------------------
 // Accessors:
 #define AS_NUMBER(chrisValue) ((double)(chrisValue).number)
+#define AS_INT(chrisValue) ((int64_t)(chrisValue).integer)
 #define AS_BOOLEAN(chrisValue) ((bool)(chrisValue).boolean)
 #define AS_OBJECT(chrisValue) ((Object*)(chrisValue).object)
 
@@ -96,10 +379,16 @@ struct CodeObject: public Object {
 #define AS_CPPSTRING(chrisValue) (AS_STRING(chrisValue)->string)
 
 #define AS_CODE(chrisValue) ((CodeObject*)(chrisValue).object)
+#define AS_FUNCTION(chrisValue) ((FunctionObject*)(chrisValue).object)
+#define AS_CLOSURE(chrisValue) ((ClosureObject*)(chrisValue).object)
+#define AS_NATIVE(chrisValue) ((NativeObject*)(chrisValue).object)
+#define AS_ARRAY(chrisValue) ((ArrayObject*)(chrisValue).object)
+#define AS_MAP(chrisValue) ((MapObject*)(chrisValue).object)
 
 // ------------------------------------------------------------------------
 // Testers:
 #define IS_NUMBER(chrisValue) ((chrisValue).type == ChrisValueType::NUMBER)
+#define IS_INT(chrisValue) ((chrisValue).type == ChrisValueType::INT)
 #define IS_BOOLEAN(chrisValue) ((chrisValue).type == ChrisValueType::BOOLEAN)
 #define IS_OBJECT(chrisValue) ((chrisValue).type == ChrisValueType::OBJECT)
 
@@ -108,6 +397,276 @@ struct CodeObject: public Object {
 
 #define IS_STRING(chrisValue) IS_OBJECT_TYPE(chrisValue, ObjectType::STRING)
 #define IS_CODE(chrisValue) IS_OBJECT_TYPE(chrisValue, ObjectType::CODE)
+#define IS_FUNCTION(chrisValue) IS_OBJECT_TYPE(chrisValue, ObjectType::FUNCTION)
+#define IS_CLOSURE(chrisValue) IS_OBJECT_TYPE(chrisValue, ObjectType::CLOSURE)
+#define IS_NATIVE(chrisValue) IS_OBJECT_TYPE(chrisValue, ObjectType::NATIVE)
+#define IS_ARRAY(chrisValue) IS_OBJECT_TYPE(chrisValue, ObjectType::ARRAY)
+#define IS_MAP(chrisValue) IS_OBJECT_TYPE(chrisValue, ObjectType::MAP)
+
+// Functions and closures (AS_FUNCTION works on both).
+#define IS_CALLABLE(chrisValue) (IS_FUNCTION(chrisValue) || IS_CLOSURE(chrisValue))
+
+// Numbers and integers.
+#define IS_NUMERIC(chrisValue) (IS_NUMBER(chrisValue) || IS_INT(chrisValue))
+
+// Numeric value as double (integers are converted).
+#define AS_DOUBLE(chrisValue) \
+    (IS_INT(chrisValue) ? (double)AS_INT(chrisValue) : AS_NUMBER(chrisValue))
+
+/**
+ * Map entry.
+ */
+struct MapEntry {
+    ChrisValue key;
+    ChrisValue value;
+
+    /**
+     * Cached key hash.
+     */
+    uint32_t hash;
+
+    /**
+     * Probe distance from the home slot + 1 (0 for empty slots).
+     */
+    uint32_t distance;
+};
+
+/**
+ * Hash map object keyed by strings, numbers and booleans.
+ *
+ * Open addressing with linear Robin Hood probing: on insert, an entry
+ * further from its home slot takes the place of a closer one, which
+ * keeps probe sequences short and lets lookups of missing keys stop
+ * early. Key hashes are stored in the entries, so probing compares
+ * hashes and only compares keys on a hash match.
+ */
+struct MapObject : public Object {
+    MapObject() : Object(ObjectType::MAP) {}
+
+    /**
+     * Min capacity (power of 2).
+     */
+    static constexpr size_t MIN_CAPACITY = 8;
+
+    /**
+     * Max load factor: MAX_LOAD_NUM / MAX_LOAD_DEN. Lookups stay short at
+     * higher loads, but the entries shifted by Robin Hood inserts grow
+     * quickly past 3/4.
+     */
+    static constexpr size_t MAX_LOAD_NUM = 3;
+    static constexpr size_t MAX_LOAD_DEN = 4;
+
+    /**
+     * Whether the value can be a key.
+     */
+    static bool isKey(const ChrisValue& key) {
+        return IS_INT(key) || IS_NUMBER(key) || IS_BOOLEAN(key) || IS_STRING(key);
+    }
+
+    /**
+     * Normalizes numeric keys: integral doubles are the same key as INTs.
+     */
+    static ChrisValue normalizeKey(const ChrisValue& key) {
+        if (IS_NUMBER(key) && AS_NUMBER(key) > -9.2e18 && AS_NUMBER(key) < 9.2e18 &&
+            (double)(int64_t)AS_NUMBER(key) == AS_NUMBER(key)) {
+            return INT((int64_t)AS_NUMBER(key));
+        }
+        return key;
+    }
+
+    /**
+     * Hash of a (normalized) key.
+     */
+    static uint32_t hashKey(const ChrisValue& key) {
+        uint64_t bits;
+
+        if (IS_STRING(key)) {
+            auto str = AS_STRING(key);
+            if (str->hash == 0) {
+                // FNV-1a.
+                uint32_t hash = 2166136261u;
+                for (auto c : str->string) {
+                    hash = (hash ^ (uint8_t)c) * 16777619u;
+                }
+                str->hash = hash;
+            }
+            return str->hash;
+        } else if (IS_INT(key)) {
+            bits = (uint64_t)AS_INT(key);
+        } else if (IS_NUMBER(key)) {
+            auto number = AS_NUMBER(key);
+            std::memcpy(&bits, &number, sizeof(bits));
+        } else {
+            bits = AS_BOOLEAN(key) ? 0x9e3779b9u : 0x7f4a7c15u;
+        }
+
+        // splitmix64 finalizer.
+        bits = (bits ^ (bits >> 30)) * 0xbf58476d1ce4e5b9ull;
+        bits = (bits ^ (bits >> 27)) * 0x94d049bb133111ebull;
+        return (uint32_t)(bits ^ (bits >> 31));
+    }
+
+    /**
+     * Whether the (normalized) keys are equal.
+     */
+    static bool keysEqual(const ChrisValue& a, const ChrisValue& b) {
+        if (a.type != b.type) {
+            return false;
+        }
+        if (IS_INT(a)) {
+            return AS_INT(a) == AS_INT(b);
+        } else if (IS_NUMBER(a)) {
+            return AS_NUMBER(a) == AS_NUMBER(b);
+        } else if (IS_BOOLEAN(a)) {
+            return AS_BOOLEAN(a) == AS_BOOLEAN(b);
+        }
+        return AS_OBJECT(a) == AS_OBJECT(b) || AS_CPPSTRING(a) == AS_CPPSTRING(b);
+    }
+
+    /**
+     * Returns the entry of the key, nullptr if not found.
+     */
+    MapEntry* find(const ChrisValue& key, uint32_t hash) {
+        if (count == 0) {
+            return nullptr;
+        }
+
+        auto mask = entries.size() - 1;
+
+        for (uint32_t i = hash & mask, distance = 1;; i = (i + 1) & mask, distance++) {
+            auto& entry = entries[i];
+
+            // An empty slot, or an entry closer to its home than the key
+            // would be: the key is not in the table.
+            if (entry.distance < distance) {
+                return nullptr;
+            }
+
+            if (entry.hash == hash && keysEqual(entry.key, key)) {
+                return &entry;
+            }
+        }
+    }
+
+    /**
+     * Sets the value of the key.
+     */
+    void set(const ChrisValue& key, uint32_t hash, const ChrisValue& value) {
+        if ((count + 1) * MAX_LOAD_DEN > entries.size() * MAX_LOAD_NUM) {
+            grow();
+        }
+
+        MapEntry inserted{key, value, hash, 1};
+        auto mask = entries.size() - 1;
+
+        for (uint32_t i = hash & mask;; i = (i + 1) & mask, inserted.distance++) {
+            auto& entry = entries[i];
+
+            if (entry.distance == 0) {
+                entry = inserted;
+                count++;
+                return;
+            }
+
+            if (entry.hash == inserted.hash && keysEqual(entry.key, inserted.key)) {
+                entry.value = inserted.value;
+                return;
+            }
+
+            // Robin Hood: the entry closer to its home moves on.
+            if (entry.distance < inserted.distance) {
+                std::swap(entry, inserted);
+                inserted.distance++;
+                insertNew(inserted, (i + 1) & mask);
+                return;
+            }
+        }
+    }
+
+    /**
+     * Doubles the capacity, reinserting the entries.
+     */
+    void grow() {
+        std::vector<MapEntry> old(std::max(entries.size() * 2, MIN_CAPACITY));
+        old.swap(entries);
+        count = 0;
+
+        auto mask = entries.size() - 1;
+
+        for (auto entry : old) {
+            if (entry.distance != 0) {
+                entry.distance = 1;
+                insertNew(entry, entry.hash & mask);
+            }
+        }
+    }
+
+    /**
+     * Places an entry whose key is known to be absent (no key compares),
+     * probing from the slot.
+     */
+    void insertNew(MapEntry inserted, uint32_t i) {
+        auto mask = entries.size() - 1;
+
+        for (;; i = (i + 1) & mask) {
+            auto& entry = entries[i];
+
+            if (entry.distance == 0) {
+                entry = inserted;
+                count++;
+                return;
+            }
+
+            if (entry.distance < inserted.distance) {
+                std::swap(entry, inserted);
+            }
+
+            inserted.distance++;
+        }
+    }
+
+    /**
+     * Number of entries.
+     */
+    size_t count = 0;
+
+    /**
+     * Slots (capacity is a power of 2).
+     */
+    std::vector<MapEntry> entries;
+};
+
+/**
+ * Destroys an object in place (the memory stays with the heap).
+ */
+void destroyObject(Object* object) {
+    switch (object->type) {
+        case ObjectType::STRING:
+            ((StringObject*)object)->~StringObject();
+            break;
+        case ObjectType::CODE:
+            ((CodeObject*)object)->~CodeObject();
+            break;
+        case ObjectType::FUNCTION:
+            ((FunctionObject*)object)->~FunctionObject();
+            break;
+        case ObjectType::CLOSURE:
+            ((ClosureObject*)object)->~ClosureObject();
+            break;
+        case ObjectType::NATIVE:
+            ((NativeObject*)object)->~NativeObject();
+            break;
+        case ObjectType::ARRAY:
+            ((ArrayObject*)object)->~ArrayObject();
+            break;
+        case ObjectType::MAP:
+            ((MapObject*)object)->~MapObject();
+            break;
+        case ObjectType::UPVALUE:
+            ((Upvalue*)object)->~Upvalue();
+            break;
+    }
+}
 
 /**
  * String representation used in constants for debug.
@@ -115,12 +674,24 @@ struct CodeObject: public Object {
 std::string chrisValueToTypeString(const ChrisValue &chrisValue) {
     if (IS_NUMBER(chrisValue)) {
         return "NUMBER";
+    } else if (IS_INT(chrisValue)) {
+        return "INT";
     } else if (IS_BOOLEAN(chrisValue)) {
         return "BOOLEAN";
     } else if (IS_STRING(chrisValue)) {
         return "STRING";
     } else if (IS_CODE(chrisValue)) {
         return "CODE";
+    } else if (IS_FUNCTION(chrisValue)) {
+        return "FUNCTION";
+    } else if (IS_CLOSURE(chrisValue)) {
+        return "CLOSURE";
+    } else if (IS_NATIVE(chrisValue)) {
+        return "NATIVE";
+    } else if (IS_ARRAY(chrisValue)) {
+        return "ARRAY";
+    } else if (IS_MAP(chrisValue)) {
+        return "MAP";
     } else {
         DIE << "chrisValueToTypeString: unknown type " << (int)chrisValue.type;
     }
@@ -134,6 +705,8 @@ std::string chrisValueToConstantString(const ChrisValue &chrisValue) {
     std::stringstream ss;
     if (IS_NUMBER(chrisValue)) {
         ss << chrisValue.number;
+    } else if (IS_INT(chrisValue)) {
+        ss << chrisValue.integer;
     } else if (IS_BOOLEAN(chrisValue)) {
         ss << (chrisValue.boolean == true ? "true" : "false");
     } else if (IS_STRING(chrisValue)) {
@@ -141,6 +714,52 @@ std::string chrisValueToConstantString(const ChrisValue &chrisValue) {
     } else if (IS_CODE(chrisValue)) {
         auto code = AS_CODE(chrisValue);
         ss << "code " << code << ": " << code->name;
+    } else if (IS_CALLABLE(chrisValue)) {
+        auto fn = AS_FUNCTION(chrisValue);
+        ss << fn->co->name << "/" << fn->co->arity;
+    } else if (IS_NATIVE(chrisValue)) {
+        auto fn = AS_NATIVE(chrisValue);
+        ss << "native " << fn->name << "/";
+        if (fn->arity == NATIVE_VARIADIC) {
+            ss << "*";
+        } else {
+            ss << fn->arity;
+        }
+    } else if (IS_ARRAY(chrisValue)) {
+        auto array = AS_ARRAY(chrisValue);
+        ss << "[";
+        for (size_t i = 0; i < array->size(); i++) {
+            ss << (i > 0 ? ", " : "");
+            if (array->isNumeric) {
+                ss << array->numbers[i];
+            } else if (IS_ARRAY(array->values[i])) {
+                // Nested arrays are not expanded (arrays may be cyclic).
+                ss << "[...]";
+            } else {
+                ss << chrisValueToConstantString(array->values[i]);
+            }
+        }
+        ss << "]";
+    } else if (IS_MAP(chrisValue)) {
+        auto map = AS_MAP(chrisValue);
+        auto first = true;
+        ss << "{";
+        for (const auto& entry : map->entries) {
+            if (entry.distance == 0) {
+                continue;
+            }
+            ss << (first ? "" : ", ") << chrisValueToConstantString(entry.key) << ": ";
+            // Nested containers are not expanded (they may be cyclic).
+            if (IS_MAP(entry.value)) {
+                ss << "{...}";
+            } else if (IS_ARRAY(entry.value)) {
+                ss << "[...]";
+            } else {
+                ss << chrisValueToConstantString(entry.value);
+            }
+            first = false;
+        }
+        ss << "}";
     } else {
         DIE << "chrisValueToConstantString: unkown type " << (int)chrisValue.type;
     }
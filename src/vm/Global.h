@@ -0,0 +1,109 @@
+/**
+ * Global object.
+ */
+
+#ifndef Global_h
+#define Global_h
+
+#include <string>
+#include <vector>
+
+#include "../Logger.h"
+#include "ChrisValue.h"
+
+/**
+ * Max number of globals (OP_GET_GLOBAL has a 1-byte index).
+ */
+#define GLOBALS_LIMIT 256
+
+/**
+ * Global var.
+ */
+struct GlobalVar {
+    std::string name;
+    ChrisValue value;
+};
+
+/**
+ * Global object.
+ *
+ * Globals are resolved to slots at compile time, the VM only accesses
+ * them by index.
+ */
+struct Global {
+    /**
+     * Returns a global.
+     */
+    GlobalVar& get(size_t index) { return globals[index]; }
+
+    /**
+     * Sets a global.
+     */
+    void set(size_t index, const ChrisValue& value) {
+        if (index >= globals.size()) {
+            DIE << "Global " << index << " doesn't exist.";
+        }
+        globals[index].value = value;
+    }
+
+    /**
+     * Registers a global (or returns the slot of an existing one).
+     */
+    size_t define(const std::string& name) {
+        auto index = getGlobalIndex(name);
+
+        // Already defined.
+        if (index != -1) {
+            return index;
+        }
+
+        if (globals.size() == GLOBALS_LIMIT) {
+            COMPILE_ERROR << "Too many globals.";
+        }
+
+        // Set to default number 0.
+        globals.push_back({name, NUMBER(0)});
+        return globals.size() - 1;
+    }
+
+    /**
+     * Drops the globals registered after the first `count` (failed
+     * compilation).
+     */
+    void truncate(size_t count) {
+        globals.erase(globals.begin() + count, globals.end());
+    }
+
+    /**
+     * Registers a global with a value.
+     */
+    size_t addConst(const std::string& name, const ChrisValue& value) {
+        auto index = define(name);
+        globals[index].value = value;
+        return index;
+    }
+
+    /**
+     * Returns the slot of a global, -1 if not found.
+     */
+    int getGlobalIndex(const std::string& name) {
+        for (int i = (int)globals.size() - 1; i >= 0; i--) {
+            if (globals[i].name == name) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * Whether a global variable exists.
+     */
+    bool exists(const std::string& name) { return getGlobalIndex(name) != -1; }
+
+    /**
+     * Global variables and functions.
+     */
+    std::vector<GlobalVar> globals;
+};
+
+#endif
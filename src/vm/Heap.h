@@ -0,0 +1,305 @@
+/**
+ * VM heap: size-class pool allocator for objects.
+ */
+
+#ifndef Heap_h
+#define Heap_h
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <new>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+/**
+ * Allocation granularity (and the smallest size class) in bytes.
+ */
+#define HEAP_GRANULARITY 16
+
+/**
+ * Number of size classes: HEAP_GRANULARITY .. HEAP_MAX_OBJECT_SIZE.
+ */
+#define HEAP_SIZE_CLASSES 16
+
+/**
+ * Max object size served by the pools.
+ */
+#define HEAP_MAX_OBJECT_SIZE (HEAP_GRANULARITY * HEAP_SIZE_CLASSES)
+
+/**
+ * Slots in the first slab of a class (slabs double up to the max size).
+ */
+#define HEAP_MIN_SLAB_SLOTS 16
+
+/**
+ * Max slab size in bytes.
+ */
+#define HEAP_MAX_SLAB_SIZE (64 * 1024)
+
+struct Object;
+
+/**
+ * Destroys an object in place (defined with the object types).
+ */
+void destroyObject(Object* object);
+
+/**
+ * Per size class counters.
+ */
+struct SizeClassStats {
+    /**
+     * Slot size in bytes.
+     */
+    size_t size;
+
+    size_t liveObjects;
+    size_t liveBytes;
+
+    /**
+     * Bytes taken by the slabs of the class.
+     */
+    size_t reservedBytes;
+};
+
+/**
+ * Heap: objects are carved from slabs, with a free list per size class.
+ *
+ * Each VM owns a heap, and each thread has a default heap for objects
+ * created outside of a VM, so allocation never takes a lock (a VM must
+ * be used by one thread at a time). Objects are released all at once
+ * when the heap is destroyed.
+ */
+class Heap {
+    public:
+    Heap() {
+        for (size_t i = 0; i < HEAP_SIZE_CLASSES; i++) {
+            classes[i].stats = {(i + 1) * HEAP_GRANULARITY, 0, 0, 0};
+        }
+    }
+
+    ~Heap() { release(); }
+
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
+    /**
+     * Allocates memory for an object of the size.
+     */
+    void* allocate(size_t size) {
+        auto& sizeClass = classes[classIndex(size)];
+
+        void* slot;
+
+        if (sizeClass.freeList != nullptr) {
+            auto node = sizeClass.freeList;
+            sizeClass.freeList = node->next;
+            slot = node;
+        } else {
+            if (sizeClass.slabs.empty() ||
+                sizeClass.slabs.back().used == sizeClass.slabs.back().slots) {
+                addSlab(sizeClass);
+            }
+            auto& slab = sizeClass.slabs.back();
+            slot = slab.memory + slab.used * sizeClass.stats.size;
+            slab.used++;
+        }
+
+        sizeClass.stats.liveObjects++;
+        sizeClass.stats.liveBytes += sizeClass.stats.size;
+        allocations++;
+
+        return slot;
+    }
+
+    /**
+     * Destroys an object and returns its slot to the free list.
+     */
+    void free(Object* object, size_t size) {
+        destroyObject(object);
+
+        auto& sizeClass = classes[classIndex(size)];
+        auto node = (FreeNode*)object;
+        node->marker = FREE_MARKER;
+        node->next = sizeClass.freeList;
+        sizeClass.freeList = node;
+
+        sizeClass.stats.liveObjects--;
+        sizeClass.stats.liveBytes -= sizeClass.stats.size;
+    }
+
+    /**
+     * Destroys all live objects and frees the slabs.
+     */
+    void release() {
+        for (auto& sizeClass : classes) {
+            for (auto& slab : sizeClass.slabs) {
+                for (size_t i = 0; i < slab.used; i++) {
+                    auto slot = slab.memory + i * sizeClass.stats.size;
+                    if (!isFree(slot)) {
+                        destroyObject((Object*)slot);
+                    }
+                }
+                ::operator delete(slab.memory);
+            }
+
+            sizeClass.slabs.clear();
+            sizeClass.freeList = nullptr;
+            sizeClass.stats.liveObjects = 0;
+            sizeClass.stats.liveBytes = 0;
+            sizeClass.stats.reservedBytes = 0;
+        }
+    }
+
+    /**
+     * Counters of the size class.
+     */
+    const SizeClassStats& stats(size_t classIndex) const {
+        return classes[classIndex].stats;
+    }
+
+    /**
+     * Live objects of all classes.
+     */
+    size_t liveObjects() const {
+        size_t total = 0;
+        for (const auto& sizeClass : classes) {
+            total += sizeClass.stats.liveObjects;
+        }
+        return total;
+    }
+
+    /**
+     * Live bytes of all classes.
+     */
+    size_t liveBytes() const {
+        size_t total = 0;
+        for (const auto& sizeClass : classes) {
+            total += sizeClass.stats.liveBytes;
+        }
+        return total;
+    }
+
+    /**
+     * Objects allocated since the heap was created (never decreases).
+     */
+    size_t allocationsCount() const { return allocations; }
+
+    /**
+     * Prints the counters of the used classes.
+     */
+    void printStats(std::ostream& os) const {
+        os << std::setw(6) << "size" << std::setw(10) << "objects"
+            << std::setw(12) << "bytes" << std::setw(12) << "reserved" << "\n";
+        for (const auto& sizeClass : classes) {
+            const auto& stats = sizeClass.stats;
+            if (stats.reservedBytes == 0) {
+                continue;
+            }
+            os << std::setw(6) << stats.size << std::setw(10) << stats.liveObjects
+                << std::setw(12) << stats.liveBytes << std::setw(12)
+                << stats.reservedBytes << "\n";
+        }
+    }
+
+    /**
+     * Heap of the running VM on this thread (the thread default heap
+     * outside of VMs).
+     */
+    static Heap*& current() {
+        thread_local Heap defaultHeap;
+        thread_local Heap* currentHeap = &defaultHeap;
+        return currentHeap;
+    }
+
+    private:
+    /**
+     * Free slot. The marker overlays Object::type, so the slab walk
+     * of `release` can tell free slots from live objects.
+     */
+    struct FreeNode {
+        uint32_t marker;
+        FreeNode* next;
+    };
+
+    static constexpr uint32_t FREE_MARKER = 0xFFFFFFFF;
+
+    /**
+     * Slab: a block of equal slots, used from the start.
+     */
+    struct Slab {
+        uint8_t* memory;
+        size_t slots;
+        size_t used;
+    };
+
+    struct SizeClass {
+        std::vector<Slab> slabs;
+        FreeNode* freeList = nullptr;
+        SizeClassStats stats;
+    };
+
+    /**
+     * Size class index of the size.
+     */
+    static size_t classIndex(size_t size) {
+        return (size + HEAP_GRANULARITY - 1) / HEAP_GRANULARITY - 1;
+    }
+
+    /**
+     * Whether the slot is on the free list.
+     */
+    static bool isFree(const uint8_t* slot) {
+        uint32_t marker;
+        std::memcpy(&marker, slot, sizeof(marker));
+        return marker == FREE_MARKER;
+    }
+
+    /**
+     * Adds a slab to the class, twice as large as the previous one.
+     */
+    void addSlab(SizeClass& sizeClass) {
+        auto size = sizeClass.stats.size;
+        auto maxSlots = HEAP_MAX_SLAB_SIZE / size;
+
+        size_t slots = HEAP_MIN_SLAB_SLOTS;
+        if (!sizeClass.slabs.empty()) {
+            slots = std::min(sizeClass.slabs.back().slots * 2, maxSlots);
+        }
+
+        auto memory = (uint8_t*)::operator new(slots * size);
+        sizeClass.slabs.push_back({memory, slots, 0});
+        sizeClass.stats.reservedBytes += slots * size;
+    }
+
+    std::array<SizeClass, HEAP_SIZE_CLASSES> classes;
+
+    size_t allocations = 0;
+};
+
+/**
+ * Makes the heap current on this thread for the scope.
+ */
+class HeapScope {
+    public:
+    HeapScope(Heap* heap) : previous(Heap::current()) { Heap::current() = heap; }
+    ~HeapScope() { Heap::current() = previous; }
+
+    private:
+    Heap* previous;
+};
+
+/**
+ * Allocates an object on the current heap.
+ */
+template <typename T, typename... Args>
+T* allocObject(Args&&... args) {
+    static_assert(sizeof(T) <= HEAP_MAX_OBJECT_SIZE, "object too large for the heap");
+    static_assert(alignof(T) <= HEAP_GRANULARITY, "object alignment not supported");
+    return new (Heap::current()->allocate(sizeof(T))) T(std::forward<Args>(args)...);
+}
+
+#endif
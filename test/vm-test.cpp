@@ -0,0 +1,117 @@
+/**
+ * VM regression tests (REPL sessions and runtime errors).
+ *
+ *   make test
+ */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../src/vm/ChrisVM.h"
+
+static int failures = 0;
+
+/**
+ * Reports a failed expectation.
+ */
+void expect(const std::string& test, const std::string& actual, const std::string& expected) {
+    if (actual != expected) {
+        std::cerr << "FAIL " << test << ": got \"" << actual << "\", expected \""
+            << expected << "\"\n";
+        failures++;
+    }
+}
+
+/**
+ * Runs the lines as a REPL session (one expression per line), returns
+ * the printed result or error of each.
+ */
+std::vector<std::string> repl(ChrisVM& vm, const std::vector<std::string>& lines) {
+    std::vector<std::string> output;
+    ChrisValue result;
+    for (size_t i = 0; i < lines.size(); i++) {
+        std::ostringstream os;
+        if (vm.tryExecIncremental(lines[i], result, i + 1)) {
+            os << chrisValueToConstantString(result);
+        } else {
+            os << vm.error;
+        }
+        output.push_back(os.str());
+    }
+    return output;
+}
+
+/**
+ * A function that fails to compile is not defined.
+ */
+void testFailedDefinition() {
+    ChrisVM vm;
+    auto output = repl(vm, {
+        "(def h () (nope))",
+        "h",
+        "(var v (nope))",
+        "v",
+        "(def h () 5)",
+        "(h)",
+    });
+    expect("failed def", output[1], "Compile error at 2:0: Reference error: h");
+    expect("failed var", output[3], "Compile error at 4:0: Reference error: v");
+    expect("def after failed def", output[5], "5");
+}
+
+/**
+ * Lowering the OSR threshold below the iterations a loop already ran
+ * makes it hot on the next iteration.
+ */
+void testLoweredOsrThreshold() {
+    ChrisVM vm;
+    size_t calls = 0;
+    vm.setOsrHook([&](CodeObject* code, size_t loop, size_t offset) -> OsrEntry {
+        calls++;
+        return {nullptr, 0};
+    });
+
+    repl(vm, {
+        "(def count (n) (begin (var i 0) (while (< i n) (set i (+ i 1))) i))",
+        "(count 500)",
+    });
+    expect("cold loop", std::to_string(calls), "0");
+
+    vm.setOsrThreshold(100);
+    repl(vm, {"(count 10)"});
+    expect("lowered threshold", std::to_string(calls), "1");
+    expect("hot loop", std::to_string(vm.getLoopStats()[0].hot), "1");
+}
+
+/**
+ * A stack overflow is reported at the call that needed the frame.
+ */
+void testStackOverflowLocation() {
+    ChrisVM vm;
+    auto output = repl(vm, {
+        "(def deep (n) (if (== n 0) 0 (+ 1 (deep (- n 1)))))",
+        "",
+        "",
+        "(deep 1000000)",
+        "(deep 10)",
+    });
+    expect("stack overflow", output[3],
+           "Runtime error at 1:34 at offset 19: Stack overflow: needs 1048578 slots, "
+           "limit 1048576.");
+    expect("run after stack overflow", output[4], "10");
+}
+
+int main(int argc, char const *argv[]) {
+    testFailedDefinition();
+    testLoweredOsrThreshold();
+    testStackOverflowLocation();
+
+    if (failures > 0) {
+        std::cerr << failures << " failed\n";
+        return 1;
+    }
+    std::cout << "All tests passed.\n";
+    return 0;
+}